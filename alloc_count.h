@@ -0,0 +1,65 @@
+/**
+ * @file: alloc_count.h
+ *
+ * Counts the heap allocations, to check that the path of each frame
+ * doesn't allocate once it's warmed up. Built with -DCOUNT_ALLOCATIONS,
+ * the global operator new is replaced by one that counts its calls, in
+ * total and per thread; without it the counters are always 0 and nothing
+ * is replaced. It replaces a global operator, so it must be included by
+ * a single translation unit of the program.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+#include <atomic>
+#include <new>
+
+#include <cstdlib>
+#include <stdint.h>
+
+/// Frames checked by a worker before its allocations are counted.
+#define ALLOCATION_WARMUP	100000
+
+#ifdef COUNT_ALLOCATIONS
+
+static std::atomic<uint64_t> heapAllocations( 0 );	///< Calls to operator new.
+static thread_local uint64_t threadAllocations = 0;	///< Calls of this thread.
+
+void* operator new( size_t n )
+{
+	void *p = malloc( n ? n : 1 );
+
+	if( !p )
+		throw std::bad_alloc();
+	heapAllocations.fetch_add( 1, std::memory_order_relaxed );
+	threadAllocations++;
+	return p;
+}
+
+__attribute__((noinline)) void operator delete( void *p ) noexcept
+{
+	free( p );
+}
+
+/** @return The heap allocations of the program so far. */
+inline uint64_t allocationCount(){ return heapAllocations; }
+
+/** @return The heap allocations of the calling thread so far. */
+inline uint64_t threadAllocationCount(){ return threadAllocations; }
+
+#else
+
+inline uint64_t allocationCount(){ return 0; }
+inline uint64_t threadAllocationCount(){ return 0; }
+
+#endif
+
+#endif
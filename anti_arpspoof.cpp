@@ -7,9 +7,9 @@
  
 /* 
  * Compilation:
- * 	g++ -o anti_arpspoof anti_arpspoof.cpp -std=c++11
+ * 	g++ -o anti_arpspoof anti_arpspoof.cpp -std=c++11 -pthread
  * or
- * 	make anti_arpspoof CXXFLAGS=-std=c++11	
+ * 	make anti_arpspoof CXXFLAGS="-std=c++11 -pthread"	
  *
  *
  * This program is free software; you can redistribute it and/or modify
@@ -19,16 +19,21 @@
  */
 
 #include <iostream>
-#include <iomanip>
+#include <fstream>
+#include <algorithm>
 #include <map>
 #include <set>
 #include <string>
-#include <sstream>
+#include <vector>
 #include <stdexcept>
 #include <atomic>
+#include <thread>
+#include <mutex>
 using namespace std;
 
 #include <cstring>
+#include <cstdlib>
+#include <cstdio>
 #include <cerrno>
 
 #include <sys/types.h>
@@ -37,107 +42,51 @@ using namespace std;
 #include <net/if.h>
 #include <linux/if_packet.h>
 #include <linux/if_arp.h>
+#include <linux/filter.h>
 #include <net/ethernet.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <signal.h>
+#include <getopt.h>
 
-/// Length in bytes of one Hardware Address.
-#define MAC_ADDR_LEN	6
+#include "anti_arpspoof.h"
+#include "sweeper.h"
+#include "table_file.h"
+#include "guard.h"
 
-/// Length in bytes of one IP Address.
-#define IP_ADDR_LEN		4
+/// Requests per second sent by scan(), by default.
+#define SCAN_RATE	1000
 
-/// Defines the IP 0.0.0.1.
-#define IP_ONE		htonl( 1 )
+/// Records between the capture and the analysis thread of a pipeline.
+#define PIPELINE_DEPTH	4096
 
-/// The maximum number of attempts to resolve a HW Address.
-#define MAX_TRIES_FOR_RESOLV	5
-
-// ===============================
-// Global variables
-// ===============================
-atomic<bool> active( true ); ///< Controls the guard() function.
+/// Background sweeps in a row that a host must miss to leave the table.
+#define DEPART_AFTER_SWEEPS	3
 
+/// Minimum time in seconds between the start of two background sweeps.
+#define RESCAN_MIN_PERIOD	60
 
 
 // ===============================
-// Data types
+// Global variables
 // ===============================
+atomic<bool> active( true ); ///< Controls the guard() function.
+atomic<bool> dumpRequested( false ); ///< The stage profile must be printed, see sigDump().
+mutex promptLock; ///< Serializes the questions to the user between workers.
+ScanMetrics scanMetrics; ///< The state of the scans, for the metrics endpoint.
 
-/**
- * Stores a MAC Address
- */
-struct HWAddr{
-	uint8_t hw[MAC_ADDR_LEN];
-
-	/**
-	 * Creates an HWAddr object from an array of bytes with length size of 6.
-	 *
-	 * @param m The array with the 6 bytes of the HW Address.
-	 */
-	HWAddr( const uint8_t m[] ){
-		memcpy( hw, m, MAC_ADDR_LEN );
-	}
-
-	bool operator < ( const HWAddr &m ) const {
-		return memcmp( hw, m.hw, MAC_ADDR_LEN ) < 0;
-	}
-
-	/**
-	 * Get a string representation of the HW Address in
-	 * the format xx:xx:xx:xx:xx:xx.
-	 *
-	 * @return The string representation of the HW Address.
-	 */
-	string toString() const {
-		ostringstream out;
-
-		out << hex << setfill( '0' ) << setw( 2 );
-		for( int i = 0 ; i < MAC_ADDR_LEN ; ){
-			out << static_cast<int>( hw[i] );
-			if( hw[i] == 0 )
-				out << 0;
-			if( ++i != MAC_ADDR_LEN )
-				out << ':';
-		}
-		return out.str();
-	}
-
+/** The ways guard() can receive frames from the ARP socket. */
+enum RecvBackend{
+	BACKEND_READ,		///< One recv() per frame, see ReadSource.
+	BACKEND_MMSG,		///< recvmmsg() in batches, see MmsgSource.
+	BACKEND_TPACKET,	///< TPACKET_V3 ring, see TPacketSource.
+	BACKEND_URING		///< io_uring multishot recv, see URingSource.
 };
 
-/**
- * The representation of a ARP Frame including the 
- * ethernet header.
- */
-struct ARPFrame{
-	uint8_t		eth_dst[MAC_ADDR_LEN]; 	///< Ethernet destination address.
-	uint8_t		eth_src[MAC_ADDR_LEN]; 	///< Ethernet source address.
-	uint16_t	eth_ethertype;			///< Eheternet ethertype.
-	uint16_t	hw_type; 				///< ARP hardware type (Ethernet 0x0001).
-	uint16_t	protocol;				///< ARP protocol (IP 0x0800).
-	uint8_t		hw_len;					///< ARP lenght in bytes of hardware address.
-	uint8_t		proto_len;				///< ARP lenght in byte of protocol address.
-	uint16_t	opcode;					///< ARP Operation code (0x0001 for request, 0x0002 for reply).
-	uint8_t		hw_src[MAC_ADDR_LEN]; 	///< ARP source HW address.
-	uint32_t	ip_src;					///< ARP source Protocol address.
-	uint8_t		hw_dst[MAC_ADDR_LEN];	///< ARP target HW address.
-	uint32_t	ip_dst;					///< ARP target Protocol address.
-} __attribute__((__packed__));
-
-/** Represents a key-value table.*/
-typedef map< HWAddr, struct in_addr> ARPTable;
-
-/** Stores some info about the netdevice */
-struct LocalData{
-	int ifindex;					///< Index of the network interface.
-	uint32_t ipAddr;				///< IP Address of the network interface.
-	uint32_t firstHost;				///< IP Address of the first host in the network.
-	uint32_t lastHost;				///< IP Address of the last host in the network.
-	uint8_t hwAddr[MAC_ADDR_LEN];	///< Hawrdware Address of the network interface.
-};
+
 
 
 // ===============================
@@ -183,18 +132,18 @@ LocalData loadLocalData( const char *ifname ) throw( runtime_error )
 	}
 	memcpy( data.hwAddr, nic.ifr_netmask.sa_data, MAC_ADDR_LEN );
 
-	// Broadcast for last host
-	if( ioctl( sock, SIOCGIFBRDADDR, &nic ) < 0 ){
+	// First and last host from the network IP and the netmask. The
+	// broadcast of the interface isn't used, it can be left unset.
+	if( ioctl( sock, SIOCGIFNETMASK, &nic ) < 0 ){
 		close( sock );
-		throw runtime_error( "Getting Broadcast: " + string(strerror(errno)) );
+		throw runtime_error( "Getting Netmask: " + string(strerror(errno)) );
 	}
-	memcpy( &data.lastHost, nic.ifr_broadaddr.sa_data + 2, IP_ADDR_LEN );
-
-	// First host from the network IP
-	struct in_addr aux = { data.ipAddr };
-	data.firstHost = inet_netof( aux );
-	data.firstHost = (htonl( data.firstHost ) >> 8) + IP_ONE;
+	uint32_t mask;
+	memcpy( &mask, nic.ifr_netmask.sa_data + 2, IP_ADDR_LEN );
+	data.firstHost = htonl( ntohl( data.ipAddr & mask ) + 1 );
+	data.lastHost = data.ipAddr | ~mask;
 
+	close( sock );
 	return data;
 }
 
@@ -207,6 +156,7 @@ LocalData loadLocalData( const char *ifname ) throw( runtime_error )
  * @throw runtime_error If the socket couldn't be opened (open raw sockets requires
  * root privileges).
  * @throw runtime_error  The maximum time to wait for a response couldn't be configured.
+ * @throw runtime_error The kernel couldn't timestamp the frames received.
  * @throw runtime_error socket could't bind to the interface.
  */
 int initSocket( int ifindex ) throw( runtime_error )
@@ -214,6 +164,7 @@ int initSocket( int ifindex ) throw( runtime_error )
 	int sockfd;
 	struct sockaddr_ll sll;
 	struct timeval timer;
+	int one = 1;
 
 	if( (sockfd = socket( AF_PACKET, SOCK_RAW, htons(ETH_P_ARP) )) < 0 )
 		throw runtime_error( "socket: " + string(strerror(errno)) );
@@ -223,6 +174,10 @@ int initSocket( int ifindex ) throw( runtime_error )
 	if( setsockopt( sockfd, SOL_SOCKET, SO_RCVTIMEO, &timer, sizeof(timer) ) < 0 )
 		throw runtime_error( strerror(errno) );
 
+	// The time a frame arrived, to measure how long the guard takes to react.
+	if( setsockopt( sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one) ) < 0 )
+		throw runtime_error( "SO_TIMESTAMPNS: " + string(strerror(errno)) );
+
 	memset( &sll, 0, sizeof(sll) );
 	sll.sll_family = AF_PACKET;
 	sll.sll_ifindex = ifindex;
@@ -234,6 +189,59 @@ int initSocket( int ifindex ) throw( runtime_error )
 	return sockfd;
 }
 
+/**
+ * Adds the socket to a PACKET_FANOUT group that spreads the frames
+ * between the sockets by the ARP sender HW Address (see shardOf()).
+ * The sockets must be added in the order of their worker index.
+ *
+ * @param sfd The ARP socket to add.
+ * @param group The id of the fanout group.
+ * @param workers The number of sockets in the group.
+ *
+ * @throw runtime_error If the socket couldn't join the group.
+ */
+void joinFanout( int sfd, uint16_t group, unsigned workers ) throw( runtime_error )
+{
+	// The program sees the frame from the ARP header, the last four bytes
+	// of the sender HW Address start at offset 10.
+	struct sock_filter code[] = {
+		BPF_STMT( BPF_LD | BPF_W | BPF_ABS, 10 ),
+		BPF_STMT( BPF_ALU | BPF_MOD | BPF_K, workers ),
+		BPF_STMT( BPF_RET | BPF_A, 0 )
+	};
+	struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+	int arg = group | PACKET_FANOUT_CBPF << 16;
+
+	if( setsockopt( sfd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg) ) < 0 )
+		throw runtime_error( "PACKET_FANOUT: " + string(strerror(errno)) );
+	if( setsockopt( sfd, SOL_PACKET, PACKET_FANOUT_DATA, &prog, sizeof(prog) ) < 0 )
+		throw runtime_error( "PACKET_FANOUT_DATA: " + string(strerror(errno)) );
+}
+
+/**
+ * Opens the source of frames of a socket. If the backend isn't supported,
+ * the frames are read with recv().
+ *
+ * @param backend How the frames are received.
+ * @param sfd The ARP socket.
+ * @return The source, to be deleted by the caller.
+ */
+FrameSource* openSource( RecvBackend backend, int sfd )
+{
+	try{
+		if( backend == BACKEND_MMSG )
+			return new MmsgSource( sfd );
+		if( backend == BACKEND_TPACKET )
+			return new TPacketSource( sfd );
+		if( backend == BACKEND_URING )
+			return new URingSource( sfd );
+	}
+	catch( runtime_error &e ){
+		cerr << e.what() << ". Falling back to read()." << endl;
+	}
+	return new ReadSource( sfd );
+}
+
 /**
  * Adds a permanent entry to the ARP cache of the system.
  *
@@ -265,25 +273,185 @@ void addARPEntry(const char *ifname, struct in_addr ip, const HWAddr &hw)
 }
 
 /**
- * Makes a scan for ARP entries.
+ * Records the start of a sweep in ::scanMetrics.
+ */
+void sweepStarted( const LocalData &ld, unsigned pps )
+{
+	scanMetrics.first = ntohl( ld.firstHost );
+	scanMetrics.last = ntohl( ld.lastHost );
+	scanMetrics.current = 0;
+	scanMetrics.rate = pps;
+	scanMetrics.running = true;
+}
+
+/** Records the request of a sweep in ::scanMetrics, see BasicSweeper::sweep(). */
+void sweepProgress( uint32_t ip )
+{
+	scanMetrics.current = ntohl( ip );
+	scanMetrics.requests++;
+}
+
+/**
+ * Records the end of a sweep in ::scanMetrics.
+ *
+ * @param stats The statistics of the sweep.
+ */
+void sweepFinished( const SweepStats &stats )
+{
+	scanMetrics.achieved = stats.pps();
+	scanMetrics.running = false;
+	scanMetrics.sweeps++;
+}
+
+/**
+ * @return The number of hosts of the network that are scanned, the last
+ * one is not included; 0 if there are none, as in a /31 or a /32.
+ */
+uint32_t scannedHosts( const LocalData &ld )
+{
+	uint32_t first = ntohl( ld.firstHost ), last = ntohl( ld.lastHost );
+
+	return last > first ? last - first : 0;
+}
+
+/**
+ * Makes a scan for ARP entries. The replies are collected for the whole
+ * scan, so a device answering for an IP Address of another one during
+ * the scan doesn't go unnoticed.
  *
  * @param sfd The ARP socket to send/receive ARP frames.
  * @param ld An LocalData object that contains the local info about the
  * network interface.
+ * @param conflicts Where the IP Addresses answered by more than one
+ * device are stored. They're left out of the table.
+ * @param pps The maximum number of requests per second.
+ * @param stats Where the statistics of the scan are stored, printed too.
  *
- * @return ARPTable that contains the ARP entries in the network.
+ * @return ARPTable that contains the ARP entries in the network. A device
+ * that answers for several IP Addresses gets a binding for each one.
  *
  * @note The last host is not included in the scan.
  * @see initSocket()
  */
-ARPTable scan( int sfd, const LocalData &ld )
+ARPTable scan( int sfd, const LocalData &ld, SweepResult &conflicts, unsigned pps,
+		SweepStats &stats )
 {
-	struct in_addr host;
 	ARPTable table;
-	ARPFrame request, reply;
-	int attempts;
+	Sweeper sweeper( sfd, ld );
+
+	sweepStarted( ld, pps );
+	SweepResult result = sweeper.sweep( pps, MAX_TRIES_FOR_RESOLV, active,
+		[]( uint32_t ip ){
+			struct in_addr host = { ip };
+			sweepProgress( ip );
+			cout << "Resolving " << IPText( host.s_addr ) << '\r';
+			cout.flush();
+		} );
+	sweepFinished( sweeper.stats() );
+
+	for( auto &r : result ){
+		struct in_addr ip = { r.first };
+
+		if( r.second.size() > 1 )
+			conflicts.insert( r );
+		else
+			table.add( *r.second.begin(), ip );
+	}
+	stats = sweeper.stats();
+	cout << "\nScan: " << result.size() << " of " << scannedHosts( ld )
+		<< " hosts answered, " << sweeper.sent() << " requests sent in "
+		<< stats.elapsed / 1000000 << " ms (" << (unsigned) stats.pps() << " requests/s)\n"
+		"\t" << stats.replies << " replies, " << stats.retries << " retries, " << stats.timeouts
+		<< " timeouts, RTT min/avg/p99 " << stats.minRTT() / 1000 << '/' << stats.avgRTT() / 1000
+		<< '/' << stats.quantileRTT( 0.99 ) / 1000 << " us" << endl;
+
+	// Only the slices with devices, the rest are counted.
+	size_t silent = 0;
+	for( auto &slice : stats.slices ){
+		if( slice.rtts.empty() ){
+			silent++;
+			continue;
+		}
+		cout << '\t' << IPText( htonl( slice.first ) ) << '-' << IPText( htonl( slice.last ) ) << ": "
+			<< slice.probes << " requests, " << slice.replies << " replies, " << slice.retries
+			<< " retries, " << slice.timeouts << " timeouts, RTT min/avg/p99 " << slice.minRTT() / 1000
+			<< '/' << slice.avgRTT() / 1000 << '/' << slice.quantileRTT( 0.99 ) / 1000 << " us\n";
+	}
+	if( silent )
+		cout << '\t' << silent << " of " << stats.slices.size() << " slices without answers\n";
+	cout.flush();
+	return table;
+}
+
+/**
+ * Writes the RTT fields of some counters of a sweep, in microseconds.
+ */
+void writeRTT( ostream &out, const SweepCounters &c )
+{
+	if( c.rtts.empty() )
+		out << "null";
+	else
+		out << "{\"min\":" << c.minRTT() / 1000 << ",\"avg\":" << c.avgRTT() / 1000
+			<< ",\"p99\":" << c.quantileRTT( 0.99 ) / 1000 << '}';
+}
+
+/**
+ * Appends the report of a scan to a file, as one JSON object per line,
+ * so the scans of many networks can be gathered in one file.
+ *
+ * @param path The path of the file.
+ * @param ifname The name of the network interface scanned.
+ * @param ld The local info about the network interface.
+ * @param stats The statistics of the scan.
+ *
+ * @throw runtime_error If the file couldn't be written.
+ */
+void writeScanReport( const char *path, const char *ifname, const LocalData &ld,
+		const SweepStats &stats ) throw( runtime_error )
+{
+	ofstream out( path, ios::app );
+	char now[TIME_STRLEN];
+
+	if( !out )
+		throw runtime_error( string(path) + ": " + strerror(errno) );
+	formatTimestamp( realtimeNs(), now );
+	out << "{\"time\":\"" << now << "\",\"interface\":\"" << ifname << "\",\"first_host\":\""
+		<< IPText( ld.firstHost ) << "\",\"last_host\":\"" << IPText( ld.lastHost ) << "\",\"hosts\":"
+		<< scannedHosts( ld ) << ",\"answered\":" << stats.answered
+		<< ",\"requests\":" << stats.probes << ",\"replies\":" << stats.replies
+		<< ",\"retries\":" << stats.retries << ",\"timeouts\":" << stats.timeouts
+		<< ",\"wall_ms\":" << stats.elapsed / 1000000 << ",\"pps\":" << (unsigned) stats.pps()
+		<< ",\"rtt_us\":";
+	writeRTT( out, stats );
+	out << ",\"slices\":[";
+	for( size_t i = 0 ; i < stats.slices.size() ; i++ ){
+		const SliceStats &slice = stats.slices[i];
+
+		out << (i ? "," : "") << "{\"first\":\"" << IPText( htonl( slice.first ) ) << "\",\"last\":\""
+			<< IPText( htonl( slice.last ) ) << "\",\"requests\":" << slice.probes << ",\"replies\":"
+			<< slice.replies << ",\"retries\":" << slice.retries << ",\"timeouts\":" << slice.timeouts
+			<< ",\"rtt_us\":";
+		writeRTT( out, slice );
+		out << '}';
+	}
+	out << "]}" << endl;
+	if( !out )
+		throw runtime_error( string(path) + ": write failed" );
+}
+
+/**
+ * Asks the network who owns an IP Address: a request sent straight to
+ * the HW Address that the table has for it, and a broadcast one.
+ *
+ * @param sfd The ARP socket.
+ * @param ld The local info about the network interface.
+ * @param ip The IP Address to verify.
+ * @param owner Packed HW Address of the IP in the table, 0 if none.
+ */
+void sendProbes( int sfd, const LocalData &ld, uint32_t ip, uint64_t owner )
+{
+	ARPFrame request;
 
-	// Setting constant values of the request
 	memset( request.eth_dst, 0xff, MAC_ADDR_LEN );
 	memcpy( request.eth_src, ld.hwAddr, MAC_ADDR_LEN );
 	request.eth_ethertype = htons( ETH_P_ARP );
@@ -295,99 +463,571 @@ ARPTable scan( int sfd, const LocalData &ld )
 	memcpy( request.hw_src, ld.hwAddr, MAC_ADDR_LEN );
 	request.ip_src = ld.ipAddr;
 	memset( request.hw_dst, 0, MAC_ADDR_LEN );
+	request.ip_dst = ip;
 
-	// Bucle for hosts
-	for( host.s_addr = ld.firstHost ; host.s_addr != ld.lastHost ; host.s_addr += IP_ONE ){
-		request.ip_dst = host.s_addr;
-		attempts = MAX_TRIES_FOR_RESOLV;
-		cout << "Resolving " << inet_ntoa( host ) << '\r';
-		cout.flush();
-		write( sfd, &request, sizeof(request) ); // Send the request.
-		do{
-			if( read( sfd, &reply, sizeof(reply) ) > 0 ){ // Receive the reply
-				// Verify the reply and sender.
-				if( ntohs(reply.opcode) == ARPOP_REPLY && reply.ip_src == host.s_addr ){
-					HWAddr hw( reply.hw_src );
-					struct in_addr aux = { reply.ip_src };
-					table[hw] = aux;
-					attempts = 0;
-				}
-				else // Not the answer what we want.
-					attempts--;
+	write( sfd, &request, sizeof(request) );
+	if( owner ){
+		memcpy( request.eth_dst, unpackHWAddr( owner ).hw, MAC_ADDR_LEN );
+		write( sfd, &request, sizeof(request) );
+	}
+}
+
+/**
+ * Notices to the user that a HW Address is poisoning an IP Address and
+ * asks for adding a permanent entry with the right one, see AlertNotifier.
+ * The alert is already counted and logged by GuardHooks, and the worker
+ * ignores the IP Address afterwards, see checkFrame().
+ */
+void alert( const HWAddr &hw, struct in_addr ip, bool unsolicited, uint64_t arrival,
+		const Probe *probe, const TableSnapshot &snap, Shard &shard, GuardShared &shared,
+		uint64_t since )
+{
+	string &option = shard.answer;
+	bool find = true;
+	uint64_t ticks;
+
+	lock_guard<mutex> lock( *shared.prompt );
+
+	if( shared.journal )
+		shared.journal->append( JOURNAL_ALERT, hw, ip );
+	shard.profile.add( STAGE_ALERT, since );
+
+	// Notice to the user
+	cout << HWText( hw.hw ) << " is poisoning " << IPText( ip.s_addr );
+	if( unsolicited )
+		cout << " with unsolicited replies";
+	if( probe && probe->owner ){
+		if( probe->ownerAnswered )
+			cout << ", " << HWText( unpackHWAddr( probe->owner ).hw ) << " still answers for it";
+		else
+			cout << " (" << HWText( unpackHWAddr( probe->owner ).hw ) << " didn't answer, "
+				"it may have changed its address)";
+	}
+	if( probe && probe->othersAnswered )
+		cout << " [" << probe->othersAnswered << " answers from other devices]";
+	cout << ". Would you like to add a permanent entry to avoid the faking? (Y/N) ";
+	getline( cin, option );
+
+	if( option != "N" && option != "n" ){
+		const ARPTable::HWList *owners = snap.table.ownersOf( ip ); // Look for the IP Address, if it is.
+
+		find = false;
+		if( owners ){
+			try{
+				ticks = profileTicks();
+				addARPEntry( shared.ifname, ip, unpackHWAddr( (*owners)[0] ) );
+				shard.profile.add( STAGE_REMEDIATE, ticks );
+				WorkerMetrics::add( shard.metrics.pins, 1 );
+				shard.metrics.remediation.record( sinceArrival( arrival ) );
+				cout << "Entry added" << endl;
+				find = true;
+			}
+			catch( runtime_error &e ){
+				cerr << e.what() << endl;
 			}
-			else // Some error or no response.
-				attempts = 0;
-		}while( attempts );
+		}
 	}
-	cout << endl;
-	return table;
+	if( !find ) // The IP spoofed is not in out ARP Table
+		cout << "There's a missing entry. Please run the tool again for a new scan." << endl;
 }
 
 /**
  * An infinite bucle that analyzes new ARP replies.
  * The bucle stops setting ::active to false.
  *
- * @param sfd The ARP socket for receive ARP replies.
- * @param ifname The name of the interface network.
- * @param table The ARPTable that contains the ARP entries. 
+ * @param shared The state shared by the workers.
+ * @param shard The state owned by this worker. When its socket is part
+ * of a fanout group, only the frames of its senders are received.
+ * @param source Where the frames come from. If it fails, it's detached
+ * from the socket of the worker and the frames are read from the socket.
+ * @param pipeline If true, the checks are done in a second thread fed
+ * through a lock-free queue, so the capture never waits for them.
+ */
+void guard( GuardShared &shared, Shard &shard, FrameSource *source, bool pipeline )
+{
+	SPSCRing<ARPRecord> *queue = NULL;
+	thread analysis;
+	atomic<bool> capturing( true );
+	ReadSource fallback( shard.sockfd );
+
+	// The capture thread only parses the frames, the checks are done by
+	// the analysis thread.
+	if( pipeline ){
+		queue = new SPSCRing<ARPRecord>( PIPELINE_DEPTH );
+		analysis = thread( [&](){
+			SnapshotReader<TableSnapshot> reader( *shared.table );
+			ARPRecord rec;
+			size_t depth;
+			int idle = 0;
+
+			while( capturing || queue->size() ){
+				depth = queue->size();
+				if( depth > shard.maxDepth )
+					shard.maxDepth = depth;
+				if( queue->pop( rec ) ){
+					uint64_t ticks = profileTicks();
+
+					analyze( rec, *reader.enter(), shard, shared, ticks );
+					reader.leave();
+					idle = 0;
+				}
+				else if( ++idle > 64 )
+					usleep( 50 );
+				verifyProbes( reader, shard, shared );
+			}
+			shard.countAllocations();
+		} );
+	}
+	SnapshotReader<TableSnapshot> reader( *shared.table );
+	// Time to wait for frames, shorter while a verification is running.
+	auto timeout = [&]() -> uint64_t {
+		uint64_t next = queue ? 0 : shared.probes.nextDeadline( shard.id );
+		uint64_t now = monotonicNs();
+
+		if( !next || next > now + SOURCE_WAIT_MS * 1000000ULL )
+			return SOURCE_WAIT_MS * 1000000ULL;
+		return next > now ? next - now : 0;
+	};
+
+	while( active ){
+		const FrameRef *frames;
+		uint64_t ticks = profileTicks();
+		int n;
+
+		try{
+			n = source->receive( frames, timeout() );
+		}
+		catch( runtime_error &e ){
+			cerr << "Worker " << shard.id << ": " << e.what() << ". Falling back to read()." << endl;
+			source->detach();
+			source = &fallback;
+			continue;
+		}
+		if( n < 0 )
+			break;
+		checkSpan( frames, n, reader, shard, shared, queue, ticks );
+	} // End while
+
+	if( queue ){
+		capturing = false;
+		analysis.join();
+		delete queue;
+	}
+	else
+		shard.countAllocations();
+}
+
+/**
+ * Applies the result of a background sweep to the table. Only the changes
+ * are applied, and every one is notified to the user.
+ *
+ * @param table The entries to update.
+ * @param result The responders found by the sweep.
+ * @param misses How many sweeps in a row each IP Address of the table
+ * didn't answer.
+ * @return The number of changes applied.
+ */
+int applySweep( ARPTable &table, const SweepResult &result, map<uint32_t, int> &misses )
+{
+	set<uint32_t> known;
+	int changes = 0;
+	lock_guard<mutex> lock( promptLock );
+
+	// Departed devices
+	table.forEach( [&]( const HWAddr&, struct in_addr ip ){
+		known.insert( ip.s_addr );
+	} );
+	for( uint32_t addr : known ){
+		struct in_addr ip = { addr };
+
+		if( result.count( addr ) )
+			misses.erase( addr );
+		else if( ++misses[addr] >= DEPART_AFTER_SWEEPS ){
+			for( uint64_t hw : *table.ownersOf( ip ) )
+				cout << "Rescan: " << HWText( unpackHWAddr( hw ).hw ) << " (" << IPText( ip.s_addr )
+					<< ") left the network" << endl;
+			misses.erase( addr );
+			changes += table.removeIP( ip );
+		}
+	}
+
+	// New devices and changed bindings
+	for( auto &r : result ){
+		struct in_addr ip = { r.first };
+
+		if( r.second.size() > 1 ){
+			cout << "Rescan: " << IPText( ip.s_addr ) << " answered by " << r.second.size()
+				<< " devices, not updated" << endl;
+			continue;
+		}
+
+		const HWAddr &hw = *r.second.begin();
+		if( table.contains( hw, ip ) )
+			continue;
+
+		const ARPTable::IPList *addrs = table.addressesOf( hw );
+		const ARPTable::HWList *owners = table.ownersOf( ip );
+		ARPTable::HWList prev; // The removals below move the lists of the table.
+
+		if( owners )
+			prev = *owners;
+
+		if( addrs ){
+			ARPTable::IPList old = *addrs;
+			bool stays = false;
+
+			for( uint32_t addr : old ){
+				auto other = result.find( addr );
+				stays = stays || (other != result.end() && other->second.count( hw ));
+			}
+			if( stays ) // Also answers for its IP Addresses, it's not a move.
+				cout << "Rescan: " << HWText( hw.hw ) << " also answers for " << IPText( ip.s_addr ) << endl;
+			else{
+				for( uint32_t addr : old ){
+					struct in_addr from = { addr };
+
+					cout << "Rescan: " << HWText( hw.hw ) << " moved from " << IPText( from.s_addr );
+					cout << " to " << IPText( ip.s_addr ) << endl;
+					table.remove( hw, from );
+				}
+			}
+		}
+		else if( prev.empty() )
+			cout << "Rescan: new device " << HWText( hw.hw ) << " at " << IPText( ip.s_addr ) << endl;
+
+		if( !prev.empty() ){
+			for( uint64_t o : prev )
+				cout << "Rescan: " << IPText( ip.s_addr ) << " moved from " << HWText( unpackHWAddr( o ).hw )
+					<< " to " << HWText( hw.hw ) << endl;
+			table.removeIP( ip );
+		}
+		table.add( hw, ip );
+		changes++;
+	}
+	return changes;
+}
+
+/**
+ * Saves the table and drops from the journal the changes already in it,
+ * telling the user if it couldn't be done.
+ *
+ * @param file The table file.
+ * @param journal The journal of the table, NULL if there's none.
+ * @param table The bindings to save.
+ */
+void saveTable( TableFile &file, Journal *journal, const ARPTable &table )
+{
+	try{
+		file.save( table );
+		if( journal )
+			journal->compact();
+	}
+	catch( runtime_error &e ){
+		lock_guard<mutex> lock( promptLock );
+		cerr << "Saving the table: " << e.what() << endl;
+	}
+}
+
+/**
+ * Appends to the journal the changes between two versions of the table.
+ *
+ * @param journal The journal.
+ * @param before The old version.
+ * @param after The new version.
+ */
+void journalChanges( Journal &journal, const ARPTable &before, const ARPTable &after )
+{
+	before.forEach( [&]( const HWAddr &hw, struct in_addr ip ){
+		if( !after.contains( hw, ip ) )
+			journal.append( JOURNAL_REMOVE, hw, ip );
+	} );
+	after.forEach( [&]( const HWAddr &hw, struct in_addr ip ){
+		if( !before.contains( hw, ip ) )
+			journal.append( JOURNAL_ADD, hw, ip );
+	} );
+}
+
+/**
+ * Sweeps the network again and again at a low rate, and publishes a new
+ * version of the table when something changed. Stops with ::active.
  *
- * @throw runtime_error If a request of add ARP entry failed.
+ * @param ld The local info about the network interface.
+ * @param table The ARP table read by the guard.
+ * @param workers The number of capture workers.
+ * @param pps The maximum number of requests per second, 0 to only verify
+ * the table.
+ * @param file Where the table is saved, NULL to not save it.
+ * @param journal Where the changes are recorded until the table is saved
+ * again, NULL if there's none.
+ * @param verify If true, the first sweep only asks for the IP Addresses
+ * of the table, to check quickly a table loaded from a file.
  */
-void guard( int sfd, const char *ifname, const ARPTable &table )
+void rescan( const LocalData &ld, Snapshot<TableSnapshot> &table, unsigned workers,
+		unsigned pps, TableFile *file, Journal *journal, bool verify )
 {
-	ARPFrame reply;
-	set<uint32_t> ignored;
-	string option;
-	bool find;
+	map<uint32_t, int> misses;
+	int sfd;
+
+	try{
+		sfd = initSocket( ld.ifindex );
+	}
+	catch( runtime_error &e ){
+		cerr << "Rescan: " << e.what() << endl;
+		return;
+	}
+
+	Sweeper sweeper( sfd, ld );
+	SnapshotReader<TableSnapshot> reader( table );
 
 	while( active ){
-		// Receive the data
-		if( read( sfd, &reply, sizeof(reply) ) > 0 ){
-			// Verify the reply
-			if( ntohs(reply.opcode) == ARPOP_REPLY ){
-				HWAddr hw( reply.hw_src );
-				struct in_addr ip = { reply.ip_src };
-
-				try{
-					struct in_addr reg = table.at(hw); // Check our ARP Table for the sender.
-
-					if( reg.s_addr != ip.s_addr &&  // If the MAC doesn't match with the IP
-							ignored.find(ip.s_addr) == ignored.end() ){ // ... And it's not ignored
-							find = true;
-
-							// Notice to the user
-							cout << hw.toString() << " is poisoning " << inet_ntoa(ip) << 
-								". Would you like to add a permanent entry to avoid the faking? (Y/N) ";
-							getline( cin, option );
-
-							if( option != "N" && option != "n" ){
-								find = false;
-								for( auto &i : table ){ // Look for the IP Address, if it is.
-									if( i.second.s_addr == ip.s_addr ){
-										try{
-											addARPEntry( ifname, ip, i.first );
-											cout << "Entry added" << endl;
-											find = true;
-										}
-										catch( runtime_error &e ){
-											cerr << e.what() << endl;
-										}
-										break;
-									}
-								}
-							}
-							if( !find ) // The IP spoofed is not in out ARP Table
-								cout << "There's a missing entry. Please run the tool again for a new scan." << endl;
-							ignored.insert( ip.s_addr );
-						} // End if for ignoring
+		time_t start = time( NULL );
+		SweepResult result;
+
+		sweepStarted( ld, pps ? pps : SCAN_RATE );
+		if( verify ){
+			vector<uint32_t> hosts;
+
+			reader.enter()->table.forEach( [&]( const HWAddr&, struct in_addr ip ){
+				hosts.push_back( ip.s_addr );
+			} );
+			reader.leave();
+			sort( hosts.begin(), hosts.end() );
+			hosts.erase( unique( hosts.begin(), hosts.end() ), hosts.end() );
+			result = sweeper.sweep( hosts, pps ? pps : SCAN_RATE, MAX_TRIES_FOR_RESOLV, active,
+				sweepProgress );
+		}
+		else
+			result = sweeper.sweep( pps, 1, active, sweepProgress );
+		sweepFinished( sweeper.stats() );
+
+		if( !active )
+			break;
+
+		ARPTable next = reader.enter()->table;
+		reader.leave();
+		ARPTable before = next;
+		if( applySweep( next, result, misses ) ){
+			table.publish( new TableSnapshot( next, workers ) );
+			scanMetrics.bindings = next.size();
+			if( journal )
+				journalChanges( *journal, before, next );
+			if( file && (!journal || journal->pendingChanges() >= JOURNAL_COMPACT_RECORDS) )
+				saveTable( *file, journal, next );
+		}
+		if( verify ){
+			lock_guard<mutex> lock( promptLock );
+			cout << "Rescan: " << result.size() << " of the IP Addresses loaded answered" << endl;
+			verify = false;
+		}
+		if( !pps )
+			break; // Only the verification was asked for.
+
+		while( active && time( NULL ) - start < RESCAN_MIN_PERIOD )
+			usleep( 100000 );
+	}
+	close( sfd );
+}
+
+/**
+ * Formats a time as UTC with nanoseconds, like 2024-01-31T23:59:59.123456789Z.
+ *
+ * @param ns The time in nanoseconds since the epoch.
+ * @return The formatted time.
+ */
+string formatTime( uint64_t ns )
+{
+	char buf[TIME_STRLEN];
+
+	return formatTimestamp( ns, buf );
+}
+
+/**
+ * Prints the quantiles of a latency of the workers, if there were any.
+ *
+ * @param what What is measured.
+ * @param shards The workers.
+ * @param histogram The histogram of WorkerMetrics with the latency.
+ */
+void printLatency( const char *what, const vector<Shard> &shards,
+	LatencyHistogram WorkerMetrics::*histogram )
+{
+	LatencySummary summary;
+
+	for( auto &shard : shards )
+		summary.add( shard.metrics.*histogram );
+	if( summary.count() )
+		cout << '\r' << what << " latency: p50 " << summary.quantile( 0.5 ) / 1000 << " us, p99 "
+			<< summary.quantile( 0.99 ) / 1000 << " us, p999 " << summary.quantile( 0.999 ) / 1000
+			<< " us, max " << summary.highest() / 1000 << " us (" << summary.count() << " measured)" << endl;
+}
+
+/**
+ * Builds the page of the metrics endpoint. The counters of the workers
+ * are summed here, the capture path only adds to its own.
+ *
+ * @param shards The workers.
+ * @param sockets The sockets of the workers.
+ * @param guarding How many sockets are ready, 0 while scanning.
+ * @param kernelPackets Packets counted by the kernel per socket so far.
+ * @param kernelDrops Packets dropped by the kernel per socket so far.
+ * @param evidence Where the poisoning frames are saved, NULL if not.
+ * @param events Where the events are logged, NULL if not.
+ * @return The metrics in the Prometheus text format.
+ */
+string renderMetrics( const vector<Shard> &shards, const vector<int> &sockets,
+	const atomic<unsigned> &guarding, vector<uint64_t> &kernelPackets, vector<uint64_t> &kernelDrops,
+	const EvidenceWriter *evidence, const EventLog *events )
+{
+	static const struct{
+		atomic<uint64_t> WorkerMetrics::*counter;
+		const char *name;
+		const char *help;
+	} counters[] = {
+		{ &WorkerMetrics::frames, "anti_arpspoof_frames_received_total", "ARP frames received." },
+		{ &WorkerMetrics::replies, "anti_arpspoof_replies_total", "ARP replies checked." },
+		{ &WorkerMetrics::unknown, "anti_arpspoof_unknown_macs_total", "Frames from HW Addresses that aren't in the table." },
+		{ &WorkerMetrics::conflicts, "anti_arpspoof_conflicts_total", "Frames claiming the IP Address of another device." },
+		{ &WorkerMetrics::alerts, "anti_arpspoof_alerts_total", "Poisonings notified." },
+		{ &WorkerMetrics::pins, "anti_arpspoof_pins_total", "Permanent ARP entries added." }
+	};
+	MetricsText page;
+	unsigned ready = guarding;
+
+	for( auto &c : counters ){
+		page.family( c.name, "counter", c.help );
+		for( unsigned i = 0 ; i < shards.size() ; i++ )
+			page.sample( c.name, "worker", i, (shards[i].metrics.*c.counter).load() );
+	}
+
+	// The statistics of a packet socket are reset every time they're read.
+	for( unsigned i = 0 ; i < ready ; i++ ){
+		struct tpacket_stats stats;
+		socklen_t len = sizeof(stats);
+
+		if( getsockopt( sockets[i], SOL_PACKET, PACKET_STATISTICS, &stats, &len ) == 0 ){
+			kernelPackets[i] += stats.tp_packets;
+			kernelDrops[i] += stats.tp_drops;
+		}
+	}
+	page.family( "anti_arpspoof_kernel_packets_total", "counter", "Packets received by the sockets, as counted by the kernel." );
+	for( unsigned i = 0 ; i < ready ; i++ )
+		page.sample( "anti_arpspoof_kernel_packets_total", "worker", i, kernelPackets[i] );
+	page.family( "anti_arpspoof_kernel_drops_total", "counter", "Packets dropped by the kernel because a socket was full." );
+	for( unsigned i = 0 ; i < ready ; i++ )
+		page.sample( "anti_arpspoof_kernel_drops_total", "worker", i, kernelDrops[i] );
+	page.family( "anti_arpspoof_pipeline_drops_total", "counter", "Frames dropped because the pipeline queue was full." );
+	for( unsigned i = 0 ; i < shards.size() ; i++ )
+		page.sample( "anti_arpspoof_pipeline_drops_total", "worker", i, shards[i].overflows.load() );
+	if( evidence ){
+		page.family( "anti_arpspoof_evidence_frames_total", "counter", "Frames saved as evidence." );
+		page.sample( "anti_arpspoof_evidence_frames_total", evidence->frames() );
+		page.family( "anti_arpspoof_evidence_drops_total", "counter", "Evidence frames dropped because a queue was full." );
+		page.sample( "anti_arpspoof_evidence_drops_total", evidence->dropped() );
+		page.family( "anti_arpspoof_evidence_write_errors_total", "counter", "Evidence frames lost because the file couldn't be written." );
+		page.sample( "anti_arpspoof_evidence_write_errors_total", evidence->failures() );
+	}
+	if( events ){
+		page.family( "anti_arpspoof_events_total", "counter", "Events logged." );
+		page.sample( "anti_arpspoof_events_total", events->events() );
+		page.family( "anti_arpspoof_event_drops_total", "counter", "Events dropped because a queue was full." );
+		page.sample( "anti_arpspoof_event_drops_total", events->dropped() );
+		page.family( "anti_arpspoof_event_write_errors_total", "counter", "Events lost because the file couldn't be written." );
+		page.sample( "anti_arpspoof_event_write_errors_total", events->failures() );
+	}
+
+	static const struct{
+		LatencyHistogram WorkerMetrics::*histogram;
+		const char *name;
+		const char *help;
+	} latencies[] = {
+		{ &WorkerMetrics::detection, "anti_arpspoof_detection_latency_seconds",
+			"From the arrival of a frame claiming the IP Address of another device in the kernel to its check." },
+		{ &WorkerMetrics::remediation, "anti_arpspoof_remediation_latency_seconds",
+			"From the arrival of a poisoning in the kernel to its permanent entry." }
+	};
+	static const char *quantiles[] = { "0.5", "0.99", "0.999" };
+
+	for( auto &l : latencies ){
+		LatencySummary summary;
+		string name = l.name;
+
+		for( auto &shard : shards )
+			summary.add( shard.metrics.*l.histogram );
+		page.family( l.name, "summary", l.help );
+		for( const char *q : quantiles )
+			page.sample( l.name, "quantile", q, summary.quantile( atof( q ) ) / 1e9 );
+		page.sample( (name + "_sum").c_str(), summary.totalNs() / 1e9 );
+		page.sample( (name + "_count").c_str(), summary.count() );
+	}
+
+	page.family( "anti_arpspoof_table_bindings", "gauge", "Bindings of the ARP table in use." );
+	page.sample( "anti_arpspoof_table_bindings", scanMetrics.bindings.load() );
+	page.family( "anti_arpspoof_scan_running", "gauge", "1 while a sweep of the network is in progress." );
+	page.sample( "anti_arpspoof_scan_running", scanMetrics.running ? 1 : 0 );
+	page.family( "anti_arpspoof_scan_progress", "gauge", "Fraction of the network swept by the sweep in progress." );
+	page.sample( "anti_arpspoof_scan_progress", scanMetrics.running ? scanMetrics.progress() : 0 );
+	page.family( "anti_arpspoof_scan_configured_rate", "gauge", "Maximum requests per second of the current or last sweep." );
+	page.sample( "anti_arpspoof_scan_configured_rate", scanMetrics.rate.load() );
+	page.family( "anti_arpspoof_scan_achieved_rate", "gauge", "Requests per second sent by the last sweep finished." );
+	page.sample( "anti_arpspoof_scan_achieved_rate", scanMetrics.achieved.load() );
+	page.family( "anti_arpspoof_scan_requests_total", "counter", "ARP requests sent by the sweeps." );
+	page.sample( "anti_arpspoof_scan_requests_total", scanMetrics.requests.load() );
+	page.family( "anti_arpspoof_sweeps_total", "counter", "Sweeps of the network finished." );
+	page.sample( "anti_arpspoof_sweeps_total", scanMetrics.sweeps.load() );
+	return page.str();
+}
+
+/**
+ * Runs the checks of the guard over a capture file, see Detector, and
+ * prints every poisoning found in the order of the capture, so the same
+ * file always gives the same list.
+ *
+ * @param path The pcap or pcapng file.
+ * @param events Where the poisonings are logged instead, NULL to print
+ * them.
+ * @return 0, or 1 if the file couldn't be read.
+ */
+int analyzeCapture( const char *path, EventLog *events )
+{
+	Detector detector;
+	uint64_t start = monotonicNs();
+
+	try{
+		PcapSource source( path );
+		const FrameRef *frames;
+		int n;
+
+		while( (n = source.receive( frames, 0 )) >= 0 )
+			detector.process( frames, n, [&]( const Poisoning &p ){
+				struct in_addr ip = { p.ip };
+
+				if( events ){
+					Event e = { p.timestamp, p.owner, p.claimant, p.ip, 0,
+						EVENT_POISONING, VERDICT_UNVERIFIED, !p.solicited };
+
+					events->submit( 0, e );
+					return;
 				}
-				// The HW Address of the sender is not in our ARP Table
-				catch( out_of_range ){
-					cout << "There's a new device. You should try with a new scan." << endl;
-				} // The received entry is not in our ARP Table
-			} // End if for replies ARP
-		} // End if for reading
-	} // End while
+				cout << formatTime( p.timestamp ) << ' ' << HWText( unpackHWAddr( p.claimant ).hw )
+					<< " is poisoning " << IPText( ip.s_addr ) << " (owner "
+					<< HWText( unpackHWAddr( p.owner ).hw ) << ')'
+					<< (p.solicited ? "" : " with unsolicited replies") << endl;
+			} );
+		if( source.skipped() )
+			cerr << source.skipped() << " frames skipped, they're not Ethernet" << endl;
+	}
+	catch( runtime_error &e ){
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	double secs = (monotonicNs() - start) / 1e9;
+	cout << detector.frames() << " frames, " << detector.arpFrames() << " ARP, "
+		<< detector.poisonings() << " poisonings (" << detector.replies() << " replies), "
+		<< detector.table().size() << " bindings learned" << endl;
+	cerr << "Analyzed in " << secs << " s (" << (secs > 0 ? detector.frames() / secs : 0)
+		<< " frames/s)" << endl;
+	return 0;
 }
 
 /**
@@ -398,6 +1038,53 @@ void sigKill(int){
 	active = false;
 }
 
+/**
+ * SIGUSR1 handler. Asks for the stage profile, printed by dumpProfile()
+ * outside of the handler. It's installed when the tool starts, since the
+ * default action would end it; a profile asked for while scanning is
+ * printed once the guard starts.
+ */
+void sigDump(int){
+	dumpRequested = true;
+}
+
+/**
+ * Prints the time spent by the workers in each stage since the guard
+ * started, to the standard error. The capture goes on meanwhile.
+ *
+ * @param shards The workers.
+ * @param clock The clock started with the guard.
+ */
+void dumpProfile( const vector<Shard> &shards, const TickClock &clock )
+{
+	static const char *names[STAGES] = { "receive", "parse", "lookup", "suppress", "alert", "remediate" };
+	uint64_t ticks[STAGES] = { 0 }, frames[STAGES] = { 0 }, total = 0;
+	double perNs = clock.perNs();
+	char line[128];
+
+	for( auto &shard : shards )
+		for( int s = 0 ; s < STAGES ; s++ ){
+			ticks[s] += shard.profile.ticks( (Stage) s );
+			frames[s] += shard.profile.frames( (Stage) s );
+		}
+	for( int s = 0 ; s < STAGES ; s++ )
+		total += ticks[s];
+
+	lock_guard<mutex> lock( promptLock );
+	snprintf( line, sizeof(line), "%.3f", perNs );
+	cerr << "\rProfile of " << shards.size() << " workers over " << clock.elapsed() / 1000000
+		<< " ms (" << line << " ticks/ns), receive includes the wait for frames:\n";
+	snprintf( line, sizeof(line), "%-10s %14s %14s %12s %7s", "Stage", "Frames", "Total ms", "ns/frame", "Share" );
+	cerr << '\t' << line << '\n';
+	for( int s = 0 ; s < STAGES ; s++ ){
+		snprintf( line, sizeof(line), "%-10s %14llu %14.1f %12.1f %6.1f%%", names[s],
+			(unsigned long long) frames[s], ticks[s] / perNs / 1e6,
+			frames[s] ? ticks[s] / perNs / frames[s] : 0.0, total ? 100.0 * ticks[s] / total : 0.0 );
+		cerr << '\t' << line << '\n';
+	}
+	cerr.flush();
+}
+
 /**
  * Main function of the program.
  *
@@ -405,39 +1092,350 @@ void sigKill(int){
  */
 int main( int argc, char **argv )
 {
-	if( argc != 2 ){
-		cerr << "Uso:\n\t" << *argv << " interface_name" << endl;
+	RecvBackend backend = BACKEND_READ;
+	unsigned workers = 1;
+	unsigned rescanRate = 0;
+	unsigned scanRate = SCAN_RATE;
+	const char *tablePath = NULL;
+	const char *capturePath = NULL;
+	const char *evidencePath = NULL;
+	const char *eventsPath = NULL;
+	const char *metricsEndpoint = NULL;
+	const char *reportPath = NULL;
+	size_t evidenceDepth = EVIDENCE_HISTORY;
+	bool pipeline = false;
+	bool badUsage = false;
+	int opt;
+
+	signal( SIGUSR1, sigDump );
+	while( (opt = getopt( argc, argv, "b:e:E:f:j:l:m:o:pr:s:t:" )) != -1 ){
+		if( opt == 'b' && string(optarg) == "read" )
+			backend = BACKEND_READ;
+		else if( opt == 'b' && string(optarg) == "mmsg" )
+			backend = BACKEND_MMSG;
+		else if( opt == 'b' && string(optarg) == "tpacket" )
+			backend = BACKEND_TPACKET;
+		else if( opt == 'b' && string(optarg) == "uring" )
+			backend = BACKEND_URING;
+		else if( opt == 'e' )
+			evidencePath = optarg;
+		else if( opt == 'E' && atoi(optarg) >= 0 )
+			evidenceDepth = atoi( optarg );
+		else if( opt == 'f' )
+			capturePath = optarg;
+		else if( opt == 'j' && atoi(optarg) > 0 )
+			workers = atoi( optarg );
+		else if( opt == 'l' )
+			eventsPath = optarg;
+		else if( opt == 'm' )
+			metricsEndpoint = optarg;
+		else if( opt == 'o' )
+			reportPath = optarg;
+		else if( opt == 'p' )
+			pipeline = true;
+		else if( opt == 'r' && atoi(optarg) > 0 )
+			rescanRate = atoi( optarg );
+		else if( opt == 's' && atoi(optarg) > 0 )
+			scanRate = atoi( optarg );
+		else if( opt == 't' )
+			tablePath = optarg;
+		else
+			badUsage = true;
+	}
+	if( badUsage || optind != argc - (capturePath ? 0 : 1) ){
+		cerr << "Uso:\n\t" << *argv << " [-b read|mmsg|tpacket|uring] [-j workers] [-p] [-r pps] [-s pps]\n"
+			"\t\t[-t file] [-e evidence.pcap [-E frames]] [-l events.jsonl] [-m [address:]port|unix:path]\n"
+			"\t\t[-o report.jsonl] interface_name\n"
+			"\t" << *argv << " [-l events.jsonl] -f capture\n\n"
+			"\t-b\tHow to receive the frames while guarding (default: read)\n"
+			"\t-e\tSave the frames of every poisoning to a pcap file\n"
+			"\t-E\tARP frames received before a poisoning saved with it (default: " << EVIDENCE_HISTORY << ")\n"
+			"\t-f\tLook for poisoning in a pcap or pcapng capture file instead of the network\n"
+			"\t-j\tNumber of capture threads, the frames are spread by sender (default: 1)\n"
+			"\t-l\tLog new devices, poisonings and conflicts to a file as JSON lines instead of\n"
+			"\t\tprinting them, - for the standard output\n"
+			"\t-m\tServe metrics in the Prometheus format over HTTP on a TCP port, on 127.0.0.1 if\n"
+			"\t\tthere's no address, or on a unix socket\n"
+			"\t-o\tAppend the timing report of the scan to a file as a line of JSON\n"
+			"\t-p\tCheck the frames in a second thread per worker\n"
+			"\t-r\tKeep the table updated with background sweeps of at most pps requests per second\n"
+			"\t-s\tRequests per second of the first scan (default: " << SCAN_RATE << ")\n"
+			"\t-t\tLoad the table from file instead of scanning, and save it there. The changes\n"
+			"\t\tare recorded in file.journal meanwhile" << endl;
 		return 1;
 	}
 
+	if( capturePath ){
+		EventLog *events = NULL;
+		int status;
+
+		try{
+			if( eventsPath )
+				events = new EventLog( eventsPath, basename( capturePath ), 1 );
+		}
+		catch( runtime_error &e ){
+			cerr << e.what() << endl;
+			return 1;
+		}
+		status = analyzeCapture( capturePath, events );
+		if( events ){
+			events->stop();
+			cerr << "Events: " << events->events() << " written to " << events->path()
+				<< " (" << events->dropped() << " dropped";
+			if( events->failures() )
+				cerr << ", " << events->failures() << " couldn't be written";
+			cerr << ")" << endl;
+			delete events;
+		}
+		return status;
+	}
+
+	const char *ifname = argv[optind];
 	int sockfd;
 	LocalData data;
 	ARPTable arpTable;
+	SweepResult conflicts;
+	vector<Shard> shards( workers );
+	vector<int> sockets( 1 );
+	vector<FrameSource*> sources;
+	vector<thread> threads;
+	EventLog *events = NULL;
+	EvidenceWriter *evidence = NULL;
+	MetricsServer *metrics = NULL;
+	atomic<unsigned> guarding( 0 );	// Sockets ready to be read by the metrics
+	vector<uint64_t> kernelPackets( workers ), kernelDrops( workers );
 
 	try{
-		data = loadLocalData( argv[1] );
+		data = loadLocalData( ifname );
 		sockfd = initSocket( data.ifindex );
+		// The workers are producers 0 to workers - 1, this thread is the last one.
+		if( eventsPath )
+			events = new EventLog( eventsPath, ifname, workers + 1 );
+		if( evidencePath )
+			evidence = new EvidenceWriter( evidencePath, workers, evidenceDepth );
+		if( metricsEndpoint )
+			metrics = new MetricsServer( metricsEndpoint, [&](){
+				return renderMetrics( shards, sockets, guarding, kernelPackets, kernelDrops, evidence, events );
+			} );
 	}
 	catch( runtime_error &e ){
 		cerr << e.what() << endl;
+		delete evidence;
+		delete events;
 		return 1;
 	}
 
 
-	arpTable = scan( sockfd, data );
-	
+	// A saved table protects the network right away, it's verified in
+	// the background. The journal has the changes since it was saved.
+	TableFile file( tablePath ? tablePath : "", ifname, data );
+	Journal *journal = NULL;
+	bool loaded = false;
+	size_t replayed = 0;
+	uint64_t savedAt = 0;
+
+	if( tablePath ){
+		try{
+			journal = new Journal( string(tablePath) + ".journal" );
+			loaded = file.load( arpTable, savedAt );
+			replayed = journal->replay( arpTable );
+			loaded = loaded || !arpTable.empty();
+		}
+		catch( runtime_error &e ){
+			cerr << e.what() << ", scanning the network" << endl;
+			arpTable = ARPTable();
+			loaded = false;
+		}
+	}
+	if( loaded ){
+		struct timespec now;
+
+		clock_gettime( CLOCK_REALTIME, &now );
+		if( savedAt )
+			cout << "Table loaded from " << tablePath << ", saved "
+				<< (now.tv_sec - (time_t) (savedAt / 1000000000ULL)) << " seconds ago" << endl;
+		if( replayed )
+			cout << replayed << " changes replayed from " << journal->path() << endl;
+	}
+	else{
+		SweepStats stats;
+
+		arpTable = scan( sockfd, data, conflicts, scanRate, stats );
+		if( reportPath ){
+			try{
+				writeScanReport( reportPath, ifname, data, stats );
+			}
+			catch( runtime_error &e ){
+				cerr << e.what() << endl;
+			}
+		}
+		if( tablePath )
+			saveTable( file, journal, arpTable );
+	}
+
 	// Output the ARP table.
+	vector< pair<HWAddr, uint32_t> > entries;
+	arpTable.forEach( [&]( const HWAddr &hw, struct in_addr ip ){
+		entries.push_back( make_pair( hw, ntohl( ip.s_addr ) ) );
+	} );
+	sort( entries.begin(), entries.end() );
+	scanMetrics.bindings = arpTable.size();
+
 	cout << arpTable.size() << " entries found. "
 		"If you think there's missing devices, please run the tool again.\n\n"
 		"\tHW Address\t\t\tIP Address\n";
-	for( auto &i : arpTable )
-		cout << '\t' << i.first.toString() << "\t\t" << inet_ntoa(i.second) << endl; 
+	for( auto &i : entries ){
+		struct in_addr ip = { htonl( i.second ) };
+		cout << '\t' << HWText( i.first.hw ) << "\t\t" << IPText( ip.s_addr ) << endl; 
+	}
+	if( !arpTable.empty() )
+		cout << "\nTable memory: " << arpTable.memoryUsage() << " bytes, "
+			<< arpTable.memoryUsage() / arpTable.size() << " per binding" << endl;
+
+	for( auto &i : conflicts ){
+		struct in_addr ip = { i.first };
+
+		if( events ){
+			// One event for each device besides the first one.
+			for( auto hw = ++i.second.begin() ; hw != i.second.end() ; ++hw ){
+				Event e = { realtimeNs(), packHWAddr( i.second.begin()->hw ), packHWAddr( hw->hw ),
+					ip.s_addr, (uint16_t) (i.second.size() - 2), EVENT_CONFLICT, VERDICT_AMBIGUOUS, false };
+
+				events->submit( workers, e );
+			}
+			continue;
+		}
+		cout << "\nWARNING: " << IPText( ip.s_addr ) << " was answered by " << i.second.size()
+			<< " devices:";
+		for( auto &hw : i.second )
+			cout << ' ' << HWText( hw.hw );
+		cout << "\nOne of them may be poisoning it, the IP Address is left out of the table." << endl;
+	}
+
+	// Every worker gets its own socket in the fanout group and looks up
+	// the entries of the senders it will receive. The table is read by the
+	// workers, their analysis threads, the sweeper and this thread.
+	Snapshot<TableSnapshot> table( new TableSnapshot( arpTable, workers ), 2 * workers + 2 );
+	GuardShared shared;
+	shared.ifname = ifname;
+	shared.local = data;
+	shared.table = &table;
+	shared.journal = journal;
+	shared.evidence = evidence;
+	shared.events = events;
+	shared.prompt = &promptLock;
+	shared.sendProbes = sendProbes;
+	shared.notify = alert;
+	sockets[0] = sockfd;
+	try{
+		for( unsigned i = 0 ; evidence && i < workers ; i++ )
+			shards[i].history = new FrameHistory( evidenceDepth );
+		while( sockets.size() < workers )
+			sockets.push_back( initSocket( data.ifindex ) );
+		for( int fd : sockets )
+			sources.push_back( openSource( backend, fd ) );
+		for( unsigned i = 0 ; workers > 1 && i < workers ; i++ )
+			joinFanout( sockets[i], getpid() & 0xffff, workers );
+		for( unsigned i = 0 ; i < workers ; i++ ){
+			shards[i].id = i;
+			shards[i].sockfd = sockets[i];
+		}
+		guarding = workers;
+	}
+	catch( runtime_error &e ){
+		cerr << e.what() << endl;
+		delete metrics;
+		for( auto source : sources )
+			delete source;
+		for( int fd : sockets )
+			close( fd );
+		for( auto &s : shards )
+			delete s.history;
+		delete evidence;
+		delete events;
+		delete journal;
+		return 1;
+	}
 
-	cout << "\nAnalyzing ARP replies. Press CTRL-C to exit\n\n";
+	cout << "\nAnalyzing ARP replies. Press CTRL-C to exit, send SIGUSR1 for a profile\n" << endl;
 	signal( SIGINT, sigKill );
-	guard( sockfd, argv[1], arpTable );
+
+	// The profile is printed by its own thread, so no worker stops for it.
+	TickClock clock;
+	threads.push_back( thread( [&](){
+		while( active ){
+			if( dumpRequested.exchange( false ) )
+				dumpProfile( shards, clock );
+			usleep( 100000 );
+		}
+	} ) );
+	for( unsigned i = 1 ; i < workers ; i++ )
+		threads.push_back( thread( guard, ref(shared), ref(shards[i]), sources[i], pipeline ) );
+	if( rescanRate || loaded )
+		threads.push_back( thread( rescan, cref(data), ref(table), workers, rescanRate,
+			tablePath ? &file : NULL, journal, loaded ) );
+	guard( shared, shards[0], sources[0], pipeline );
+	for( auto &t : threads )
+		t.join();
+
+	uint64_t hits = 0, misses = 0, evictions = 0;
+	for( auto &i : shards ){
+		hits += i.correlation.hits;
+		misses += i.correlation.misses;
+		evictions += i.correlation.evictions;
+	}
+	cout << "\rReplies: " << hits << " solicited, " << misses << " unsolicited ("
+		<< evictions << " requests evicted)" << endl;
+	if( pipeline )
+		for( unsigned i = 0 ; i < workers ; i++ )
+			cout << "\rWorker " << i << ": " << shards[i].received << " frames queued, "
+				<< shards[i].overflows << " dropped (queue full), max depth "
+				<< shards[i].maxDepth << '/' << PIPELINE_DEPTH << endl;
+	printLatency( "Detection", shards, &WorkerMetrics::detection );
+	printLatency( "Remediation", shards, &WorkerMetrics::remediation );
+#ifdef COUNT_ALLOCATIONS
+	for( unsigned i = 0 ; i < workers ; i++ )
+		cout << "\rWorker " << i << ": " << shards[i].checked << " frames checked, "
+			<< shards[i].allocations << " allocations after the first " << ALLOCATION_WARMUP << endl;
+#endif
+
+	if( tablePath ){
+		SnapshotReader<TableSnapshot> reader( table );
+
+		saveTable( file, journal, reader.enter()->table );
+		reader.leave();
+	}
+	// The server reads the statistics of the sockets, the evidence and the events.
+	delete metrics;
+	if( evidence ){
+		evidence->stop();
+		cout << "\rEvidence: " << evidence->frames() << " frames saved to "
+			<< evidence->path() << " (" << evidence->dropped() << " dropped";
+		if( evidence->failures() )
+			cout << ", " << evidence->failures() << " couldn't be written";
+		cout << ")" << endl;
+		delete evidence;
+		for( auto &s : shards )
+			delete s.history;
+	}
+	if( events ){
+		events->stop();
+		cout << "\rEvents: " << events->events() << " written to " << events->path()
+			<< " (" << events->dropped() << " dropped";
+		if( events->failures() )
+			cout << ", " << events->failures() << " couldn't be written";
+		cout << ")" << endl;
+		delete events;
+	}
+	if( journal && journal->failures() )
+		cerr << "\r" << journal->failures() << " batches couldn't be written to "
+			<< journal->path() << endl;
+	delete journal;
 
 	cout << "\rClosing socket..." << endl;
-	close( sockfd );
+	for( auto source : sources )
+		delete source;
+	for( int fd : sockets )
+		close( fd );
 	return 0;
 }
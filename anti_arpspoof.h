@@ -0,0 +1,290 @@
+/**
+ * @file: anti_arpspoof.h
+ * @author Ricardo Román <reroman4@gmail.com>
+ *
+ * Common data types shared by the tool and its receive backends.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef ANTI_ARPSPOOF_H
+#define ANTI_ARPSPOOF_H
+
+#include <ostream>
+#include <string>
+
+#include <cstring>
+#include <ctime>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+/// Length in bytes of one Hardware Address.
+#define MAC_ADDR_LEN	6
+
+/// Length in bytes of one IP Address.
+#define IP_ADDR_LEN		4
+
+/// Defines the IP 0.0.0.1.
+#define IP_ONE		htonl( 1 )
+
+/// The maximum number of attempts to resolve a HW Address.
+#define MAX_TRIES_FOR_RESOLV	5
+
+/// Bytes of a HW Address formatted as xx:xx:xx:xx:xx:xx, '\0' included.
+#define HW_ADDR_STRLEN	18
+
+/// Bytes of an IP Address formatted in dotted decimal, '\0' included.
+#define IP_ADDR_STRLEN	16
+
+/// Bytes of a time formatted by formatTimestamp(), '\0' included.
+#define TIME_STRLEN		31
+
+
+// ===============================
+// Formatting
+// ===============================
+
+/**
+ * Writes a HW Address as xx:xx:xx:xx:xx:xx, two lowercase hex digits per
+ * byte.
+ *
+ * @param hw The 6 bytes of the HW Address.
+ * @param out A buffer of at least HW_ADDR_STRLEN bytes.
+ * @return out.
+ */
+inline char* formatHWAddr( const uint8_t hw[], char *out )
+{
+	static const char digits[] = "0123456789abcdef";
+	char *p = out;
+
+	for( int i = 0 ; i < MAC_ADDR_LEN ; i++ ){
+		*p++ = digits[hw[i] >> 4];
+		*p++ = digits[hw[i] & 0x0f];
+		*p++ = ':';
+	}
+	p[-1] = '\0';
+	return out;
+}
+
+/**
+ * Writes an IP Address in dotted decimal. Unlike inet_ntoa(), it can be
+ * called from several threads at once.
+ *
+ * @param ip The IP Address, network byte order.
+ * @param out A buffer of at least IP_ADDR_STRLEN bytes.
+ * @return out.
+ */
+inline char* formatIPAddr( uint32_t ip, char *out )
+{
+	// The digits of every octet and how many there are.
+	struct Octets{
+		char text[256][4];
+
+		Octets(){
+			for( int i = 0 ; i < 256 ; i++ ){
+				int n = i >= 100 ? 3 : i >= 10 ? 2 : 1;
+
+				text[i][3] = n;
+				for( int j = n - 1, v = i ; j >= 0 ; j--, v /= 10 )
+					text[i][j] = '0' + v % 10;
+			}
+		}
+	};
+	static const Octets octets;
+	const uint8_t *b = reinterpret_cast<const uint8_t*>( &ip );
+	char *p = out;
+
+	for( int i = 0 ; i < IP_ADDR_LEN ; i++ ){
+		const char *t = octets.text[b[i]];
+
+		memcpy( p, t, 4 ); // Only the digits count.
+		p += t[3];
+		*p++ = '.';
+	}
+	p[-1] = '\0';
+	return out;
+}
+
+/**
+ * Writes a time as UTC with nanoseconds, like 2024-01-31T23:59:59.123456789Z.
+ *
+ * @param ns The time in nanoseconds since the epoch.
+ * @param out A buffer of at least TIME_STRLEN bytes.
+ * @return out.
+ */
+inline char* formatTimestamp( uint64_t ns, char *out )
+{
+	time_t secs = ns / 1000000000ULL;
+	uint32_t frac = ns % 1000000000ULL;
+	struct tm utc;
+	size_t n;
+
+	gmtime_r( &secs, &utc );
+	n = strftime( out, TIME_STRLEN, "%Y-%m-%dT%H:%M:%S", &utc );
+	out[n++] = '.';
+	for( int i = 8 ; i >= 0 ; i--, frac /= 10 )
+		out[n + i] = '0' + frac % 10;
+	out[n + 9] = 'Z';
+	out[n + 10] = '\0';
+	return out;
+}
+
+/**
+ * A HW Address formatted on the stack, to be written to a stream:
+ * cout << HWText( hw.hw ).
+ */
+struct HWText{
+	char str[HW_ADDR_STRLEN];
+
+	explicit HWText( const uint8_t hw[] ){ formatHWAddr( hw, str ); }
+};
+
+/**
+ * An IP Address formatted on the stack, to be written to a stream:
+ * cout << IPText( ip.s_addr ).
+ */
+struct IPText{
+	char str[IP_ADDR_STRLEN];
+
+	explicit IPText( uint32_t ip ){ formatIPAddr( ip, str ); }
+};
+
+inline std::ostream& operator << ( std::ostream &out, const HWText &t ){
+	return out << t.str;
+}
+
+inline std::ostream& operator << ( std::ostream &out, const IPText &t ){
+	return out << t.str;
+}
+
+
+// ===============================
+// Data types
+// ===============================
+
+/**
+ * Stores a MAC Address
+ */
+struct HWAddr{
+	uint8_t hw[MAC_ADDR_LEN];
+
+	/**
+	 * Creates an HWAddr object from an array of bytes with length size of 6.
+	 *
+	 * @param m The array with the 6 bytes of the HW Address.
+	 */
+	HWAddr( const uint8_t m[] ){
+		memcpy( hw, m, MAC_ADDR_LEN );
+	}
+
+	bool operator < ( const HWAddr &m ) const {
+		return memcmp( hw, m.hw, MAC_ADDR_LEN ) < 0;
+	}
+
+	/**
+	 * Get a string representation of the HW Address in
+	 * the format xx:xx:xx:xx:xx:xx.
+	 *
+	 * @return The string representation of the HW Address.
+	 */
+	std::string toString() const {
+		char str[HW_ADDR_STRLEN];
+
+		return formatHWAddr( hw, str );
+	}
+
+};
+
+/**
+ * The representation of a ARP Frame including the
+ * ethernet header.
+ */
+struct ARPFrame{
+	uint8_t		eth_dst[MAC_ADDR_LEN]; 	///< Ethernet destination address.
+	uint8_t		eth_src[MAC_ADDR_LEN]; 	///< Ethernet source address.
+	uint16_t	eth_ethertype;			///< Eheternet ethertype.
+	uint16_t	hw_type; 				///< ARP hardware type (Ethernet 0x0001).
+	uint16_t	protocol;				///< ARP protocol (IP 0x0800).
+	uint8_t		hw_len;					///< ARP lenght in bytes of hardware address.
+	uint8_t		proto_len;				///< ARP lenght in byte of protocol address.
+	uint16_t	opcode;					///< ARP Operation code (0x0001 for request, 0x0002 for reply).
+	uint8_t		hw_src[MAC_ADDR_LEN]; 	///< ARP source HW address.
+	uint32_t	ip_src;					///< ARP source Protocol address.
+	uint8_t		hw_dst[MAC_ADDR_LEN];	///< ARP target HW address.
+	uint32_t	ip_dst;					///< ARP target Protocol address.
+} __attribute__((__packed__));
+
+/**
+ * The fields of a received ARP frame that the guard checks, with the
+ * time it was received and the frame itself.
+ */
+struct ARPRecord{
+	uint8_t		hw_src[MAC_ADDR_LEN];	///< ARP source HW address.
+	uint16_t	opcode;					///< ARP Operation code, host byte order.
+	uint32_t	ip_src;					///< ARP source Protocol address.
+	uint32_t	ip_dst;					///< ARP target Protocol address.
+	uint64_t	timestamp;				///< Reception time, in nanoseconds since the epoch.
+	ARPFrame	frame;					///< The frame as received, kept as evidence.
+};
+
+/** Stores some info about the netdevice */
+struct LocalData{
+	int ifindex;					///< Index of the network interface.
+	uint32_t ipAddr;				///< IP Address of the network interface.
+	uint32_t firstHost;				///< IP Address of the first host in the network.
+	uint32_t lastHost;				///< IP Address of the last host in the network.
+	uint8_t hwAddr[MAC_ADDR_LEN];	///< Hawrdware Address of the network interface.
+};
+
+/**
+ * Packs a HW Address in an integer, so it can be compared and stored
+ * atomically.
+ */
+inline uint64_t packHWAddr( const uint8_t hw[] )
+{
+	uint64_t v = 0;
+
+	memcpy( &v, hw, MAC_ADDR_LEN );
+	return v;
+}
+
+/**
+ * Unpacks a HW Address stored by packHWAddr().
+ */
+inline HWAddr unpackHWAddr( uint64_t v )
+{
+	uint8_t hw[8];
+
+	memcpy( hw, &v, sizeof(v) );
+	return HWAddr( hw );
+}
+
+/**
+ * @return The time of CLOCK_MONOTONIC in nanoseconds.
+ */
+inline uint64_t monotonicNs()
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @return The time of CLOCK_REALTIME in nanoseconds since the epoch.
+ */
+inline uint64_t realtimeNs()
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_REALTIME, &ts );
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,474 @@
+/**
+ * @file: arp_table.h
+ *
+ * The table of bindings between HW Addresses and IP Addresses. A router
+ * or a multi-homed server answers for several IP Addresses, and several
+ * devices can answer for one, so every (HW Address, IP Address) pair is
+ * kept. Both directions are indexed by open addressing hash tables whose
+ * values keep their first items inline.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef ARP_TABLE_H
+#define ARP_TABLE_H
+
+#include <utility>
+
+#include <cstring>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+#include "anti_arpspoof.h"
+
+
+/**
+ * Vector of trivially copyable items that stores the first N of them
+ * inside the object and only allocates when there are more.
+ */
+template<class T, unsigned N>
+class SmallVector{
+public:
+	SmallVector() : count( 0 ), cap( N ) {}
+
+	SmallVector( const SmallVector &v ) : count( 0 ), cap( N ) {
+		*this = v;
+	}
+
+	SmallVector( SmallVector &&v ) : count( 0 ), cap( N ) {
+		swap( v );
+	}
+
+	~SmallVector(){
+		if( cap > N )
+			delete[] heap;
+	}
+
+	SmallVector& operator = ( const SmallVector &v ){
+		if( this != &v ){
+			count = 0;
+			reserve( v.count );
+			memcpy( data(), v.data(), v.count * sizeof(T) );
+			count = v.count;
+		}
+		return *this;
+	}
+
+	SmallVector& operator = ( SmallVector &&v ){
+		swap( v );
+		return *this;
+	}
+
+	void swap( SmallVector &v ){
+		SmallVector *small = cap > N ? &v : this;
+		SmallVector *other = small == this ? &v : this;
+
+		if( cap > N && v.cap > N ){
+			std::swap( heap, v.heap );
+			std::swap( cap, v.cap );
+		}
+		else if( other->cap > N ){
+			// One inline and one allocated: the buffer changes of owner.
+			T *buffer = other->heap;
+			memcpy( other->inl, small->inl, small->count * sizeof(T) );
+			small->heap = buffer;
+			std::swap( small->cap, other->cap );
+		}
+		else{
+			T tmp[N];
+			memcpy( tmp, inl, count * sizeof(T) );
+			memcpy( inl, v.inl, v.count * sizeof(T) );
+			memcpy( v.inl, tmp, count * sizeof(T) );
+		}
+		std::swap( count, v.count );
+	}
+
+	T* data(){ return cap > N ? heap : inl; }
+	const T* data() const { return cap > N ? heap : inl; }
+	const T* begin() const { return data(); }
+	const T* end() const { return data() + count; }
+	uint32_t size() const { return count; }
+	bool empty() const { return !count; }
+	const T& operator [] ( uint32_t i ) const { return data()[i]; }
+
+	bool contains( const T &item ) const {
+		for( uint32_t i = 0 ; i < count ; i++ )
+			if( data()[i] == item )
+				return true;
+		return false;
+	}
+
+	/** Removes all the items and frees the allocated memory. */
+	void clear(){
+		if( cap > N )
+			delete[] heap;
+		count = 0;
+		cap = N;
+	}
+
+	void push_back( const T &item ){
+		reserve( count + 1 );
+		data()[count++] = item;
+	}
+
+	/** Removes an item, the last item takes its place. */
+	bool remove( const T &item ){
+		T *d = data();
+
+		for( uint32_t i = 0 ; i < count ; i++ ){
+			if( d[i] == item ){
+				d[i] = d[--count];
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/** @return The bytes allocated out of the object. */
+	size_t heapUsage() const {
+		return cap > N ? cap * sizeof(T) : 0;
+	}
+
+private:
+	uint32_t count;
+	uint32_t cap;
+	union{
+		T inl[N];
+		T *heap;
+	};
+
+	void reserve( uint32_t n ){
+		if( n <= cap )
+			return;
+		uint32_t c = cap * 2 > n ? cap * 2 : n;
+		T *buffer = new T[c];
+		memcpy( buffer, data(), count * sizeof(T) );
+		if( cap > N )
+			delete[] heap;
+		heap = buffer;
+		cap = c;
+	}
+};
+
+/**
+ * Hash table with linear probing for integer keys. The key 0 marks the
+ * empty slots, so it's kept out of them, in an entry of its own: a zero
+ * MAC or 0.0.0.0 can come in any frame. V must have a clear() method.
+ */
+template<class K, class V>
+class FlatMap{
+public:
+	FlatMap() : entries( NULL ), mask( 0 ), count( 0 ), hasZero( false ) {}
+
+	FlatMap( const FlatMap &m ) : entries( NULL ), mask( 0 ), count( 0 ), hasZero( false ) {
+		*this = m;
+	}
+
+	~FlatMap(){
+		delete[] entries;
+	}
+
+	FlatMap& operator = ( const FlatMap &m ){
+		if( this != &m ){
+			delete[] entries;
+			entries = NULL;
+			mask = m.mask;
+			count = m.count;
+			hasZero = m.hasZero;
+			zero = m.zero;
+			if( m.entries ){
+				entries = new Entry[mask + 1];
+				for( size_t i = 0 ; i <= mask ; i++ )
+					entries[i] = m.entries[i];
+			}
+		}
+		return *this;
+	}
+
+	/** @return The value of the key, NULL if it's not stored. */
+	const V* find( K key ) const {
+		if( !key )
+			return hasZero ? &zero.value : NULL;
+		if( !entries )
+			return NULL;
+		for( size_t i = home( key ) ; entries[i].key ; i = (i + 1) & mask )
+			if( entries[i].key == key )
+				return &entries[i].value;
+		return NULL;
+	}
+
+	V* find( K key ){
+		return const_cast<V*>( static_cast<const FlatMap*>( this )->find( key ) );
+	}
+
+	/** @return The value of the key, a new empty one if it wasn't stored. */
+	V& operator [] ( K key ){
+		size_t i;
+
+		if( !key ){
+			count += !hasZero;
+			hasZero = true;
+			return zero.value;
+		}
+		if( (count + 1) * 10 > (mask + 1) * 7 )
+			grow();
+		for( i = home( key ) ; entries[i].key ; i = (i + 1) & mask )
+			if( entries[i].key == key )
+				return entries[i].value;
+		entries[i].key = key;
+		count++;
+		return entries[i].value;
+	}
+
+	/** Removes the key, moving back the entries of its probe sequence. */
+	bool erase( K key ){
+		size_t i, j;
+
+		if( !key ){
+			if( !hasZero )
+				return false;
+			hasZero = false;
+			zero.value.clear();
+			count--;
+			return true;
+		}
+		if( !entries )
+			return false;
+		for( i = home( key ) ; entries[i].key != key ; i = (i + 1) & mask )
+			if( !entries[i].key )
+				return false;
+		for( j = (i + 1) & mask ; entries[j].key ; j = (j + 1) & mask ){
+			size_t h = home( entries[j].key );
+
+			// The entry can fill the hole if its home isn't between them.
+			if( ((j - h) & mask) >= ((j - i) & mask) ){
+				entries[i].key = entries[j].key;
+				entries[i].value = std::move( entries[j].value );
+				i = j;
+			}
+		}
+		entries[i].key = 0;
+		entries[i].value.clear();
+		count--;
+		return true;
+	}
+
+	size_t size() const { return count; }
+
+	/** Allocates the slots for n keys, so adding them won't allocate. */
+	void reserve( size_t n ){
+		while( (n + 1) * 10 > (entries ? mask + 1 : 0) * 7 )
+			grow();
+	}
+
+	/** Calls f( K key, const V &value ) for every entry. */
+	template<class F>
+	void forEach( F f ) const {
+		if( hasZero )
+			f( zero.key, zero.value );
+		for( size_t i = 0 ; entries && i <= mask ; i++ )
+			if( entries[i].key )
+				f( entries[i].key, entries[i].value );
+	}
+
+	/** @return The bytes used by the slots, without the values' own memory. */
+	size_t slotUsage() const {
+		return entries ? (mask + 1) * sizeof(Entry) : 0;
+	}
+
+private:
+	struct Entry{
+		K key;
+		V value;
+
+		Entry() : key( 0 ) {}
+	};
+
+	Entry *entries;
+	size_t mask;
+	size_t count;
+	bool hasZero;	///< The key 0 is stored, in zero.
+	Entry zero;		///< The entry of the key 0.
+
+	size_t home( K key ) const {
+		return ((uint64_t) key * 0x9E3779B97F4A7C15ULL >> 32) & mask;
+	}
+
+	void grow(){
+		Entry *old = entries;
+		size_t oldSize = entries ? mask + 1 : 0;
+
+		mask = oldSize ? oldSize * 2 - 1 : 15;
+		entries = new Entry[mask + 1];
+		for( size_t i = 0 ; i < oldSize ; i++ ){
+			if( old[i].key ){
+				size_t j;
+				for( j = home( old[i].key ) ; entries[j].key ; j = (j + 1) & mask )
+					;
+				entries[j].key = old[i].key;
+				entries[j].value = std::move( old[i].value );
+			}
+		}
+		delete[] old;
+	}
+};
+
+/**
+ * Set of IP Addresses (network byte order) on a FlatMap, so it can be
+ * allocated beforehand.
+ */
+class IPSet{
+public:
+	/** Allocates room for n IP Addresses. */
+	void reserve( size_t n ){ set.reserve( n ); }
+
+	/** @return false if it was already in the set. */
+	bool insert( uint32_t ip ){
+		Flag &f = set[ip];
+
+		if( f.on )
+			return false;
+		f.on = true;
+		return true;
+	}
+
+	bool contains( uint32_t ip ) const { return set.find( ip ); }
+
+	size_t size() const { return set.size(); }
+
+private:
+	struct Flag{
+		bool on;
+
+		Flag() : on( false ) {}
+		void clear(){ on = false; }
+	};
+
+	FlatMap<uint32_t, Flag> set;
+};
+
+/**
+ * The bindings between HW Addresses and IP Addresses (network byte order).
+ * Checking a pair and finding the owners of an IP Address take constant
+ * time.
+ */
+class ARPTable{
+public:
+	typedef SmallVector<uint32_t, 2> IPList;	///< IP Addresses of one HW Address.
+	typedef SmallVector<uint64_t, 1> HWList;	///< Packed HW Addresses of one IP Address.
+
+	ARPTable() : bindings( 0 ) {}
+
+	/**
+	 * Adds a binding.
+	 *
+	 * @return false if it was already in the table.
+	 */
+	bool add( const HWAddr &hw, struct in_addr ip ){
+		uint64_t key = packHWAddr( hw.hw );
+		HWList &hws = byIP[ip.s_addr];
+
+		// An IP Address has few owners, a HW Address can have thousands of IPs.
+		if( hws.contains( key ) )
+			return false;
+		hws.push_back( key );
+		byHW[key].push_back( ip.s_addr );
+		bindings++;
+		return true;
+	}
+
+	/**
+	 * Removes a binding.
+	 *
+	 * @return false if it wasn't in the table.
+	 */
+	bool remove( const HWAddr &hw, struct in_addr ip ){
+		uint64_t key = packHWAddr( hw.hw );
+		HWList *hws = byIP.find( ip.s_addr );
+
+		if( !hws || !hws->remove( key ) )
+			return false;
+		if( hws->empty() )
+			byIP.erase( ip.s_addr );
+		IPList *ips = byHW.find( key );
+		ips->remove( ip.s_addr );
+		if( ips->empty() )
+			byHW.erase( key );
+		bindings--;
+		return true;
+	}
+
+	/**
+	 * Removes all the bindings of an IP Address.
+	 *
+	 * @return The number of bindings removed.
+	 */
+	size_t removeIP( struct in_addr ip ){
+		const HWList *hws = byIP.find( ip.s_addr );
+		HWList owners;
+		size_t n = 0;
+
+		if( hws )
+			owners = *hws;
+		for( uint64_t hw : owners )
+			n += remove( unpackHWAddr( hw ), ip );
+		return n;
+	}
+
+	/** @return true if the binding is in the table. */
+	bool contains( const HWAddr &hw, struct in_addr ip ) const {
+		const HWList *hws = byIP.find( ip.s_addr );
+
+		return hws && hws->contains( packHWAddr( hw.hw ) );
+	}
+
+	/** @return The IP Addresses of a HW Address, NULL if it's unknown. */
+	const IPList* addressesOf( const HWAddr &hw ) const {
+		return byHW.find( packHWAddr( hw.hw ) );
+	}
+
+	/** @return The packed HW Addresses of an IP Address, NULL if it's unknown. */
+	const HWList* ownersOf( struct in_addr ip ) const {
+		return byIP.find( ip.s_addr );
+	}
+
+	/** @return The number of bindings. */
+	size_t size() const { return bindings; }
+
+	bool empty() const { return !bindings; }
+
+	/** @return The bytes of memory used by the table. */
+	size_t memoryUsage() const {
+		size_t bytes = sizeof(*this) + byHW.slotUsage() + byIP.slotUsage();
+
+		byHW.forEach( [&]( uint64_t, const IPList &v ){ bytes += v.heapUsage(); } );
+		byIP.forEach( [&]( uint32_t, const HWList &v ){ bytes += v.heapUsage(); } );
+		return bytes;
+	}
+
+	/** Calls f( const HWAddr &hw, struct in_addr ip ) for every binding. */
+	template<class F>
+	void forEach( F f ) const {
+		byHW.forEach( [&]( uint64_t key, const IPList &ips ){
+			HWAddr hw = unpackHWAddr( key );
+
+			for( uint32_t addr : ips ){
+				struct in_addr ip = { addr };
+				f( hw, ip );
+			}
+		} );
+	}
+
+private:
+	FlatMap<uint64_t, IPList> byHW;	///< IP Addresses by packed HW Address.
+	FlatMap<uint32_t, HWList> byIP;	///< Packed HW Addresses by IP Address.
+	size_t bindings;
+};
+
+#endif
@@ -0,0 +1,148 @@
+/**
+ * @file: correlation.h
+ *
+ * Matches ARP replies with the requests seen on the wire, so the guard
+ * knows if a reply was asked for. A reply that nobody asked for and
+ * changes a binding is the usual sign of poisoning.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef CORRELATION_H
+#define CORRELATION_H
+
+#include <atomic>
+
+#include <stdint.h>
+
+/// Number of slots of the table of requests (power of two).
+#define REQUEST_SLOTS		4096
+
+/// Slots per bucket. A bucket fits in one cache line.
+#define REQUEST_WAYS		4
+
+/// Time in milliseconds that a request waits for its replies.
+#define REQUEST_TTL_MS		1000
+
+
+/**
+ * Counters of one worker about the requests and replies matched. They're
+ * written by the worker only, and read by the others.
+ */
+struct CorrelationStats{
+	std::atomic<uint64_t> hits;			///< Replies that matched a request.
+	std::atomic<uint64_t> misses;		///< Replies without a request.
+	std::atomic<uint64_t> evictions;	///< Requests dropped before expiring, because the bucket was full.
+
+	CorrelationStats() : hits( 0 ), misses( 0 ), evictions( 0 ) {}
+
+	/**
+	 * Adds one to a counter. Only the worker can call it: it's a load and
+	 * a store, without the locked instruction of fetch_add().
+	 */
+	static void count( std::atomic<uint64_t> &counter ){
+		counter.store( counter.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+	}
+};
+
+/**
+ * Fixed size hash table of the requests waiting for replies, keyed by
+ * (requester IP, target IP). It never allocates: when a bucket is full
+ * the request closest to expire is replaced, so a flood of requests
+ * only shortens how long they're remembered.
+ *
+ * Shared by the workers without locks. The key and the expiry of a slot
+ * are stored apart, two workers writing the same slot at once can mix
+ * them up; the worst outcome is one reply tagged wrong.
+ */
+class RequestTable{
+public:
+	RequestTable(){
+		for( int i = 0 ; i < REQUEST_SLOTS ; i++ ){
+			slots[i].key = 0;
+			slots[i].expires = 0;
+		}
+	}
+
+	/**
+	 * Remembers a request.
+	 *
+	 * @param requester The sender IP Address of the request.
+	 * @param target The IP Address asked for.
+	 * @param nowMs The current time, CLOCK_MONOTONIC ms.
+	 * @param stats The counters of the worker.
+	 */
+	void request( uint32_t requester, uint32_t target, uint32_t nowMs, CorrelationStats &stats ){
+		uint64_t key = makeKey( requester, target );
+		Slot *bucket = slots + bucketOf( key );
+		Slot *victim = NULL;
+
+		for( int i = 0 ; i < REQUEST_WAYS ; i++ ){
+			Slot &s = bucket[i];
+
+			if( s.key == key ){
+				s.expires = nowMs + REQUEST_TTL_MS;
+				return;
+			}
+			if( !victim || live( s, nowMs ) < live( *victim, nowMs ) ||
+					(live( s, nowMs ) && live( *victim, nowMs ) &&
+					 (int32_t) (s.expires - victim->expires) < 0) )
+				victim = &s;
+		}
+		if( live( *victim, nowMs ) )
+			CorrelationStats::count( stats.evictions );
+		victim->key = key;
+		victim->expires = nowMs + REQUEST_TTL_MS;
+	}
+
+	/**
+	 * Checks if a reply was asked for, and updates the counters.
+	 *
+	 * @param sender The sender IP Address of the reply.
+	 * @param target The target IP Address of the reply.
+	 * @param nowMs The current time, CLOCK_MONOTONIC ms.
+	 * @param stats The counters of the worker.
+	 * @return true if there's a request from target for sender.
+	 */
+	bool reply( uint32_t sender, uint32_t target, uint32_t nowMs, CorrelationStats &stats ){
+		uint64_t key = makeKey( target, sender );
+		Slot *bucket = slots + bucketOf( key );
+
+		// A request can have several replies, so the slot is kept.
+		for( int i = 0 ; i < REQUEST_WAYS ; i++ ){
+			if( bucket[i].key == key && live( bucket[i], nowMs ) ){
+				CorrelationStats::count( stats.hits );
+				return true;
+			}
+		}
+		CorrelationStats::count( stats.misses );
+		return false;
+	}
+
+private:
+	struct Slot{
+		std::atomic<uint64_t> key;		///< requester << 32 | target, 0 if empty.
+		std::atomic<uint32_t> expires;	///< CLOCK_MONOTONIC ms.
+	};
+
+	Slot slots[REQUEST_SLOTS] __attribute__((aligned(64)));
+
+	static uint64_t makeKey( uint32_t requester, uint32_t target ){
+		return (uint64_t) requester << 32 | target;
+	}
+
+	static unsigned bucketOf( uint64_t key ){
+		return (key * 0x9E3779B97F4A7C15ULL) >> 32 & (REQUEST_SLOTS - REQUEST_WAYS);
+	}
+
+	static bool live( const Slot &s, uint32_t nowMs ){
+		return s.key && (int32_t) (s.expires - nowMs) > 0;
+	}
+};
+
+#endif
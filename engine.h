@@ -0,0 +1,327 @@
+/**
+ * @file: engine.h
+ *
+ * The checks of the ARP frames, apart from where the frames come from.
+ * The guard and the analysis of capture files run the same checks over
+ * the spans of a FrameSource, and the decisions of the guard about a
+ * frame are taken here too, with what's done about them left to hooks,
+ * so the tool, the benchmark and the simulator share them.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <map>
+#include <utility>
+
+#include <cstring>
+#include <stdint.h>
+
+#include <linux/if_arp.h>
+#include <linux/if_ether.h>
+
+#include "anti_arpspoof.h"
+#include "arp_table.h"
+#include "correlation.h"
+#include "frame_source.h"
+#include "probes.h"
+#include "profiler.h"
+
+/// IP Addresses a worker can ignore before its set has to grow.
+#define IGNORED_RESERVE	1024
+
+
+/**
+ * Takes the fields to check from an Ethernet frame. The frame can have one
+ * 802.1Q tag, as captured from a SPAN port.
+ *
+ * @param data The frame.
+ * @param len The number of bytes captured.
+ * @param timestamp The capture time, in nanoseconds since the epoch.
+ * @param rec Where the fields are stored.
+ * @return false if it's not an ARP frame for IPv4 over Ethernet.
+ */
+inline bool parseEthernet( const uint8_t *data, uint32_t len, uint64_t timestamp, ARPRecord &rec )
+{
+	uint32_t off = 12;
+
+	if( len < sizeof(ARPFrame) )
+		return false;
+	if( (data[off] << 8 | data[off + 1]) == ETH_P_8021Q )
+		off += 4;
+	if( (data[off] << 8 | data[off + 1]) != ETH_P_ARP || len < off + 2 + 28 )
+		return false;
+
+	const uint8_t *arp = data + off + 2;
+	if( (arp[0] << 8 | arp[1]) != ARPHRD_ETHER || (arp[2] << 8 | arp[3]) != ETH_P_IP ||
+			arp[4] != MAC_ADDR_LEN || arp[5] != IP_ADDR_LEN )
+		return false;
+	memcpy( rec.hw_src, arp + 8, MAC_ADDR_LEN );
+	rec.opcode = arp[6] << 8 | arp[7];
+	memcpy( &rec.ip_src, arp + 14, IP_ADDR_LEN );
+	memcpy( &rec.ip_dst, arp + 24, IP_ADDR_LEN );
+	rec.timestamp = timestamp;
+	// Without the tag.
+	memcpy( &rec.frame, data, 2 * MAC_ADDR_LEN );
+	memcpy( (uint8_t*) &rec.frame + 2 * MAC_ADDR_LEN, data + off, 2 + 28 );
+	return true;
+}
+
+/** What inspect() found in an ARP frame. */
+enum Finding{
+	FINDING_NONE,		///< Nothing wrong, or it's not a reply.
+	FINDING_NEW_DEVICE,	///< The sender is not in the table.
+	FINDING_CONFLICT	///< The sender claims an IP Address that it doesn't have in the table.
+};
+
+/**
+ * The checks of one ARP frame. Requests are remembered to tell if the
+ * replies were asked for.
+ *
+ * @param rec The fields of the frame.
+ * @param senders A table with the bindings of the sender.
+ * @param all The whole table.
+ * @param requests The requests waiting for replies.
+ * @param stats The counters of the worker.
+ * @param nowMs The time of the frame, in milliseconds.
+ * @param solicited Where it's stored if a reply was asked for.
+ * @param owner Where the packed HW Address of the IP Address in the table
+ * is stored on a conflict, 0 if none.
+ * @return What was found.
+ */
+inline Finding inspect( const ARPRecord &rec, const ARPTable &senders, const ARPTable &all,
+		RequestTable &requests, CorrelationStats &stats, uint32_t nowMs, bool &solicited,
+		uint64_t &owner )
+{
+	if( rec.opcode == ARPOP_REQUEST ){
+		requests.request( rec.ip_src, rec.ip_dst, nowMs, stats );
+		return FINDING_NONE;
+	}
+	// Verify the reply
+	if( rec.opcode != ARPOP_REPLY )
+		return FINDING_NONE;
+
+	HWAddr hw( rec.hw_src );
+	struct in_addr ip = { rec.ip_src };
+
+	solicited = requests.reply( rec.ip_src, rec.ip_dst, nowMs, stats );
+
+	// Check our ARP Table for the sender.
+	if( !senders.addressesOf( hw ) ) // The HW Address of the sender is not in our ARP Table
+		return FINDING_NEW_DEVICE;
+	if( senders.contains( hw, ip ) )
+		return FINDING_NONE;
+
+	const ARPTable::HWList *owners = all.ownersOf( ip ); // Look for the IP Address, if it is.
+	owner = owners ? (*owners)[0] : 0;
+	return FINDING_CONFLICT;
+}
+
+/** The state of the checks of the guard owned by one worker. */
+struct CheckState{
+	unsigned id;					///< Index of the worker, the one that gives the verdict of its verifications.
+	IPSet ignored;					///< IP Addresses already notified by the worker.
+	CorrelationStats correlation;	///< Replies matched with requests.
+
+	// The set doesn't grow for the first poisonings.
+	CheckState() : id( 0 ) {
+		ignored.reserve( IGNORED_RESERVE );
+	}
+};
+
+/**
+ * The decisions of the guard about one ARP frame. If the sender claims
+ * an IP Address of another device, a verification of the IP Address is
+ * started, unless it was already notified or is being verified; if
+ * there's no room for it, the poisoning is notified right away. What's
+ * done about each decision is left to the hooks, callable as:
+ *
+ *	- stage( Stage s ): a stage of the path of the frame ended.
+ *	- inspected( const ARPRecord &rec, Finding found ): the frame was checked.
+ *	- newDevice( const ARPRecord &rec, bool solicited ): the sender is not in the table.
+ *	- conflict( const ARPRecord &rec, bool known ): the sender claims an IP
+ *	  Address of another device; known if it was already notified or is
+ *	  being verified.
+ *	- probe( const ARPRecord &rec, uint64_t owner ): a verification was
+ *	  started, the probes must be sent.
+ *	- alert( const HWAddr &hw, struct in_addr ip, bool unsolicited,
+ *	  uint64_t arrival, const Probe *probe ): a poisoning, probe is NULL
+ *	  if it couldn't be verified. The worker ignores the IP Address after it.
+ *
+ * @param rec The fields of the frame.
+ * @param senders A table with the bindings of the sender.
+ * @param all The whole table.
+ * @param requests The requests waiting for replies.
+ * @param probes The verifications in progress.
+ * @param state The state of the worker.
+ * @param nowNs The current time, the clock of the deadlines of the
+ * verifications, in nanoseconds.
+ * @param hooks What's done about the decisions.
+ * @return What inspect() found.
+ */
+template<class Hooks>
+inline Finding checkFrame( const ARPRecord &rec, const ARPTable &senders, const ARPTable &all,
+		RequestTable &requests, ProbeTable &probes, CheckState &state, uint64_t nowNs, Hooks &hooks )
+{
+	bool solicited = false;
+	uint64_t owner = 0;
+	Finding found = inspect( rec, senders, all, requests, state.correlation, nowNs / 1000000,
+			solicited, owner );
+
+	if( rec.opcode == ARPOP_REPLY )
+		probes.observe( rec.ip_src, rec.hw_src );
+	hooks.inspected( rec, found );
+	hooks.stage( STAGE_LOOKUP );
+
+	if( found == FINDING_NEW_DEVICE ){
+		hooks.newDevice( rec, solicited );
+		hooks.stage( STAGE_ALERT );
+		return found;
+	}
+	if( found != FINDING_CONFLICT )
+		return found;
+
+	bool known = state.ignored.contains( rec.ip_src ) || probes.pending( rec.ip_src );
+	hooks.stage( STAGE_SUPPRESS );
+	hooks.conflict( rec, known );
+	if( known )
+		return found;
+
+	Launch launched = probes.launch( rec.ip_src, rec.hw_src, owner, !solicited, state.id,
+			nowNs + PROBE_WINDOW_MS * 1000000ULL, rec.timestamp );
+
+	if( launched == LAUNCH_STARTED ){
+		hooks.probe( rec, owner );
+		hooks.stage( STAGE_ALERT );
+	}
+	else if( launched == LAUNCH_FULL ){ // No room to verify it.
+		struct in_addr ip = { rec.ip_src };
+
+		hooks.alert( HWAddr( rec.hw_src ), ip, !solicited, rec.timestamp, (const Probe*) NULL );
+		state.ignored.insert( rec.ip_src );
+	}
+	return found;
+}
+
+/**
+ * Gives the verdict of the verifications of a worker that ended, see
+ * checkFrame().
+ *
+ * @param probes The verifications in progress.
+ * @param state The state of the worker.
+ * @param nowNs The current time, in the clock given to checkFrame().
+ * @param hooks Its alert() is called for every verification ended.
+ */
+template<class Hooks>
+inline void expireProbes( ProbeTable &probes, CheckState &state, uint64_t nowNs, Hooks &hooks )
+{
+	probes.expire( state.id, nowNs, [&]( const Probe &p ){
+		struct in_addr ip = { p.ip };
+
+		hooks.alert( unpackHWAddr( p.claimant ), ip, p.unsolicited, p.arrival, &p );
+		state.ignored.insert( p.ip );
+	} );
+}
+
+/** A poisoning found by a Detector. */
+struct Poisoning{
+	uint64_t timestamp;		///< Time of the first reply of the claim, in nanoseconds since the epoch.
+	uint64_t claimant;		///< Packed HW Address that claimed the IP Address.
+	uint64_t owner;			///< Packed HW Address of the IP Address in the table.
+	uint32_t ip;			///< IP Address poisoned.
+	bool solicited;			///< The reply was asked for.
+};
+
+/**
+ * Looks for poisoning in frames without a scan to start with: the table
+ * is learned from the replies, and a reply that claims an IP Address of
+ * another device is a poisoning. Each (HW Address, IP Address) claim is
+ * reported once, with its first reply.
+ */
+class Detector{
+public:
+	Detector() : frameCount( 0 ), arpCount( 0 ), replyCount( 0 ) {}
+
+	/**
+	 * Checks a span of frames.
+	 *
+	 * @param frames The frames, in the order they were captured.
+	 * @param n The number of frames.
+	 * @param report Callable as report( const Poisoning &p ), for every
+	 * new poisoning.
+	 */
+	template<class Report>
+	void process( const FrameRef *frames, int n, Report report ){
+		ARPRecord rec;
+
+		for( int i = 0 ; i < n ; i++ ){
+			bool solicited = false;
+			uint64_t owner = 0;
+
+			frameCount++;
+			if( !parseEthernet( frames[i].data, frames[i].len, frames[i].timestamp, rec ) )
+				continue;
+			arpCount++;
+
+			HWAddr hw( rec.hw_src );
+			struct in_addr ip = { rec.ip_src };
+			Finding found = inspect( rec, learned, learned, requests, stats,
+					rec.timestamp / 1000000, solicited, owner );
+
+			if( found == FINDING_NEW_DEVICE ){
+				const ARPTable::HWList *owners = learned.ownersOf( ip );
+				if( !owners ){
+					learned.add( hw, ip );
+					continue;
+				}
+				owner = (*owners)[0];
+			}
+			else if( found == FINDING_NONE )
+				continue;
+			else if( !owner ){ // A known device with one more IP Address.
+				learned.add( hw, ip );
+				continue;
+			}
+
+			replyCount++;
+			if( claims[std::make_pair( ip.s_addr, packHWAddr( hw.hw ) )]++ )
+				continue;
+
+			Poisoning p = { rec.timestamp, packHWAddr( hw.hw ), owner, ip.s_addr, solicited };
+			report( p );
+		}
+	}
+
+	/** @return The number of frames checked. */
+	uint64_t frames() const { return frameCount; }
+
+	/** @return The number of ARP frames among them. */
+	uint64_t arpFrames() const { return arpCount; }
+
+	/** @return The number of poisonings found. */
+	uint64_t poisonings() const { return claims.size(); }
+
+	/** @return The number of replies of all the poisonings. */
+	uint64_t replies() const { return replyCount; }
+
+	/** @return The bindings learned. */
+	const ARPTable& table() const { return learned; }
+
+private:
+	ARPTable learned;
+	RequestTable requests;
+	CorrelationStats stats;
+	std::map< std::pair<uint32_t, uint64_t>, uint64_t > claims;	///< Replies of each poisoning.
+	uint64_t frameCount;
+	uint64_t arpCount;
+	uint64_t replyCount;
+};
+
+#endif
@@ -0,0 +1,257 @@
+/**
+ * @file: event_log.h
+ *
+ * The log of what the tool finds, one JSON object per line. Every thread
+ * that reports events has its own lock-free queue of fixed-size records;
+ * a background thread formats them and writes them in batches, so a
+ * storm of events never makes the guard wait for the output.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "anti_arpspoof.h"
+#include "spsc_ring.h"
+#include "table_file.h"
+
+/// Events of one thread waiting to be written.
+#define EVENT_QUEUE			4096
+
+/// Size in bytes of the batches written.
+#define EVENT_BATCH			(64 << 10)
+
+/// Longest line of the log, in bytes.
+#define EVENT_LINE			512
+
+/// Time in milliseconds that the writer sleeps when there's nothing to write.
+#define EVENT_POLL_MS		10
+
+
+/** What happened. */
+enum EventType{
+	EVENT_NEW_DEVICE,	///< A device that isn't in the table.
+	EVENT_POISONING,	///< A device claimed the IP Address of another one.
+	EVENT_CONFLICT		///< Several devices answered for an IP Address during a scan.
+};
+
+/** What the tool concluded about it. */
+enum Verdict{
+	VERDICT_UNVERIFIED,		///< Nothing could be checked.
+	VERDICT_OWNER_ANSWERS,	///< The owner still answers for the IP Address.
+	VERDICT_OWNER_SILENT,	///< The owner didn't answer, it may have changed its address.
+	VERDICT_AMBIGUOUS		///< It can't be told which device is the owner.
+};
+
+/** An event, as queued. */
+struct Event{
+	uint64_t timestamp;		///< When it happened, nanoseconds since the epoch.
+	uint64_t oldHW;			///< Packed HW Address of the owner in the table, 0 if none.
+	uint64_t newHW;			///< Packed HW Address of the device that claimed it.
+	uint32_t ip;			///< The IP Address, network byte order.
+	uint16_t others;		///< Answers from other devices while it was verified.
+	uint8_t type;			///< One of EventType.
+	uint8_t verdict;		///< One of Verdict.
+	bool unsolicited;		///< The claim was a reply nobody asked for.
+};
+
+/**
+ * Writes the events of several threads to a file or to the standard
+ * output. Each thread has its own queue, so submitting never blocks:
+ * when the queue is full the event is counted as dropped.
+ */
+class EventLog{
+public:
+	/**
+	 * Opens the file, appending to it, and starts the writer thread.
+	 *
+	 * @param path The path of the file, "-" for the standard output.
+	 * @param source The interface or capture file the events come from.
+	 * @param producers The number of threads that submit events.
+	 *
+	 * @throw runtime_error If the file couldn't be opened.
+	 */
+	EventLog( const std::string &path, const std::string &source, unsigned producers )
+		throw( std::runtime_error )
+		: filePath( path ), running( true ), written( 0 ), drops( 0 ), errors( 0 )
+	{
+		fd = path == "-" ? STDOUT_FILENO :
+			open( path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600 );
+		if( fd < 0 )
+			throw std::runtime_error( path + ": " + std::string(strerror(errno)) );
+		origin = escape( source );
+		for( unsigned i = 0 ; i < producers ; i++ )
+			queues.push_back( new SPSCRing<Event>( EVENT_QUEUE ) );
+		writer = std::thread( &EventLog::run, this );
+	}
+
+	~EventLog(){
+		stop();
+		if( fd != STDOUT_FILENO )
+			close( fd );
+		for( auto q : queues )
+			delete q;
+	}
+
+	/**
+	 * Writes the events still queued and stops the writer thread. No
+	 * event can be submitted after it.
+	 */
+	void stop(){
+		running = false;
+		if( writer.joinable() )
+			writer.join();
+	}
+
+	/**
+	 * Queues an event to be written. Only its thread can call it.
+	 *
+	 * @param producer The index of the thread.
+	 * @param e The event.
+	 */
+	void submit( unsigned producer, const Event &e ){
+		if( !queues[producer]->push( e ) )
+			drops++;
+	}
+
+	/** @return The number of events written. */
+	uint64_t events() const { return written; }
+
+	/** @return The number of events dropped because a queue was full. */
+	uint64_t dropped() const { return drops; }
+
+	/** @return The number of events lost because the file couldn't be written. */
+	uint64_t failures() const { return errors; }
+
+	/** @return The path of the file. */
+	const std::string& path() const { return filePath; }
+
+private:
+	std::string filePath;
+	std::string origin;		///< The source, escaped for JSON.
+	int fd;
+	std::vector< SPSCRing<Event>* > queues;
+	std::thread writer;
+	std::atomic<bool> running;
+	std::atomic<uint64_t> written;
+	std::atomic<uint64_t> drops;
+	std::atomic<uint64_t> errors;
+
+	/** Moves the queued events to the file until it's stopped. */
+	void run(){
+		std::vector<char> buffer( EVENT_BATCH );
+
+		while( true ){
+			bool stop = !running;
+			size_t used = 0;
+			uint64_t n = 0;
+			Event e;
+
+			for( auto q : queues ){
+				while( q->pop( e ) ){
+					used += format( e, &buffer[used] );
+					n++;
+					if( used > EVENT_BATCH - EVENT_LINE ){
+						flush( buffer.data(), used, n );
+						used = n = 0;
+					}
+				}
+			}
+			if( used )
+				flush( buffer.data(), used, n );
+			else if( stop )
+				break;
+			else
+				usleep( EVENT_POLL_MS * 1000 );
+		}
+	}
+
+	/**
+	 * Writes a batch of events to the file and counts them.
+	 *
+	 * @param data The lines of the events.
+	 * @param len The length of the lines.
+	 * @param n The number of events.
+	 */
+	void flush( const char *data, size_t len, uint64_t n ){
+		if( writeAll( fd, data, len ) )
+			written += n;
+		else
+			errors += n;
+	}
+
+	/**
+	 * Writes an event as a line of JSON.
+	 *
+	 * @param out A buffer of at least EVENT_LINE bytes.
+	 * @return The length of the line.
+	 */
+	size_t format( const Event &e, char *out ) const {
+		static const char *types[] = { "new_device", "poisoning", "conflict" };
+		static const char *verdicts[] = { "unverified", "owner_answers", "owner_silent", "ambiguous" };
+		char time[TIME_STRLEN], ip[IP_ADDR_STRLEN], oldHW[HW_ADDR_STRLEN + 2], newHW[HW_ADDR_STRLEN];
+
+		formatTimestamp( e.timestamp, time );
+		formatIPAddr( e.ip, ip );
+		formatHWAddr( unpackHWAddr( e.newHW ).hw, newHW );
+		if( e.oldHW ){
+			oldHW[0] = '"';
+			formatHWAddr( unpackHWAddr( e.oldHW ).hw, oldHW + 1 );
+			strcpy( oldHW + HW_ADDR_STRLEN, "\"" );
+		}
+		else
+			strcpy( oldHW, "null" );
+
+		int n = snprintf( out, EVENT_LINE, "{\"time\":\"%s\",\"interface\":\"%s\",\"event\":\"%s\","
+				"\"ip\":\"%s\",\"old_mac\":%s,\"new_mac\":\"%s\",\"verdict\":\"%s\","
+				"\"unsolicited\":%s,\"other_answers\":%u}\n",
+				time, origin.c_str(), types[e.type], ip, oldHW, newHW, verdicts[e.verdict],
+				e.unsolicited ? "true" : "false", (unsigned) e.others );
+
+		return n < EVENT_LINE ? n : EVENT_LINE - 1;
+	}
+
+	/** @return The text as the contents of a JSON string, cut if it's too long. */
+	static std::string escape( const std::string &text ){
+		std::string s;
+
+		for( unsigned char c : text.substr( 0, EVENT_LINE / 16 ) ){
+			char hex[8];
+
+			if( c == '"' || c == '\\' )
+				s += '\\';
+			if( c >= 0x20 )
+				s += c;
+			else{
+				snprintf( hex, sizeof(hex), "\\u%04x", c );
+				s += hex;
+			}
+		}
+		return s;
+	}
+
+	EventLog( const EventLog& );
+	EventLog& operator = ( const EventLog& );
+};
+
+#endif
@@ -0,0 +1,222 @@
+/**
+ * @file: evidence.h
+ *
+ * Evidence of the poisoning: the frames that claimed an IP Address, and
+ * the ARP frames received before them, saved to a pcap file. The workers
+ * only copy each frame into a ring; the file is written by a background
+ * thread.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef EVIDENCE_H
+#define EVIDENCE_H
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "anti_arpspoof.h"
+#include "spsc_ring.h"
+#include "table_file.h"
+#include "pcap_reader.h"
+
+/// ARP frames before a poisoning saved with it, by default.
+#define EVIDENCE_HISTORY	64
+
+/// Frames of one worker waiting to be written.
+#define EVIDENCE_QUEUE		4096
+
+/// Time in milliseconds that the writer sleeps when there's nothing to write.
+#define EVIDENCE_POLL_MS	10
+
+
+/**
+ * The last ARP frames received by one worker. It's written and read
+ * by the worker only.
+ */
+class FrameHistory{
+public:
+	/**
+	 * @param depth The number of frames kept before the last one.
+	 */
+	explicit FrameHistory( size_t depth ) : count( 0 ), exported( 0 ) {
+		size_t n = 1;
+
+		while( n < depth + 1 )
+			n <<= 1;
+		slots.resize( n );
+		mask = n - 1;
+	}
+
+	/** Keeps a frame, replacing the oldest one. */
+	void record( const ARPRecord &rec ){
+		slots[count++ & mask] = rec;
+	}
+
+	/**
+	 * Hands out the last frame recorded and the ones before it, oldest
+	 * first. Frames already handed out are skipped.
+	 *
+	 * @param preceding The number of frames before the last one.
+	 * @param f Callable as f( const ARPRecord &rec ).
+	 */
+	template<class F>
+	void drain( size_t preceding, F f ){
+		uint64_t keep = preceding < mask ? preceding + 1 : mask + 1;
+		uint64_t from = count > keep ? count - keep : 0;
+
+		for( uint64_t i = from > exported ? from : exported ; i < count ; i++ )
+			f( slots[i & mask] );
+		exported = count;
+	}
+
+private:
+	std::vector<ARPRecord> slots;
+	size_t mask;
+	uint64_t count;		///< Frames recorded.
+	uint64_t exported;	///< Frames recorded when drain() was last called.
+};
+
+/**
+ * Writes the evidence frames of all the workers to a pcap file. Each
+ * worker has its own queue, so submitting never blocks: when the queue
+ * is full the frame is counted as dropped.
+ */
+class EvidenceWriter{
+public:
+	/**
+	 * Creates the pcap file and starts the writer thread.
+	 *
+	 * @param path The path of the file.
+	 * @param workers The number of workers.
+	 * @param depth The number of frames saved before each poisoning.
+	 *
+	 * @throw runtime_error If the file couldn't be created.
+	 */
+	EvidenceWriter( const std::string &path, unsigned workers, size_t depth ) throw( std::runtime_error )
+		: filePath( path ), history( depth ), running( true ), written( 0 ), drops( 0 ), errors( 0 )
+	{
+		// pcap header, nanosecond timestamps.
+		uint32_t header[6] = { PCAP_MAGIC_NS, 2 | 4 << 16, 0, 0, 65535, LINKTYPE_ETHERNET };
+
+		fd = open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 );
+		if( fd < 0 || !writeAll( fd, header, sizeof(header) ) ){
+			if( fd >= 0 )
+				close( fd );
+			throw std::runtime_error( path + ": " + std::string(strerror(errno)) );
+		}
+		for( unsigned i = 0 ; i < workers ; i++ )
+			queues.push_back( new SPSCRing<ARPRecord>( EVIDENCE_QUEUE ) );
+		writer = std::thread( &EvidenceWriter::run, this );
+	}
+
+	~EvidenceWriter(){
+		stop();
+		close( fd );
+		for( auto q : queues )
+			delete q;
+	}
+
+	/**
+	 * Writes the frames still queued and stops the writer thread. No frame
+	 * can be submitted after it.
+	 */
+	void stop(){
+		running = false;
+		if( writer.joinable() )
+			writer.join();
+	}
+
+	/** @return The number of frames saved before each poisoning. */
+	size_t depth() const { return history; }
+
+	/**
+	 * Queues a frame to be written. Only the worker can call it.
+	 *
+	 * @param worker The index of the worker.
+	 * @param rec The frame.
+	 */
+	void submit( unsigned worker, const ARPRecord &rec ){
+		if( !queues[worker]->push( rec ) )
+			drops++;
+	}
+
+	/** @return The number of frames written. */
+	uint64_t frames() const { return written; }
+
+	/** @return The number of frames dropped because a queue was full. */
+	uint64_t dropped() const { return drops; }
+
+	/** @return The number of frames lost because the file couldn't be written. */
+	uint64_t failures() const { return errors; }
+
+	/** @return The path of the file. */
+	const std::string& path() const { return filePath; }
+
+private:
+	std::string filePath;
+	int fd;
+	size_t history;
+	std::vector< SPSCRing<ARPRecord>* > queues;
+	std::thread writer;
+	std::atomic<bool> running;
+	std::atomic<uint64_t> written;
+	std::atomic<uint64_t> drops;
+	std::atomic<uint64_t> errors;
+
+	/** Moves the queued frames to the file until it's stopped. */
+	void run(){
+		std::vector<char> buffer;
+
+		while( true ){
+			bool stop = !running;
+			ARPRecord rec;
+			uint64_t n = 0;
+
+			buffer.clear();
+			for( auto q : queues ){
+				while( q->pop( rec ) ){
+					uint32_t header[4] = {
+						(uint32_t) (rec.timestamp / 1000000000ULL),
+						(uint32_t) (rec.timestamp % 1000000000ULL),
+						sizeof(rec.frame), sizeof(rec.frame)
+					};
+
+					buffer.insert( buffer.end(), (char*) header, (char*) (header + 4) );
+					buffer.insert( buffer.end(), (char*) &rec.frame, (char*) (&rec.frame + 1) );
+					n++;
+				}
+			}
+			if( !buffer.empty() ){
+				if( writeAll( fd, buffer.data(), buffer.size() ) )
+					written += n;
+				else
+					errors += n;
+			}
+			else if( stop )
+				break;
+			else
+				usleep( EVIDENCE_POLL_MS * 1000 );
+		}
+	}
+
+	EvidenceWriter( const EvidenceWriter& );
+	EvidenceWriter& operator = ( const EvidenceWriter& );
+};
+
+#endif
@@ -0,0 +1,435 @@
+/**
+ * @file: frame_source.h
+ *
+ * Where the frames checked by the guard come from. A source hands out
+ * spans of frames, so the cost of a call is shared by all the frames of
+ * the span, and the checks are the same whatever the source is: a packet
+ * socket read in several ways, a capture file or frames in memory.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <stdint.h>
+
+#include <linux/if_packet.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "anti_arpspoof.h"
+#include "pcap_reader.h"
+#include "uring_receiver.h"
+
+/// The maximum number of frames in a span of the socket sources.
+#define SOURCE_BATCH		64
+
+/// Bytes kept of each frame by the socket sources that copy them.
+#define SOURCE_SNAPLEN		128
+
+/// Room for the control messages of a frame, its SO_TIMESTAMPNS one.
+#define SOURCE_CONTROL		64
+
+/// Time in milliseconds that the guard waits for a span of frames.
+#define SOURCE_WAIT_MS		100
+
+/// Size in bytes of each block of the TPACKET_V3 ring.
+#define TPACKET_BLOCK_SIZE	(1 << 16)
+
+/// Number of blocks of the TPACKET_V3 ring.
+#define TPACKET_BLOCKS		32
+
+/// Time in milliseconds after which the kernel hands out a block that isn't full.
+#define TPACKET_RETIRE_MS	10
+
+
+/** One frame handed out by a FrameSource. */
+struct FrameRef{
+	const uint8_t *data;	///< The frame, from the Ethernet header.
+	uint32_t len;			///< The number of bytes captured.
+	uint64_t timestamp;		///< Capture time in nanoseconds since the epoch, 0 if unknown.
+};
+
+/**
+ * A source of frames.
+ */
+class FrameSource{
+public:
+	virtual ~FrameSource(){}
+
+	/**
+	 * Waits for frames and hands out the ones available.
+	 *
+	 * @param frames Where the span is stored. It's valid until the next call.
+	 * @param timeout Maximum time to wait, in nanoseconds.
+	 * @return The number of frames of the span, 0 if none arrived in time,
+	 * -1 if the source has no more frames.
+	 *
+	 * @throw runtime_error If the frames couldn't be received.
+	 */
+	virtual int receive( const FrameRef *&frames, uint64_t timeout ) throw( std::runtime_error ) = 0;
+
+	/** @return The name of the source. */
+	virtual const char* name() const = 0;
+
+	/**
+	 * Gives the socket back to recv(): the kernel stops delivering the
+	 * frames to the source, which can't be used after it.
+	 */
+	virtual void detach(){}
+
+protected:
+	/** Waits until the socket is readable. */
+	static bool waitReadable( int sockfd, uint64_t timeout ){
+		struct pollfd pfd = { sockfd, POLLIN, 0 };
+		struct timespec ts = { (time_t) (timeout / 1000000000ULL), (long) (timeout % 1000000000ULL) };
+
+		return ppoll( &pfd, 1, &ts, NULL ) > 0;
+	}
+
+	/**
+	 * @param msg A message received from a socket with SO_TIMESTAMPNS.
+	 * @return The time the kernel received the frame, in nanoseconds since
+	 * the epoch; 0 if it isn't in the message.
+	 */
+	static uint64_t kernelTimestamp( struct msghdr &msg ){
+		for( struct cmsghdr *c = CMSG_FIRSTHDR( &msg ) ; c ; c = CMSG_NXTHDR( &msg, c ) )
+			if( c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS ){
+				struct timespec ts;
+
+				memcpy( &ts, CMSG_DATA( c ), sizeof(ts) );
+				return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+			}
+		return 0;
+	}
+};
+
+/**
+ * Frames of a packet socket, one recvmsg() per frame.
+ */
+class ReadSource : public FrameSource{
+public:
+	/** @param sfd The ARP socket, as returned by initSocket(). */
+	explicit ReadSource( int sfd ) : sockfd( sfd ) {}
+
+	int receive( const FrameRef *&frames, uint64_t timeout ) throw( std::runtime_error ){
+		int n = 0;
+
+		if( !waitReadable( sockfd, timeout ) )
+			return 0;
+		while( n < SOURCE_BATCH ){
+			struct iovec iov = { buffers[n], SOURCE_SNAPLEN };
+			struct msghdr msg;
+
+			memset( &msg, 0, sizeof(msg) );
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			ssize_t len = recvmsg( sockfd, &msg, MSG_DONTWAIT );
+			if( len <= 0 )
+				break;
+			refs[n].data = buffers[n];
+			refs[n].len = len;
+			refs[n].timestamp = kernelTimestamp( msg );
+			n++;
+		}
+		frames = refs;
+		return n;
+	}
+
+	const char* name() const { return "read"; }
+
+private:
+	int sockfd;
+	uint8_t buffers[SOURCE_BATCH][SOURCE_SNAPLEN];
+	FrameRef refs[SOURCE_BATCH];
+	alignas(struct cmsghdr) uint8_t control[SOURCE_CONTROL];
+};
+
+/**
+ * Frames of a packet socket, up to #SOURCE_BATCH per recvmmsg().
+ */
+class MmsgSource : public FrameSource{
+public:
+	/** @param sfd The ARP socket, as returned by initSocket(). */
+	explicit MmsgSource( int sfd ) : sockfd( sfd ) {
+		memset( msgs, 0, sizeof(msgs) );
+		for( int i = 0 ; i < SOURCE_BATCH ; i++ ){
+			iov[i].iov_base = buffers[i];
+			iov[i].iov_len = SOURCE_SNAPLEN;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = control[i];
+			refs[i].data = buffers[i];
+			refs[i].timestamp = 0;
+		}
+	}
+
+	int receive( const FrameRef *&frames, uint64_t timeout ) throw( std::runtime_error ){
+		if( !waitReadable( sockfd, timeout ) )
+			return 0;
+		// The kernel leaves here the length of the control messages received.
+		for( int i = 0 ; i < SOURCE_BATCH ; i++ )
+			msgs[i].msg_hdr.msg_controllen = SOURCE_CONTROL;
+
+		int n = recvmmsg( sockfd, msgs, SOURCE_BATCH, MSG_DONTWAIT, NULL );
+		if( n < 0 ){
+			if( errno == EAGAIN || errno == EINTR )
+				return 0;
+			throw std::runtime_error( "recvmmsg: " + std::string(strerror(errno)) );
+		}
+		for( int i = 0 ; i < n ; i++ ){
+			refs[i].len = msgs[i].msg_len < SOURCE_SNAPLEN ? msgs[i].msg_len : SOURCE_SNAPLEN;
+			refs[i].timestamp = kernelTimestamp( msgs[i].msg_hdr );
+		}
+		frames = refs;
+		return n;
+	}
+
+	const char* name() const { return "mmsg"; }
+
+private:
+	int sockfd;
+	struct mmsghdr msgs[SOURCE_BATCH];
+	struct iovec iov[SOURCE_BATCH];
+	uint8_t buffers[SOURCE_BATCH][SOURCE_SNAPLEN];
+	FrameRef refs[SOURCE_BATCH];
+	alignas(struct cmsghdr) uint8_t control[SOURCE_BATCH][SOURCE_CONTROL];
+};
+
+/**
+ * Frames of a packet socket through a TPACKET_V3 ring shared with the
+ * kernel. A span is one block of the ring, handed out without copies and
+ * given back to the kernel on the next call.
+ */
+class TPacketSource : public FrameSource{
+public:
+	/**
+	 * Sets up the ring on the socket. After it, the socket can't be read
+	 * in other ways.
+	 *
+	 * @param sfd The ARP socket, as returned by initSocket().
+	 *
+	 * @throw runtime_error If the ring couldn't be set up.
+	 */
+	explicit TPacketSource( int sfd ) throw( std::runtime_error )
+		: sockfd( sfd ), block( 0 ), held( false )
+	{
+		struct tpacket_req3 req;
+		int version = TPACKET_V3;
+
+		memset( &req, 0, sizeof(req) );
+		req.tp_block_size = TPACKET_BLOCK_SIZE;
+		req.tp_block_nr = TPACKET_BLOCKS;
+		req.tp_frame_size = 2048;
+		req.tp_frame_nr = TPACKET_BLOCK_SIZE / 2048 * TPACKET_BLOCKS;
+		req.tp_retire_blk_tov = TPACKET_RETIRE_MS;
+
+		if( setsockopt( sockfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version) ) < 0 ||
+				setsockopt( sockfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req) ) < 0 )
+			throw std::runtime_error( "TPACKET_V3: " + std::string(strerror(errno)) );
+		ring = static_cast<uint8_t*>( mmap( NULL, TPACKET_BLOCK_SIZE * TPACKET_BLOCKS,
+			PROT_READ | PROT_WRITE, MAP_SHARED, sockfd, 0 ) );
+		if( ring == MAP_FAILED ){
+			int err = errno;
+
+			// Without the ring, the socket can be read again.
+			memset( &req, 0, sizeof(req) );
+			setsockopt( sockfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req) );
+			throw std::runtime_error( "TPACKET_V3 mmap: " + std::string(strerror(err)) );
+		}
+		// Enough for a block full of the smallest frames.
+		refs.reserve( TPACKET_BLOCK_SIZE / TPACKET_ALIGN( sizeof(struct tpacket3_hdr) + 42 ) + 1 );
+	}
+
+	~TPacketSource(){
+		detach();
+	}
+
+	int receive( const FrameRef *&frames, uint64_t timeout ) throw( std::runtime_error ){
+		if( held ){
+			__atomic_store_n( &current()->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE );
+			block = (block + 1) % TPACKET_BLOCKS;
+			held = false;
+		}
+		if( !ready() && (!waitReadable( sockfd, timeout ) || !ready()) )
+			return 0;
+
+		struct tpacket_block_desc *desc = current();
+		const uint8_t *p = reinterpret_cast<uint8_t*>( desc ) + desc->hdr.bh1.offset_to_first_pkt;
+
+		refs.clear();
+		for( uint32_t i = 0 ; i < desc->hdr.bh1.num_pkts ; i++ ){
+			const struct tpacket3_hdr *h = reinterpret_cast<const struct tpacket3_hdr*>( p );
+			FrameRef ref = { p + h->tp_mac, h->tp_snaplen,
+				h->tp_sec * 1000000000ULL + h->tp_nsec };
+
+			refs.push_back( ref );
+			p += h->tp_next_offset;
+		}
+		held = true;
+		frames = refs.data();
+		return refs.size();
+	}
+
+	const char* name() const { return "tpacket"; }
+
+	// While the ring is set up, the frames don't reach recv().
+	void detach(){
+		struct tpacket_req3 req;
+
+		if( ring == MAP_FAILED )
+			return;
+		munmap( ring, TPACKET_BLOCK_SIZE * TPACKET_BLOCKS );
+		ring = static_cast<uint8_t*>( MAP_FAILED );
+		memset( &req, 0, sizeof(req) );
+		setsockopt( sockfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req) );
+	}
+
+private:
+	int sockfd;
+	uint8_t *ring;
+	unsigned block;		///< The next block to read.
+	bool held;			///< The block was handed out and must be given back.
+	std::vector<FrameRef> refs;
+
+	struct tpacket_block_desc* current() const {
+		return reinterpret_cast<struct tpacket_block_desc*>( ring + block * TPACKET_BLOCK_SIZE );
+	}
+
+	bool ready() const {
+		return __atomic_load_n( &current()->hdr.bh1.block_status, __ATOMIC_ACQUIRE ) & TP_STATUS_USER;
+	}
+};
+
+/**
+ * Frames of a packet socket through io_uring, see URingReceiver. The
+ * frames are copied out of the ring so its slots are given back at once.
+ */
+class URingSource : public FrameSource{
+public:
+	/**
+	 * @param sfd The ARP socket, as returned by initSocket().
+	 *
+	 * @throw runtime_error If io_uring isn't supported.
+	 */
+	explicit URingSource( int sfd ) throw( std::runtime_error ) : receiver( sfd ) {
+		copies.reserve( URING_CQ_ENTRIES );
+		refs.reserve( URING_CQ_ENTRIES );
+		lens.reserve( URING_CQ_ENTRIES );
+	}
+
+	int receive( const FrameRef *&frames, uint64_t timeout ) throw( std::runtime_error ){
+		copies.clear();
+		refs.clear();
+		receiver.wait( [&]( const ARPFrame &frame, int len ){
+			copies.push_back( frame );
+			lens.push_back( len < (int) sizeof(frame) ? len : sizeof(frame) );
+		}, timeout );
+		for( size_t i = 0 ; i < copies.size() ; i++ ){
+			FrameRef ref = { reinterpret_cast<const uint8_t*>( &copies[i] ), lens[i], 0 };
+			refs.push_back( ref );
+		}
+		lens.clear();
+		frames = refs.data();
+		return refs.size();
+	}
+
+	const char* name() const { return "uring"; }
+
+	void detach(){
+		receiver.release();
+	}
+
+private:
+	URingReceiver receiver;
+	std::vector<ARPFrame> copies;
+	std::vector<uint32_t> lens;
+	std::vector<FrameRef> refs;
+};
+
+/**
+ * Frames of a pcap or pcapng file, see PcapReader. They're handed out
+ * in place, and the timeout is ignored.
+ */
+class PcapSource : public FrameSource{
+public:
+	/**
+	 * @param path The path of the file.
+	 *
+	 * @throw runtime_error If it's not a capture of Ethernet frames.
+	 */
+	explicit PcapSource( const std::string &path ) throw( std::runtime_error ) : reader( path ) {}
+
+	int receive( const FrameRef *&frames, uint64_t ) throw( std::runtime_error ){
+		int n = 0;
+
+		while( n < SOURCE_BATCH && reader.next( refs[n].data, refs[n].len, refs[n].timestamp ) )
+			n++;
+		frames = refs;
+		return n ? n : -1;
+	}
+
+	const char* name() const { return "pcap"; }
+
+	/** @return The number of frames skipped for not being Ethernet. */
+	uint64_t skipped() const { return reader.skipped(); }
+
+private:
+	PcapReader reader;
+	FrameRef refs[SOURCE_BATCH];
+};
+
+/**
+ * Frames kept in memory, handed out in spans of #SOURCE_BATCH. It feeds
+ * the checks with known traffic, to test or measure them.
+ */
+class MemorySource : public FrameSource{
+public:
+	/**
+	 * @param frames The frames. They must be valid while the source is used.
+	 * @param rounds How many times the frames are handed out.
+	 */
+	explicit MemorySource( const std::vector<FrameRef> &frames, uint64_t rounds = 1 )
+		: feed( frames ), left( frames.empty() ? 0 : rounds ), pos( 0 ) {}
+
+	int receive( const FrameRef *&frames, uint64_t ) throw( std::runtime_error ){
+		if( !left )
+			return -1;
+
+		size_t n = feed.size() - pos < SOURCE_BATCH ? feed.size() - pos : SOURCE_BATCH;
+		frames = feed.data() + pos;
+		pos += n;
+		if( pos == feed.size() ){
+			pos = 0;
+			left--;
+		}
+		return n;
+	}
+
+	const char* name() const { return "memory"; }
+
+private:
+	const std::vector<FrameRef> &feed;
+	uint64_t left;		///< Rounds left.
+	size_t pos;			///< The next frame of the round.
+};
+
+#endif
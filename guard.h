@@ -0,0 +1,339 @@
+/**
+ * @file: guard.h
+ *
+ * The path of a frame through a worker of the guard, from a span of a
+ * FrameSource to the decisions of checkFrame() and what the guard does
+ * about them: the metrics, the history and the evidence, the events, the
+ * profile of the stages. Only the I/O, sending probes and asking the
+ * user, is left to functions set in GuardShared, so the benchmark can
+ * run the same path from memory.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef GUARD_H
+#define GUARD_H
+
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "anti_arpspoof.h"
+#include "arp_table.h"
+#include "frame_source.h"
+#include "engine.h"
+#include "snapshot.h"
+#include "spsc_ring.h"
+#include "probes.h"
+#include "correlation.h"
+#include "journal.h"
+#include "evidence.h"
+#include "event_log.h"
+#include "metrics.h"
+#include "profiler.h"
+#include "alloc_count.h"
+
+/// Bytes of the answers to the prompts kept without allocating.
+#define ANSWER_RESERVE	64
+
+
+/**
+ * Gets the capture worker that owns a sender HW Address. Must give the
+ * same result as the BPF program installed by joinFanout().
+ *
+ * @param hw The sender HW Address.
+ * @param workers The number of capture workers.
+ * @return The index of the worker.
+ */
+inline unsigned shardOf( const uint8_t hw[], unsigned workers )
+{
+	uint32_t low = (uint32_t) hw[2] << 24 | hw[3] << 16 | hw[4] << 8 | hw[5];
+
+	return low % workers;
+}
+
+/**
+ * One version of the ARP table as seen by the guard. It's never modified
+ * after it's published, a change means publishing a new one.
+ */
+struct TableSnapshot{
+	ARPTable table;					///< All the bindings.
+	std::vector<ARPTable> shards;	///< The bindings split by worker, see shardOf().
+
+	/**
+	 * Creates a version of the table ready to be published.
+	 *
+	 * @param t The bindings of the table.
+	 * @param workers The number of capture workers.
+	 */
+	TableSnapshot( const ARPTable &t, unsigned workers ) : table( t ), shards( workers ) {
+		table.forEach( [&]( const HWAddr &hw, struct in_addr ip ){
+			shards[shardOf( hw.hw, workers )].add( hw, ip );
+		} );
+	}
+};
+
+struct Shard;
+struct GuardShared;
+
+/**
+ * Sends the probes of a verification, see sendProbes().
+ *
+ * @param sfd The ARP socket of the worker.
+ * @param ld The local info about the network interface.
+ * @param ip The IP Address to verify.
+ * @param owner Packed HW Address of the IP in the table, 0 if none.
+ */
+typedef void (*ProbeSender)( int sfd, const LocalData &ld, uint32_t ip, uint64_t owner );
+
+/**
+ * Notifies a poisoning to the user, once it's counted and logged, see
+ * alert().
+ *
+ * @param hw The HW Address that claimed the IP Address.
+ * @param ip The IP Address poisoned.
+ * @param unsolicited If the claim was a reply that nobody asked for.
+ * @param arrival When the claim arrived, nanoseconds since the epoch.
+ * @param probe The verification done, NULL if it couldn't be done.
+ * @param snap The current version of the ARP table.
+ * @param shard The state of the worker that received the claim.
+ * @param shared The state shared by the workers.
+ * @param since The profileTicks() when the alert started.
+ */
+typedef void (*AlertNotifier)( const HWAddr &hw, struct in_addr ip, bool unsolicited,
+	uint64_t arrival, const Probe *probe, const TableSnapshot &snap, Shard &shard,
+	GuardShared &shared, uint64_t since );
+
+/** The guard state shared by all the workers. */
+struct GuardShared{
+	const char *ifname;				///< The name of the network interface.
+	LocalData local;				///< The local info about the network interface.
+	Snapshot<TableSnapshot> *table;	///< The ARP table.
+	ProbeTable probes;				///< The verifications in progress.
+	RequestTable requests;			///< The requests waiting for replies.
+	Journal *journal;				///< Where the alerts are recorded, NULL if not.
+	EvidenceWriter *evidence;		///< Where the poisoning frames are saved, NULL if not.
+	EventLog *events;				///< Where the events are logged, NULL if not. Each worker is a producer.
+	std::mutex *prompt;				///< Serializes what the workers print to the user.
+	ProbeSender sendProbes;			///< Sends the probes of the verifications.
+	AlertNotifier notify;			///< Notifies the poisonings to the user.
+
+	GuardShared() : ifname( NULL ), local(), table( NULL ), journal( NULL ), evidence( NULL ),
+		events( NULL ), prompt( NULL ), sendProbes( NULL ), notify( NULL ) {}
+};
+
+/**
+ * The part of the guard state owned by one capture worker. Its id also
+ * selects its entries in a TableSnapshot.
+ */
+struct Shard : CheckState{
+	int sockfd;				///< The ARP socket of the worker.
+	std::string answer;		///< The last answer of the user to a prompt of the worker.
+
+	std::atomic<uint64_t> received;		///< Records taken by the pipeline queue.
+	std::atomic<uint64_t> overflows;	///< Records dropped because the pipeline queue was full.
+	std::atomic<size_t> maxDepth;		///< The highest depth of the pipeline queue.
+	FrameHistory *history;			///< The last frames checked, NULL if no evidence is saved.
+	WorkerMetrics metrics;			///< The counters served by the metrics endpoint.
+	StageProfile profile;			///< Time spent in each stage of the path of a frame.
+	uint64_t checked;				///< Records checked by analyze().
+	uint64_t allocationBase;		///< Heap allocations of the checking thread after ALLOCATION_WARMUP records.
+	uint64_t allocations;			///< Heap allocations of the checking thread since then.
+
+	// Everything a frame may need is allocated beforehand.
+	Shard() : sockfd( -1 ), received( 0 ), overflows( 0 ), maxDepth( 0 ),
+		history( NULL ), checked( 0 ), allocationBase( 0 ), allocations( 0 ) {
+		answer.reserve( ANSWER_RESERVE );
+	}
+
+	/** Counts the allocations of the calling thread since the warm-up. */
+	void countAllocations(){
+		if( checked >= ALLOCATION_WARMUP )
+			allocations = threadAllocationCount() - allocationBase;
+	}
+};
+
+/**
+ * @param arrival When a frame arrived, nanoseconds since the epoch.
+ * @return The nanoseconds since then, 0 if the clock went back.
+ */
+inline uint64_t sinceArrival( uint64_t arrival )
+{
+	uint64_t now = realtimeNs();
+
+	return now > arrival ? now - arrival : 0;
+}
+
+/**
+ * What the guard does about the decisions of checkFrame() for a worker.
+ */
+struct GuardHooks{
+	const TableSnapshot &snap;	///< The current version of the ARP table.
+	Shard &shard;				///< The state of the worker.
+	GuardShared &shared;		///< The state shared by the workers.
+	uint64_t &ticks;			///< The profileTicks() when the current stage started.
+
+	void stage( Stage s ){
+		ticks = shard.profile.add( s, ticks );
+	}
+
+	void inspected( const ARPRecord &reply, Finding found ){
+		if( reply.opcode == ARPOP_REPLY )
+			WorkerMetrics::add( shard.metrics.replies, 1 );
+		if( found == FINDING_NEW_DEVICE )
+			WorkerMetrics::add( shard.metrics.unknown, 1 );
+		else if( found == FINDING_CONFLICT ){
+			WorkerMetrics::add( shard.metrics.conflicts, 1 );
+			shard.metrics.detection.record( sinceArrival( reply.timestamp ) );
+		}
+		if( shard.history )
+			shard.history->record( reply );
+	}
+
+	void newDevice( const ARPRecord &reply, bool solicited ){
+		if( shared.events ){ // Logged without waiting for the terminal
+			Event e = { reply.timestamp, 0, packHWAddr( reply.hw_src ), reply.ip_src, 0,
+				EVENT_NEW_DEVICE, VERDICT_UNVERIFIED, !solicited };
+
+			shared.events->submit( shard.id, e );
+			return;
+		}
+		std::lock_guard<std::mutex> lock( *shared.prompt );
+		std::cout << "There's a new device. You should try with a new scan." << std::endl;
+	}
+
+	// The frames before a new poisoning are saved with it.
+	void conflict( const ARPRecord&, bool known ){
+		if( shared.evidence )
+			shard.history->drain( known ? 0 : shared.evidence->depth(), [&]( const ARPRecord &r ){
+				shared.evidence->submit( shard.id, r );
+			} );
+	}
+
+	void probe( const ARPRecord &reply, uint64_t owner ){
+		shared.sendProbes( shard.sockfd, shared.local, reply.ip_src, owner );
+		// A socket doesn't receive its own frames.
+		shared.requests.request( shared.local.ipAddr, reply.ip_src, monotonicNs() / 1000000,
+			shard.correlation );
+	}
+
+	// The notification accounts its own stages, not the prompt.
+	void alert( const HWAddr &hw, struct in_addr ip, bool unsolicited, uint64_t arrival,
+			const Probe *probe ){
+		WorkerMetrics::add( shard.metrics.alerts, 1 );
+		if( shared.events ){
+			const ARPTable::HWList *owners = snap.table.ownersOf( ip );
+			Event e = { realtimeNs(), owners ? (*owners)[0] : 0, packHWAddr( hw.hw ), ip.s_addr, 0,
+				EVENT_POISONING, VERDICT_UNVERIFIED, unsolicited };
+
+			if( probe && probe->owner ){
+				e.oldHW = probe->owner;
+				e.others = probe->othersAnswered;
+				e.verdict = probe->ownerAnswered ? VERDICT_OWNER_ANSWERS : VERDICT_OWNER_SILENT;
+			}
+			shared.events->submit( shard.id, e );
+		}
+		shared.notify( hw, ip, unsolicited, arrival, probe, snap, shard, shared, ticks );
+		ticks = profileTicks();
+	}
+};
+
+/**
+ * Checks one received ARP frame against the ARP table, see checkFrame().
+ * If the sender is claiming an IP Address of another device, starts a
+ * verification of the IP Address; the poisoning is notified with the
+ * answers when it expires.
+ *
+ * @param reply The fields of the received frame.
+ * @param snap The current version of the ARP table.
+ * @param shard The state of the worker that owns the sender of the frame.
+ * @param shared The state shared by the workers.
+ * @param ticks The profileTicks() when the check started, the ones when
+ * it ended on return.
+ */
+inline void analyze( const ARPRecord &reply, const TableSnapshot &snap, Shard &shard,
+		GuardShared &shared, uint64_t &ticks )
+{
+	if( ++shard.checked == ALLOCATION_WARMUP ) // From now on the thread shouldn't allocate.
+		shard.allocationBase = threadAllocationCount();
+
+	GuardHooks hooks = { snap, shard, shared, ticks };
+	checkFrame( reply, snap.shards[shard.id], snap.table, shared.requests, shared.probes, shard,
+		monotonicNs(), hooks );
+}
+
+/**
+ * Gives the verdict of the verifications of a worker that ended.
+ *
+ * @param reader The registration of the calling thread as a reader of
+ * the table.
+ * @param shard The state of the worker.
+ * @param shared The state shared by the workers.
+ */
+inline void verifyProbes( SnapshotReader<TableSnapshot> &reader, Shard &shard, GuardShared &shared )
+{
+	uint64_t ticks = profileTicks();
+	GuardHooks hooks = { *reader.enter(), shard, shared, ticks };
+
+	expireProbes( shared.probes, shard, monotonicNs(), hooks );
+	reader.leave();
+}
+
+/**
+ * Checks a span of frames received by a worker. The frames are parsed
+ * and checked with analyze(), or queued for the analysis thread of the
+ * worker if it has one, which gives the verdicts too.
+ *
+ * @param frames The frames.
+ * @param n The number of frames, 0 if none arrived before the timeout.
+ * @param reader The registration of the calling thread as a reader of
+ * the table.
+ * @param shard The state of the worker.
+ * @param shared The state shared by the workers.
+ * @param queue The queue of the analysis thread, NULL to check the
+ * frames here.
+ * @param ticks The profileTicks() when the span was asked for, the ones
+ * when it was checked on return.
+ */
+inline void checkSpan( const FrameRef *frames, int n, SnapshotReader<TableSnapshot> &reader,
+		Shard &shard, GuardShared &shared, SPSCRing<ARPRecord> *queue, uint64_t &ticks )
+{
+	ARPRecord rec;
+
+	WorkerMetrics::add( shard.metrics.frames, n );
+	// The spans of an idle network also count the wait for their first frame.
+	if( n )
+		ticks = shard.profile.add( STAGE_RECEIVE, ticks, n );
+
+	// Frames without a capture time get the time of the span.
+	uint64_t now = n ? realtimeNs() : 0;
+	for( int i = 0 ; i < n ; i++ ){
+		bool parsed = parseEthernet( frames[i].data, frames[i].len,
+			frames[i].timestamp ? frames[i].timestamp : now, rec );
+
+		ticks = shard.profile.add( STAGE_PARSE, ticks );
+		if( !parsed )
+			continue;
+		if( !queue ){
+			analyze( rec, *reader.enter(), shard, shared, ticks );
+			reader.leave();
+		}
+		else if( queue->push( rec ) )
+			shard.received++;
+		else
+			shard.overflows++;
+	}
+	if( !queue )
+		verifyProbes( reader, shard, shared );
+}
+
+#endif
@@ -0,0 +1,355 @@
+/**
+ * @file: journal.h
+ *
+ * Append-only journal of the changes of the ARP table and the alerts.
+ * The table file is only saved from time to time; replaying the journal
+ * over it recovers the last table after a crash, and the alerts kept in
+ * it are the timeline of what happened.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "anti_arpspoof.h"
+#include "arp_table.h"
+#include "table_file.h"
+
+/// Identifies a journal file.
+#define JOURNAL_MAGIC		"AAJOURN"
+
+/// Version of the format of the journal.
+#define JOURNAL_VERSION		1
+
+/// Time in milliseconds that a record waits for others to be synced with it.
+#define JOURNAL_COMMIT_MS	20
+
+/// Records of binding changes after which the journal should be compacted.
+#define JOURNAL_COMPACT_RECORDS	4096
+
+/// Records of a batch that fit without allocating.
+#define JOURNAL_BATCH_RESERVE	256
+
+
+/** The kinds of record of the journal. */
+enum JournalType{
+	JOURNAL_ADD = 1,	///< A binding was added to the table.
+	JOURNAL_REMOVE,		///< A binding was removed from the table.
+	JOURNAL_ALERT		///< A HW Address was found poisoning an IP Address.
+};
+
+/** The header of a journal file. */
+struct JournalHeader{
+	char		magic[8];		///< #JOURNAL_MAGIC.
+	uint32_t	version;		///< #JOURNAL_VERSION.
+	uint32_t	recordSize;		///< sizeof(JournalRecord).
+	uint8_t		reserved[16];
+};
+
+/** One entry of the journal. */
+struct JournalRecord{
+	uint32_t	checksum;			///< CRC-32 of the rest of the record.
+	uint8_t		type;				///< One of JournalType.
+	uint8_t		reserved;
+	uint8_t		hw[MAC_ADDR_LEN];	///< HW Address of the binding, or the poisoner.
+	uint32_t	ip;					///< IP Address of the binding, or the one poisoned.
+	uint64_t	seq;				///< Sequence number, increasing along the file.
+	uint64_t	timestamp;			///< When it happened, in nanoseconds since the epoch.
+};
+
+static_assert( sizeof(JournalHeader) == 32, "JournalHeader must be 32 bytes" );
+static_assert( sizeof(JournalRecord) == 32, "JournalRecord must be 32 bytes" );
+
+/**
+ * The journal file. Records are appended without waiting for the disk:
+ * a writer thread collects them for #JOURNAL_COMMIT_MS and syncs them
+ * all with a single fdatasync(), so a crash loses at most that window.
+ *
+ * Replaying adds and removes is idempotent: each binding ends as its last
+ * record says. So the journal can be replayed over a table file saved
+ * after some of its records, and a crash between saving the table file
+ * and compacting the journal is harmless.
+ */
+class Journal{
+public:
+	/**
+	 * Opens the journal, creating it if it doesn't exist.
+	 *
+	 * @param path The path of the file.
+	 *
+	 * @throw runtime_error If it couldn't be opened or it's not a journal.
+	 */
+	explicit Journal( const std::string &path ) throw( std::runtime_error )
+		: filePath( path ), fd( -1 ), nextSeq( 1 ), durableSeq( 0 ), syncWanted( false ),
+		  stopping( false ), changes( 0 ), commits( 0 ), errors( 0 )
+	{
+		pending.reserve( JOURNAL_BATCH_RESERVE );
+		batch.reserve( JOURNAL_BATCH_RESERVE );
+		fd = openFile( filePath, false );
+		writer = std::thread( &Journal::run, this );
+	}
+
+	/** Syncs the records not written yet and closes the file. */
+	~Journal(){
+		{
+			std::lock_guard<std::mutex> l( lock );
+			stopping = true;
+		}
+		wake.notify_one();
+		writer.join();
+		close( fd );
+	}
+
+	/**
+	 * Applies the records of binding changes to a table. A torn record
+	 * at the end, left by a crash while writing, is cut off. It must be
+	 * called before appending.
+	 *
+	 * @param table The table to update.
+	 * @return The number of binding changes applied.
+	 *
+	 * @throw runtime_error If the file couldn't be read.
+	 */
+	size_t replay( ARPTable &table ) throw( std::runtime_error )
+	{
+		std::vector<JournalRecord> records;
+		size_t n = 0;
+
+		off_t valid = readRecords( fd, records );
+		if( ftruncate( fd, valid ) < 0 )
+			throw std::runtime_error( filePath + ": " + std::string(strerror(errno)) );
+		for( auto &r : records ){
+			struct in_addr ip = { r.ip };
+
+			if( r.type == JOURNAL_ADD )
+				table.add( HWAddr( r.hw ), ip );
+			else if( r.type == JOURNAL_REMOVE )
+				table.remove( HWAddr( r.hw ), ip );
+			else
+				continue;
+			n++;
+		}
+		changes = n;
+
+		std::lock_guard<std::mutex> l( lock );
+		if( !records.empty() ){
+			nextSeq = records.back().seq + 1;
+			durableSeq = records.back().seq;
+		}
+		return n;
+	}
+
+	/**
+	 * Appends a record. It returns at once, the record is synced by the
+	 * writer thread.
+	 *
+	 * @param type One of JournalType.
+	 * @param hw The HW Address.
+	 * @param ip The IP Address.
+	 */
+	void append( JournalType type, const HWAddr &hw, struct in_addr ip ){
+		JournalRecord r;
+		struct timespec now;
+
+		clock_gettime( CLOCK_REALTIME, &now );
+		memset( &r, 0, sizeof(r) );
+		r.type = type;
+		memcpy( r.hw, hw.hw, MAC_ADDR_LEN );
+		r.ip = ip.s_addr;
+		r.timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+		if( type != JOURNAL_ALERT )
+			changes++;
+		{
+			std::lock_guard<std::mutex> l( lock );
+			r.seq = nextSeq++;
+			r.checksum = crc32( 0, &r.type, sizeof(r) - sizeof(r.checksum) );
+			pending.push_back( r );
+		}
+		wake.notify_one();
+	}
+
+	/** Waits until every record appended is on disk. */
+	void commit(){
+		std::unique_lock<std::mutex> l( lock );
+		uint64_t target = nextSeq - 1;
+
+		syncWanted = true;
+		wake.notify_one();
+		synced.wait( l, [&]{ return durableSeq >= target; } );
+	}
+
+	/**
+	 * Drops the binding changes from the journal, once the table has been
+	 * saved to the table file. The alerts are kept. Binding changes must
+	 * not be appended meanwhile.
+	 *
+	 * @throw runtime_error If the journal couldn't be rewritten.
+	 */
+	void compact() throw( std::runtime_error )
+	{
+		std::vector<JournalRecord> records, alerts;
+		std::string tmp = filePath + ".tmp";
+
+		commit();
+		std::lock_guard<std::mutex> io( ioLock );
+		readRecords( fd, records );
+		for( auto &r : records )
+			if( r.type == JOURNAL_ALERT )
+				alerts.push_back( r );
+
+		int nfd = openFile( tmp, true );
+		if( !writeAll( nfd, alerts.data(), alerts.size() * sizeof(JournalRecord) ) ||
+				fsync( nfd ) < 0 || rename( tmp.c_str(), filePath.c_str() ) < 0 ){
+			int err = errno;
+			close( nfd );
+			unlink( tmp.c_str() );
+			throw std::runtime_error( filePath + ": " + std::string(strerror(err)) );
+		}
+		syncDir( filePath );
+		close( fd );
+		fd = nfd;
+		changes = 0;
+	}
+
+	/** @return The records of binding changes since the last compaction. */
+	uint64_t pendingChanges() const { return changes; }
+
+	/** @return The number of fdatasync() done. */
+	uint64_t syncs() const { return commits; }
+
+	/** @return The number of batches that couldn't be written. */
+	uint64_t failures() const { return errors; }
+
+	/** @return The path of the file. */
+	const std::string& path() const { return filePath; }
+
+private:
+	std::string filePath;
+	int fd;
+	std::thread writer;
+
+	std::mutex lock;					///< Guards the fields below.
+	std::condition_variable wake;		///< Wakes up the writer thread.
+	std::condition_variable synced;		///< Signals that durableSeq advanced.
+	std::vector<JournalRecord> pending;	///< Records waiting to be written.
+	std::vector<JournalRecord> batch;	///< Records being written, swapped with pending to keep their memory.
+	uint64_t nextSeq;					///< Sequence number of the next record.
+	uint64_t durableSeq;				///< Last sequence number on disk.
+	bool syncWanted;					///< Someone waits in commit().
+	bool stopping;
+
+	std::mutex ioLock;					///< Held while writing the file.
+	std::atomic<uint64_t> changes;
+	std::atomic<uint64_t> commits;
+	std::atomic<uint64_t> errors;
+
+	/** Writes the batches of records. */
+	void run(){
+		std::unique_lock<std::mutex> l( lock );
+
+		while( true ){
+			wake.wait( l, [&]{ return stopping || !pending.empty() || syncWanted; } );
+			if( stopping && pending.empty() )
+				break;
+			// More records can join the batch meanwhile.
+			wake.wait_for( l, std::chrono::milliseconds( JOURNAL_COMMIT_MS ),
+				[&]{ return stopping || syncWanted; } );
+
+			uint64_t last = nextSeq - 1;
+
+			batch.swap( pending );
+			syncWanted = false;
+			l.unlock();
+			if( !batch.empty() ){
+				std::lock_guard<std::mutex> io( ioLock );
+
+				if( !writeAll( fd, batch.data(), batch.size() * sizeof(JournalRecord) ) ||
+						fdatasync( fd ) < 0 )
+					errors++;
+				commits++;
+				batch.clear();
+			}
+			l.lock();
+			durableSeq = last;
+			synced.notify_all();
+		}
+	}
+
+	/** Opens a journal file, writing the header if it's new or truncated. */
+	static int openFile( const std::string &path, bool truncate ) throw( std::runtime_error )
+	{
+		JournalHeader h;
+		struct stat st;
+		int fd = open( path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC |
+			(truncate ? O_TRUNC : 0), 0600 );
+
+		if( fd < 0 || fstat( fd, &st ) < 0 ){
+			if( fd >= 0 )
+				close( fd );
+			throw std::runtime_error( path + ": " + std::string(strerror(errno)) );
+		}
+		if( st.st_size < (off_t) sizeof(h) ){
+			memset( &h, 0, sizeof(h) );
+			memcpy( h.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC) );
+			h.version = JOURNAL_VERSION;
+			h.recordSize = sizeof(JournalRecord);
+			if( ftruncate( fd, 0 ) < 0 || !writeAll( fd, &h, sizeof(h) ) || fsync( fd ) < 0 ){
+				close( fd );
+				throw std::runtime_error( path + ": " + std::string(strerror(errno)) );
+			}
+		}
+		else if( pread( fd, &h, sizeof(h), 0 ) != sizeof(h) ||
+				memcmp( h.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC) ) ||
+				h.version != JOURNAL_VERSION || h.recordSize != sizeof(JournalRecord) ){
+			close( fd );
+			throw std::runtime_error( path + ": not a journal" );
+		}
+		return fd;
+	}
+
+	/**
+	 * Reads the valid records of the file.
+	 *
+	 * @return The length of the file up to the last valid record.
+	 */
+	static off_t readRecords( int fd, std::vector<JournalRecord> &records ){
+		JournalRecord r;
+		off_t pos = sizeof(JournalHeader);
+
+		while( pread( fd, &r, sizeof(r), pos ) == sizeof(r) &&
+				crc32( 0, &r.type, sizeof(r) - sizeof(r.checksum) ) == r.checksum ){
+			records.push_back( r );
+			pos += sizeof(r);
+		}
+		return pos;
+	}
+
+	Journal( const Journal& );
+	Journal& operator = ( const Journal& );
+};
+
+#endif
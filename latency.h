@@ -0,0 +1,148 @@
+/**
+ * @file: latency.h
+ *
+ * Histograms of latencies in nanoseconds, log-linear like HdrHistogram:
+ * every power of two is split in 2^#LATENCY_SUB_BITS buckets of the same
+ * width, so any value is kept with an error under 1 / 2^#LATENCY_SUB_BITS
+ * of itself in a fixed array, and recording is a few instructions. Each
+ * histogram has a single writer; they're summed when they're read.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <atomic>
+#include <vector>
+
+#include <stdint.h>
+
+/// Bits of precision of each value, 32 buckets per power of two.
+#define LATENCY_SUB_BITS	5
+
+/// Bits of the highest value kept, about 18 minutes in nanoseconds. Higher ones count as it.
+#define LATENCY_MAX_BITS	40
+
+/// Number of buckets of a histogram.
+#define LATENCY_BUCKETS		((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+
+/**
+ * The latencies recorded by one thread.
+ */
+class LatencyHistogram{
+public:
+	LatencyHistogram() : sum( 0 ), max( 0 ) {
+		for( auto &b : buckets )
+			b.store( 0, std::memory_order_relaxed );
+	}
+
+	/**
+	 * Records a latency. Only its writer thread can call it.
+	 *
+	 * @param ns The latency in nanoseconds.
+	 */
+	void record( uint64_t ns ){
+		std::atomic<uint64_t> &b = buckets[bucketOf( ns )];
+
+		b.store( b.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+		sum.store( sum.load( std::memory_order_relaxed ) + ns, std::memory_order_relaxed );
+		if( ns > max.load( std::memory_order_relaxed ) )
+			max.store( ns, std::memory_order_relaxed );
+	}
+
+	/**
+	 * @return The bucket of a value: the value itself below 2^(#LATENCY_SUB_BITS + 1),
+	 * above it the top #LATENCY_SUB_BITS + 1 bits after the position of the highest one.
+	 */
+	static unsigned bucketOf( uint64_t ns ){
+		if( ns >> LATENCY_MAX_BITS )
+			ns = (1ULL << LATENCY_MAX_BITS) - 1;
+		if( ns < (2ULL << LATENCY_SUB_BITS) )
+			return ns;
+
+		unsigned shift = 63 - __builtin_clzll( ns ) - LATENCY_SUB_BITS;
+		return (shift << LATENCY_SUB_BITS) + (ns >> shift);
+	}
+
+	/** @return The highest value that falls in a bucket. */
+	static uint64_t highestOf( unsigned bucket ){
+		if( bucket < (2U << LATENCY_SUB_BITS) )
+			return bucket;
+
+		unsigned shift = (bucket >> LATENCY_SUB_BITS) - 1;
+		uint64_t top = bucket - (shift << LATENCY_SUB_BITS);
+		return ((top + 1) << shift) - 1;
+	}
+
+private:
+	friend class LatencySummary;
+
+	std::atomic<uint64_t> buckets[LATENCY_BUCKETS];
+	std::atomic<uint64_t> sum;		///< Sum of the values.
+	std::atomic<uint64_t> max;		///< Highest value.
+};
+
+/**
+ * The sum of several histograms at some moment, to get its quantiles.
+ */
+class LatencySummary{
+public:
+	LatencySummary() : buckets( LATENCY_BUCKETS ), total( 0 ), sum( 0 ), max( 0 ) {}
+
+	/** Adds the values of a histogram, it can be written meanwhile. */
+	void add( const LatencyHistogram &h ){
+		for( unsigned i = 0 ; i < LATENCY_BUCKETS ; i++ ){
+			uint64_t n = h.buckets[i].load( std::memory_order_relaxed );
+
+			buckets[i] += n;
+			total += n;
+		}
+		sum += h.sum.load( std::memory_order_relaxed );
+		if( h.max.load( std::memory_order_relaxed ) > max )
+			max = h.max.load( std::memory_order_relaxed );
+	}
+
+	/**
+	 * @param q The quantile, from 0 to 1.
+	 * @return The highest value of the bucket where the quantile is, not
+	 * above the highest value recorded; 0 if there are no values.
+	 */
+	uint64_t quantile( double q ) const {
+		uint64_t rank = q * total + 0.5, seen = 0;
+
+		if( !total )
+			return 0;
+		for( unsigned i = 0 ; i < LATENCY_BUCKETS ; i++ ){
+			seen += buckets[i];
+			if( seen && seen >= rank ){
+				uint64_t v = LatencyHistogram::highestOf( i );
+				return v < max ? v : max;
+			}
+		}
+		return max;
+	}
+
+	/** @return The number of values. */
+	uint64_t count() const { return total; }
+
+	/** @return The sum of the values, in nanoseconds. */
+	uint64_t totalNs() const { return sum; }
+
+	/** @return The highest value, in nanoseconds. */
+	uint64_t highest() const { return max; }
+
+private:
+	std::vector<uint64_t> buckets;
+	uint64_t total;
+	uint64_t sum;
+	uint64_t max;
+};
+
+#endif
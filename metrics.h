@@ -0,0 +1,292 @@
+/**
+ * @file: metrics.h
+ *
+ * Counters of the tool, served in the Prometheus text format over HTTP
+ * on a local TCP port or a unix socket. The counters of the guard are
+ * kept per worker, each worker in its own cache line, and every counter
+ * is written by a single thread, so counting is a plain add; they're
+ * only summed when the metrics are scraped.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "latency.h"
+#include "spsc_ring.h"
+
+/// Time in milliseconds the server waits for a connection before checking if it must stop.
+#define METRICS_POLL_MS		100
+
+/// Time in milliseconds a client has to send its request.
+#define METRICS_REQUEST_MS	1000
+
+/// Longest request read, in bytes.
+#define METRICS_REQUEST_MAX	4096
+
+
+/**
+ * The counters of one guard worker. The frames are counted by its
+ * capture thread and the rest by the thread that checks them, which also
+ * records the latencies.
+ */
+struct alignas(CACHE_LINE) WorkerMetrics{
+	std::atomic<uint64_t> frames;		///< Frames received.
+	std::atomic<uint64_t> replies;		///< ARP replies checked.
+	std::atomic<uint64_t> unknown;		///< Frames from HW Addresses that aren't in the table.
+	std::atomic<uint64_t> conflicts;	///< Frames claiming the IP Address of another device.
+	std::atomic<uint64_t> alerts;		///< Poisonings notified.
+	std::atomic<uint64_t> pins;			///< Permanent entries added.
+	LatencyHistogram detection;			///< From the arrival of a conflicting frame to its check.
+	LatencyHistogram remediation;		///< From the arrival of a poisoning to its permanent entry.
+
+	WorkerMetrics() : frames( 0 ), replies( 0 ), unknown( 0 ), conflicts( 0 ), alerts( 0 ),
+		pins( 0 ) {}
+
+	/**
+	 * Adds to a counter. Only its writer thread can call it: it's a load
+	 * and a store, without the locked instruction of fetch_add().
+	 */
+	static void add( std::atomic<uint64_t> &counter, uint64_t n ){
+		counter.store( counter.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+	}
+};
+
+/** The state of the scans, written by the thread that sweeps. */
+struct ScanMetrics{
+	std::atomic<bool> running;		///< A sweep is in progress.
+	std::atomic<uint64_t> requests;	///< Requests sent by all the sweeps.
+	std::atomic<uint64_t> sweeps;	///< Sweeps finished.
+	std::atomic<unsigned> rate;		///< Maximum requests per second of the current or last sweep.
+	std::atomic<double> achieved;	///< Requests per second sent by the last sweep finished.
+	std::atomic<uint32_t> first;	///< First IP Address of the network, host byte order.
+	std::atomic<uint32_t> last;		///< Last IP Address of the network, not included.
+	std::atomic<uint32_t> current;	///< IP Address asked for last, host byte order.
+	std::atomic<uint64_t> bindings;	///< Bindings of the table in use.
+
+	ScanMetrics() : running( false ), requests( 0 ), sweeps( 0 ), rate( 0 ), achieved( 0 ), first( 0 ),
+		last( 0 ), current( 0 ), bindings( 0 ) {}
+
+	/** @return How far the sweep in progress is in the network, from 0 to 1. */
+	double progress() const {
+		uint32_t f = first, l = last, c = current;
+
+		return l > f && c >= f ? (double) (c - f + 1) / (l - f) : 0;
+	}
+};
+
+/**
+ * Builds a page in the Prometheus text format.
+ */
+class MetricsText{
+public:
+	/**
+	 * Starts a metric.
+	 *
+	 * @param name The name of the metric.
+	 * @param type counter or gauge.
+	 * @param help What it measures.
+	 */
+	void family( const char *name, const char *type, const char *help ){
+		out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+	}
+
+	/** Adds a sample without labels. */
+	template<class V>
+	void sample( const char *name, V value ){
+		out << name << ' ' << value << '\n';
+	}
+
+	/** Adds a sample with a label. */
+	template<class V>
+	void sample( const char *name, const char *label, unsigned labelValue, V value ){
+		out << name << '{' << label << "=\"" << labelValue << "\"} " << value << '\n';
+	}
+
+	/** Adds a sample with a label whose value is text. */
+	template<class V>
+	void sample( const char *name, const char *label, const char *labelValue, V value ){
+		out << name << '{' << label << "=\"" << labelValue << "\"} " << value << '\n';
+	}
+
+	std::string str() const { return out.str(); }
+
+private:
+	std::ostringstream out;
+};
+
+/**
+ * Serves the metrics over HTTP from a background thread, one request at
+ * a time: scrapes are rare and short.
+ */
+class MetricsServer{
+public:
+	/**
+	 * Starts listening.
+	 *
+	 * @param endpoint [address:]port for TCP, on 127.0.0.1 if there's no
+	 * address, or unix:path for a unix socket.
+	 * @param render Builds the page of metrics, called by the server
+	 * thread on every scrape.
+	 *
+	 * @throw runtime_error If the endpoint is wrong or it couldn't listen on it.
+	 */
+	MetricsServer( const std::string &endpoint, std::function<std::string()> render )
+		throw( std::runtime_error )
+		: page( render ), running( true )
+	{
+		if( endpoint.compare( 0, 5, "unix:" ) == 0 ){
+			struct sockaddr_un sun;
+
+			unixPath = endpoint.substr( 5 );
+			memset( &sun, 0, sizeof(sun) );
+			sun.sun_family = AF_UNIX;
+			if( unixPath.empty() || unixPath.size() >= sizeof(sun.sun_path) )
+				throw std::runtime_error( endpoint + ": wrong unix socket path" );
+			strcpy( sun.sun_path, unixPath.c_str() );
+			unlink( unixPath.c_str() );
+			listen( AF_UNIX, (struct sockaddr*) &sun, sizeof(sun), endpoint );
+		}
+		else{
+			struct sockaddr_in sin;
+			size_t colon = endpoint.rfind( ':' );
+			std::string host = colon == std::string::npos ? "127.0.0.1" : endpoint.substr( 0, colon );
+			int port = atoi( endpoint.c_str() + (colon == std::string::npos ? 0 : colon + 1) );
+
+			memset( &sin, 0, sizeof(sin) );
+			sin.sin_family = AF_INET;
+			sin.sin_port = htons( port );
+			if( port <= 0 || port > 65535 || !inet_aton( host.c_str(), &sin.sin_addr ) )
+				throw std::runtime_error( endpoint + ": wrong address or port" );
+			listen( AF_INET, (struct sockaddr*) &sin, sizeof(sin), endpoint );
+		}
+		server = std::thread( &MetricsServer::run, this );
+	}
+
+	~MetricsServer(){
+		stop();
+		close( sockfd );
+		if( !unixPath.empty() )
+			unlink( unixPath.c_str() );
+	}
+
+	/** Stops serving, the render function isn't called anymore. */
+	void stop(){
+		running = false;
+		if( server.joinable() )
+			server.join();
+	}
+
+private:
+	std::function<std::string()> page;
+	std::string unixPath;
+	int sockfd;
+	std::thread server;
+	std::atomic<bool> running;
+
+	void listen( int family, const struct sockaddr *addr, socklen_t len, const std::string &endpoint )
+		throw( std::runtime_error )
+	{
+		int one = 1;
+
+		sockfd = socket( family, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+		if( sockfd < 0 )
+			throw std::runtime_error( "socket: " + std::string(strerror(errno)) );
+		setsockopt( sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+		if( bind( sockfd, addr, len ) < 0 || ::listen( sockfd, 16 ) < 0 ){
+			int err = errno;
+
+			close( sockfd );
+			throw std::runtime_error( endpoint + ": " + std::string(strerror(err)) );
+		}
+	}
+
+	/** Answers the requests until it's stopped. */
+	void run(){
+		while( running ){
+			struct pollfd pfd = { sockfd, POLLIN, 0 };
+
+			if( poll( &pfd, 1, METRICS_POLL_MS ) <= 0 )
+				continue;
+
+			int client = accept4( sockfd, NULL, NULL, SOCK_CLOEXEC );
+			if( client >= 0 ){
+				answer( client );
+				close( client );
+			}
+		}
+	}
+
+	/** Reads a request and sends the page, or an error if it's not a GET. */
+	void answer( int client ){
+		char request[METRICS_REQUEST_MAX + 1];
+		size_t len = 0;
+		std::string status = "200 OK", body;
+
+		// Up to the end of the headers; the body of a GET is ignored.
+		while( len < METRICS_REQUEST_MAX ){
+			struct pollfd pfd = { client, POLLIN, 0 };
+			ssize_t n;
+
+			if( poll( &pfd, 1, METRICS_REQUEST_MS ) <= 0 ||
+					(n = read( client, request + len, METRICS_REQUEST_MAX - len )) <= 0 )
+				return;
+			len += n;
+			request[len] = '\0';
+			if( strstr( request, "\r\n\r\n" ) || strstr( request, "\n\n" ) )
+				break;
+		}
+		request[len] = '\0';
+
+		if( strncmp( request, "GET ", 4 ) )
+			status = "405 Method Not Allowed";
+		else if( strncmp( request + 4, "/metrics ", 9 ) && strncmp( request + 4, "/ ", 2 ) )
+			status = "404 Not Found";
+		else
+			body = page();
+
+		std::ostringstream response;
+		response << "HTTP/1.0 " << status << "\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: " << body.size() << "\r\nConnection: close\r\n\r\n" << body;
+
+		// A client that goes away must not kill the tool with SIGPIPE.
+		std::string text = response.str();
+		for( size_t sent = 0 ; sent < text.size() ; ){
+			ssize_t n = send( client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL );
+
+			if( n <= 0 && errno != EINTR )
+				return;
+			sent += n > 0 ? n : 0;
+		}
+	}
+
+	MetricsServer( const MetricsServer& );
+	MetricsServer& operator = ( const MetricsServer& );
+};
+
+#endif
@@ -0,0 +1,279 @@
+/**
+ * @file: pcap_reader.h
+ *
+ * Reader of pcap and pcapng capture files. The file is mapped in memory
+ * and the frames are handed out in place, without copies, so a capture
+ * is read as fast as the disk gives it.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef PCAP_READER_H
+#define PCAP_READER_H
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Link type of Ethernet frames.
+#define LINKTYPE_ETHERNET	1
+
+/// Magic number of pcap files with timestamps in microseconds.
+#define PCAP_MAGIC_US		0xa1b2c3d4
+
+/// Magic number of pcap files with timestamps in nanoseconds.
+#define PCAP_MAGIC_NS		0xa1b23c4d
+
+/// Type of the Section Header Block of pcapng files.
+#define PCAPNG_SHB			0x0A0D0D0A
+
+/// Byte order magic of the Section Header Block.
+#define PCAPNG_BYTE_ORDER	0x1A2B3C4D
+
+
+/**
+ * Sequential reader of the Ethernet frames of a capture file.
+ */
+class PcapReader{
+public:
+	/**
+	 * Opens and maps a capture file.
+	 *
+	 * @param path The path of the file.
+	 *
+	 * @throw runtime_error If it couldn't be mapped, or it's not a pcap
+	 * or pcapng file of Ethernet frames.
+	 */
+	explicit PcapReader( const std::string &path ) throw( std::runtime_error )
+		: base( NULL ), size( 0 ), swapped( false ), ng( false ), others( 0 )
+	{
+		struct stat st;
+		int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+
+		if( fd < 0 || fstat( fd, &st ) < 0 ){
+			if( fd >= 0 )
+				close( fd );
+			throw std::runtime_error( path + ": " + std::string(strerror(errno)) );
+		}
+		size = st.st_size;
+		if( size < 24 ){
+			close( fd );
+			throw std::runtime_error( path + ": not a capture file" );
+		}
+		void *map = mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		close( fd );
+		if( map == MAP_FAILED )
+			throw std::runtime_error( path + ": mmap: " + std::string(strerror(errno)) );
+		madvise( map, size, MADV_SEQUENTIAL );
+		base = static_cast<const uint8_t*>( map );
+		end = base + size;
+		pos = base;
+
+		uint32_t magic = read32( base );
+		if( magic == PCAPNG_SHB )
+			ng = true;
+		else{
+			if( magic == __builtin_bswap32( PCAP_MAGIC_US ) ||
+					magic == __builtin_bswap32( PCAP_MAGIC_NS ) ){
+				swapped = true;
+				magic = __builtin_bswap32( magic );
+			}
+			if( magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS ){
+				munmap( map, size );
+				throw std::runtime_error( path + ": not a capture file" );
+			}
+			if( read32( base + 20 ) != LINKTYPE_ETHERNET ){
+				munmap( map, size );
+				throw std::runtime_error( path + ": not a capture of Ethernet frames" );
+			}
+			fraction = magic == PCAP_MAGIC_US ? 1000 : 1;
+			pos = base + 24;
+		}
+	}
+
+	~PcapReader(){
+		munmap( const_cast<uint8_t*>( base ), size );
+	}
+
+	/**
+	 * Gets the next Ethernet frame. A record cut at the end of the file,
+	 * as left by a capture still being written, ends the reading.
+	 *
+	 * @param data Where the start of the frame is stored. It points inside
+	 * the file, and it's valid while the reader lives.
+	 * @param len Where the number of bytes captured is stored.
+	 * @param timestamp Where the capture time is stored, in nanoseconds
+	 * since the epoch.
+	 * @return false at the end of the file.
+	 *
+	 * @throw runtime_error If the file is corrupt.
+	 */
+	bool next( const uint8_t *&data, uint32_t &len, uint64_t &timestamp ) throw( std::runtime_error )
+	{
+		if( !ng ){
+			if( end - pos < 16 )
+				return false;
+			len = read32( pos + 8 );
+			if( len > (size_t) (end - pos - 16) )
+				return false;
+			timestamp = read32( pos ) * 1000000000ULL + read32( pos + 4 ) * fraction;
+			data = pos + 16;
+			pos += 16 + len;
+			return true;
+		}
+		return nextBlock( data, len, timestamp );
+	}
+
+	/** @return The number of frames skipped for not being Ethernet. */
+	uint64_t skipped() const { return others; }
+
+	/** @return How many bytes of the file have been read. */
+	uint64_t offset() const { return pos - base; }
+
+private:
+	/** An interface of a pcapng section. */
+	struct Interface{
+		uint32_t linktype;
+		uint64_t units;		///< Timestamp units per second.
+		uint64_t scale;		///< Nanoseconds per unit, 0 if it's not exact.
+		uint64_t divisor;	///< Units per nanosecond, 0 if it's not exact.
+	};
+
+	const uint8_t *base;
+	const uint8_t *end;
+	const uint8_t *pos;
+	size_t size;
+	bool swapped;			///< The file has the other byte order.
+	bool ng;				///< The file is pcapng.
+	uint64_t fraction;		///< pcap: nanoseconds per unit of the second fraction.
+	std::vector<Interface> interfaces;	///< pcapng: the interfaces of the section.
+	uint64_t others;
+
+	uint32_t read32( const uint8_t *p ) const {
+		uint32_t v;
+
+		memcpy( &v, p, sizeof(v) );
+		return swapped ? __builtin_bswap32( v ) : v;
+	}
+
+	uint16_t read16( const uint8_t *p ) const {
+		uint16_t v;
+
+		memcpy( &v, p, sizeof(v) );
+		return swapped ? __builtin_bswap16( v ) : v;
+	}
+
+	/** Walks the pcapng blocks up to the next Ethernet frame. */
+	bool nextBlock( const uint8_t *&data, uint32_t &len, uint64_t &timestamp ) throw( std::runtime_error )
+	{
+		while( end - pos >= 12 ){
+			uint32_t type = read32( pos );
+
+			if( type == PCAPNG_SHB ){
+				uint32_t order;
+
+				memcpy( &order, pos + 8, sizeof(order) );
+				if( order != PCAPNG_BYTE_ORDER && order != __builtin_bswap32( PCAPNG_BYTE_ORDER ) )
+					throw std::runtime_error( "pcapng: bad byte order magic" );
+				swapped = order != PCAPNG_BYTE_ORDER;
+				interfaces.clear();
+			}
+
+			uint32_t blen = read32( pos + 4 );
+			const uint8_t *body = pos + 8;
+
+			if( blen > (size_t) (end - pos) )
+				return false;
+			if( blen < 12 || blen % 4 )
+				throw std::runtime_error( "pcapng: bad block length" );
+			pos += blen;
+
+			if( type == 1 && blen >= 20 )	// Interface Description Block
+				addInterface( body, body + blen - 12 );
+			else if( type == 6 && blen >= 32 ){	// Enhanced Packet Block
+				uint32_t id = read32( body );
+
+				len = read32( body + 12 );
+				if( len > blen - 32 )
+					throw std::runtime_error( "pcapng: bad packet length" );
+				if( id >= interfaces.size() )
+					throw std::runtime_error( "pcapng: unknown interface" );
+				if( interfaces[id].linktype != LINKTYPE_ETHERNET ){
+					others++;
+					continue;
+				}
+				timestamp = toNs( interfaces[id], (uint64_t) read32( body + 4 ) << 32 | read32( body + 8 ) );
+				data = body + 20;
+				return true;
+			}
+			else if( type == 3 && blen >= 16 ){	// Simple Packet Block
+				if( interfaces.empty() )
+					throw std::runtime_error( "pcapng: unknown interface" );
+				if( interfaces[0].linktype != LINKTYPE_ETHERNET ){
+					others++;
+					continue;
+				}
+				len = read32( body );
+				if( len > blen - 16 )
+					len = blen - 16;
+				timestamp = 0;
+				data = body + 4;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/** Reads an Interface Description Block, body up to the options end. */
+	void addInterface( const uint8_t *body, const uint8_t *last ){
+		Interface i = { read16( body ), 1000000, 1000 };
+		const uint8_t *opt = body + 8;
+
+		while( last - opt >= 4 ){
+			uint16_t code = read16( opt ), olen = read16( opt + 2 );
+
+			if( !code || last - opt - 4 < olen )
+				break;
+			if( code == 9 && olen >= 1 ){	// if_tsresol
+				uint8_t r = opt[4];
+
+				i.units = 1;
+				for( int k = 0 ; k < (r & 0x7f) && i.units < 1000000000000000000ULL ; k++ )
+					i.units *= r & 0x80 ? 2 : 10;
+				i.scale = 1000000000ULL % i.units ? 0 : 1000000000ULL / i.units;
+				i.divisor = i.units % 1000000000ULL ? 0 : i.units / 1000000000ULL;
+			}
+			opt += 4 + ((olen + 3) & ~3);
+		}
+		interfaces.push_back( i );
+	}
+
+	static uint64_t toNs( const Interface &i, uint64_t t ){
+		if( i.scale )
+			return t * i.scale;
+		if( i.divisor )
+			return t / i.divisor;
+		// Units finer than a nanosecond overflow 64 bits when multiplied.
+		return t / i.units * 1000000000ULL +
+			(uint64_t) ((unsigned __int128) (t % i.units) * 1000000000ULL / i.units);
+	}
+
+	PcapReader( const PcapReader& );
+	PcapReader& operator = ( const PcapReader& );
+};
+
+#endif
@@ -0,0 +1,204 @@
+/**
+ * @file: probes.h
+ *
+ * Verifications in progress. When a reply contradicts the table the guard
+ * asks the network who owns the IP Address, and the answers are matched
+ * here until the deadline of the probe.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <atomic>
+#include <mutex>
+
+#include <stdint.h>
+
+#include "anti_arpspoof.h"
+
+/// The maximum number of verifications in progress.
+#define MAX_PROBES		32
+
+/// Time in milliseconds that the answers to a probe are collected.
+#define PROBE_WINDOW_MS	50
+
+
+/**
+ * One verification. Every field is atomic since the answers can be
+ * received by any worker.
+ */
+struct Probe{
+	std::atomic<int> state;					///< PROBE_FREE, PROBE_SETUP or PROBE_PENDING.
+	std::atomic<uint32_t> ip;				///< The IP Address being verified.
+	std::atomic<uint64_t> claimant;			///< Packed HW Address that claimed the IP.
+	std::atomic<uint64_t> owner;			///< Packed HW Address of the IP in the table, 0 if none.
+	std::atomic<uint64_t> deadline;			///< When the verdict is given, CLOCK_MONOTONIC ns.
+	std::atomic<uint64_t> arrival;			///< When the claim arrived, ns since the epoch.
+	std::atomic<unsigned> worker;			///< The worker that gives the verdict.
+	std::atomic<bool> unsolicited;			///< The claim was a reply that nobody asked for.
+	std::atomic<bool> ownerAnswered;		///< The owner answered for the IP.
+	std::atomic<unsigned> othersAnswered;	///< Answers from HW Addresses besides the owner and claimant.
+};
+
+enum{
+	PROBE_FREE,		///< The slot is not used.
+	PROBE_SETUP,	///< The slot is being filled.
+	PROBE_PENDING	///< Waiting for answers.
+};
+
+/** What ProbeTable::launch() did. */
+enum Launch{
+	LAUNCH_STARTED,		///< The verification was started.
+	LAUNCH_VERIFYING,	///< There's already one for the IP Address.
+	LAUNCH_FULL			///< There's no room for another one.
+};
+
+/**
+ * Fixed table of verifications in progress, shared by the workers
+ * without locks.
+ */
+class ProbeTable{
+public:
+	ProbeTable() : active( 0 ) {
+		for( int i = 0 ; i < MAX_PROBES ; i++ )
+			probes[i].state = PROBE_FREE;
+	}
+
+	/**
+	 * Starts a verification, unless there's one for the same IP Address.
+	 * The launches are serialized, so two workers can't start one for the
+	 * same IP Address; they only happen on conflicts.
+	 *
+	 * @param ip The IP Address claimed.
+	 * @param claimant The HW Address that claimed it.
+	 * @param owner Packed HW Address of the IP in the table, 0 if none.
+	 * @param unsolicited If the claim was a reply that nobody asked for.
+	 * @param worker The worker that will give the verdict.
+	 * @param deadline When the verdict is given, CLOCK_MONOTONIC ns.
+	 * @param arrival When the claim arrived, ns since the epoch.
+	 * @return If it was started, or why not.
+	 */
+	Launch launch( uint32_t ip, const uint8_t claimant[], uint64_t owner, bool unsolicited,
+			unsigned worker, uint64_t deadline, uint64_t arrival = 0 )
+	{
+		std::lock_guard<std::mutex> l( launching );
+		Probe *slot = NULL;
+
+		// Look for the IP Address before taking a slot, a slot taken is only freed by its worker.
+		for( int i = 0 ; i < MAX_PROBES ; i++ )
+			if( probes[i].state == PROBE_PENDING && probes[i].ip == ip )
+				return LAUNCH_VERIFYING;
+		for( int i = 0 ; i < MAX_PROBES && !slot ; i++ ){
+			int expected = PROBE_FREE;
+
+			if( probes[i].state.compare_exchange_strong( expected, PROBE_SETUP ) )
+				slot = &probes[i];
+		}
+		if( !slot )
+			return LAUNCH_FULL;
+		slot->ip = ip;
+		slot->claimant = packHWAddr( claimant );
+		slot->owner = owner;
+		slot->unsolicited = unsolicited;
+		slot->deadline = deadline;
+		slot->arrival = arrival;
+		slot->worker = worker;
+		slot->ownerAnswered = false;
+		slot->othersAnswered = 0;
+		active++;
+		slot->state = PROBE_PENDING;
+		return LAUNCH_STARTED;
+	}
+
+	/**
+	 * Matches a received reply against the verifications in progress.
+	 * It's cheap when there are none.
+	 *
+	 * @param ip The sender IP Address of the reply.
+	 * @param hw The sender HW Address of the reply.
+	 */
+	void observe( uint32_t ip, const uint8_t hw[] ){
+		if( !active.load( std::memory_order_relaxed ) )
+			return;
+
+		uint64_t sender = packHWAddr( hw );
+		for( int i = 0 ; i < MAX_PROBES ; i++ ){
+			Probe &p = probes[i];
+
+			if( p.state != PROBE_PENDING || p.ip != ip )
+				continue;
+			if( sender == p.owner )
+				p.ownerAnswered = true;
+			else if( sender != p.claimant )
+				p.othersAnswered++;
+		}
+	}
+
+	/**
+	 * @return true if the IP Address is being verified.
+	 */
+	bool pending( uint32_t ip ) const {
+		if( !active.load( std::memory_order_relaxed ) )
+			return false;
+		for( int i = 0 ; i < MAX_PROBES ; i++ )
+			if( probes[i].state == PROBE_PENDING && probes[i].ip == ip )
+				return true;
+		return false;
+	}
+
+	/**
+	 * Gives the verdict of the expired verifications of a worker.
+	 *
+	 * @param worker The worker.
+	 * @param now The current time, CLOCK_MONOTONIC ns.
+	 * @param verdict Callable as verdict( const Probe &probe ). The slot is
+	 * freed after the call.
+	 */
+	template<class Verdict>
+	void expire( unsigned worker, uint64_t now, Verdict verdict ){
+		if( !active.load( std::memory_order_relaxed ) )
+			return;
+
+		for( int i = 0 ; i < MAX_PROBES ; i++ ){
+			Probe &p = probes[i];
+
+			if( p.state != PROBE_PENDING || p.worker != worker || p.deadline > now )
+				continue;
+			verdict( p );
+			p.state = PROBE_FREE;
+			active--;
+		}
+	}
+
+	/**
+	 * @return The earliest deadline of the verifications of a worker,
+	 * 0 if there are none.
+	 */
+	uint64_t nextDeadline( unsigned worker ) const {
+		uint64_t next = 0;
+
+		if( !active.load( std::memory_order_relaxed ) )
+			return 0;
+		for( int i = 0 ; i < MAX_PROBES ; i++ ){
+			const Probe &p = probes[i];
+
+			if( p.state == PROBE_PENDING && p.worker == worker && (!next || p.deadline < next) )
+				next = p.deadline;
+		}
+		return next;
+	}
+
+private:
+	Probe probes[MAX_PROBES];
+	std::atomic<int> active;	///< Verifications in progress.
+	std::mutex launching;		///< Held while starting a verification.
+};
+
+#endif
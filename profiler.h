@@ -0,0 +1,119 @@
+/**
+ * @file: profiler.h
+ *
+ * Time spent by the guard in each stage of the path of a frame, measured
+ * with the cycle counter of the CPU, which costs a few cycles to read.
+ * Every worker has its own profile and each stage is written by a single
+ * thread, so accounting a stage is a plain add; the profiles are only
+ * summed when they're dumped.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <atomic>
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "anti_arpspoof.h"
+#include "spsc_ring.h"
+
+/** The stages of the path of a frame. */
+enum Stage{
+	STAGE_RECEIVE,		///< Getting the spans of frames from the source.
+	STAGE_PARSE,		///< Parsing the frames.
+	STAGE_LOOKUP,		///< Checking the sender against the table and the requests.
+	STAGE_SUPPRESS,		///< Looking if a conflict was already notified or is being verified.
+	STAGE_ALERT,		///< Starting a verification or queuing an alert, without the prompt.
+	STAGE_REMEDIATE,	///< Adding a permanent entry.
+	STAGES
+};
+
+/**
+ * @return The ticks of the cycle counter, or nanoseconds of CLOCK_MONOTONIC
+ * where there isn't one.
+ */
+inline uint64_t profileTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return monotonicNs();
+#endif
+}
+
+/** The time and frames of a stage, in its own cache line. */
+struct alignas(CACHE_LINE) StageCounter{
+	std::atomic<uint64_t> ticks;	///< Ticks spent in the stage.
+	std::atomic<uint64_t> frames;	///< Frames that went through the stage.
+
+	StageCounter() : ticks( 0 ), frames( 0 ) {}
+};
+
+/**
+ * The time spent in each stage by a worker.
+ */
+class StageProfile{
+public:
+	/**
+	 * Ends a stage. Only the thread that runs the stage can call it.
+	 *
+	 * @param stage The stage.
+	 * @param since The ticks when the stage started.
+	 * @param frames The frames that went through it.
+	 * @return The ticks now, when the next stage starts.
+	 */
+	uint64_t add( Stage stage, uint64_t since, uint64_t frames = 1 ){
+		uint64_t now = profileTicks();
+		StageCounter &c = stages[stage];
+
+		c.ticks.store( c.ticks.load( std::memory_order_relaxed ) + (now - since), std::memory_order_relaxed );
+		c.frames.store( c.frames.load( std::memory_order_relaxed ) + frames, std::memory_order_relaxed );
+		return now;
+	}
+
+	/** @return The ticks spent in a stage. */
+	uint64_t ticks( Stage stage ) const { return stages[stage].ticks; }
+
+	/** @return The frames that went through a stage. */
+	uint64_t frames( Stage stage ) const { return stages[stage].frames; }
+
+private:
+	StageCounter stages[STAGES];
+};
+
+/**
+ * Converts ticks to nanoseconds, comparing the ticks and the monotonic
+ * clock since it was created.
+ */
+class TickClock{
+public:
+	TickClock() : ticks( profileTicks() ), ns( monotonicNs() ) {}
+
+	/** @return The ticks per nanosecond measured so far, 1 if none passed yet. */
+	double perNs() const {
+		uint64_t elapsed = monotonicNs() - ns;
+
+		return elapsed ? (double) (profileTicks() - ticks) / elapsed : 1;
+	}
+
+	/** @return The nanoseconds since it was created. */
+	uint64_t elapsed() const { return monotonicNs() - ns; }
+
+private:
+	uint64_t ticks;
+	uint64_t ns;
+};
+
+#endif
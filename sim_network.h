@@ -0,0 +1,312 @@
+/**
+ * @file: sim_network.h
+ *
+ * A simulated network on a virtual clock, in place of the ARP socket. It
+ * has hosts that answer the requests after a random round trip time,
+ * losses, and an attacker that answers for some of them and can claim
+ * them on its own. Time only advances when the sweep or the guard waits,
+ * so a scan of a big network takes a fraction of a second, and the same
+ * seed always gives the same run.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef SIM_NETWORK_H
+#define SIM_NETWORK_H
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+#include <cstring>
+#include <stdint.h>
+
+#include <arpa/inet.h>
+#include <linux/if_arp.h>
+#include <net/ethernet.h>
+
+#include "anti_arpspoof.h"
+#include "frame_source.h"
+
+/// Virtual time when a simulation starts, in nanoseconds.
+#define SIM_EPOCH		1000000000ULL
+
+/// HW Address of the attacker, packed as by packHWAddr().
+#define SIM_ATTACKER	0x010000006602ULL
+
+
+/** How the round trip times are spread. */
+enum RttShape{
+	RTT_FIXED,		///< Always the shortest one.
+	RTT_UNIFORM,	///< The shortest one plus up to the jitter.
+	RTT_EXPONENTIAL	///< The shortest one plus an exponential tail, the jitter is its mean.
+};
+
+/** The settings of a simulated network. */
+struct SimConfig{
+	unsigned hosts;			///< Hosts that answer, from the first host of the network.
+	uint64_t rtt;			///< Shortest round trip time, in nanoseconds.
+	uint64_t jitter;		///< Extra round trip time, in nanoseconds, see RttShape.
+	RttShape shape;
+	double loss;			///< Probability that a request or its reply is lost.
+	unsigned spoofers;		///< Hosts whose IP Address is also answered by the attacker.
+	uint64_t spoofEvery;	///< Period of unsolicited claims of each of them, in nanoseconds, 0 for none.
+	uint64_t seed;			///< Seed of the random numbers.
+};
+
+/**
+ * The simulated network. The random numbers come from its own generator,
+ * not from <random>, so the runs are the same with any library.
+ */
+class SimNetwork{
+public:
+	/**
+	 * @param ld The local info of the simulated interface. The hosts and
+	 * the attacker answer to it.
+	 * @param c The settings.
+	 *
+	 * @throw runtime_error If the hosts don't fit in the network.
+	 */
+	SimNetwork( const LocalData &ld, const SimConfig &c ) throw( std::runtime_error )
+		: local( ld ), config( c ), clock( SIM_EPOCH ), seed( c.seed ), order( 0 ),
+		  requests( 0 ), drops( 0 ), replies( 0 )
+	{
+		uint32_t ip = ntohl( ld.firstHost );
+
+		for( unsigned i = 0 ; i < c.hosts ; ip++ ){
+			if( ip >= ntohl( ld.lastHost ) )
+				throw std::runtime_error( "the hosts don't fit in the network" );
+			if( htonl( ip ) != ld.ipAddr ){
+				hostIPs.push_back( ip );
+				i++;
+			}
+		}
+		for( unsigned i = 0 ; i < c.spoofers && i < c.hosts ; i++ ){
+			uint32_t victim = hostIPs[(uint64_t) i * c.hosts / c.spoofers];
+
+			spoofed.insert( victim );
+			if( c.spoofEvery )
+				schedule( clock + (uint64_t) (uniform() * c.spoofEvery), claim( victim ), true );
+		}
+	}
+
+	/** @return The virtual time, in nanoseconds. */
+	uint64_t now() const { return clock; }
+
+	/**
+	 * Puts a frame on the network. The hosts answer the requests for
+	 * their IP Address, and the attacker the ones of the spoofed hosts.
+	 */
+	void send( const ARPFrame &frame ){
+		if( ntohs( frame.opcode ) != ARPOP_REQUEST )
+			return;
+		requests++;
+
+		uint32_t ip = ntohl( frame.ip_dst );
+		if( !isHost( ip ) )
+			return;
+		answer( frame, ip, hostHW( ip ) );
+		if( spoofed.count( ip ) )
+			answer( frame, ip, SIM_ATTACKER );
+	}
+
+	/**
+	 * Waits for a frame, advancing the virtual clock up to its arrival
+	 * or the deadline.
+	 *
+	 * @param frame Where the frame is stored.
+	 * @param deadline Until when to wait, in virtual nanoseconds.
+	 * @return false if no frame arrived.
+	 */
+	bool receive( ARPFrame &frame, uint64_t deadline ){
+		if( events.empty() || events.top().time > deadline ){
+			if( deadline > clock )
+				clock = deadline;
+			return false;
+		}
+
+		Event e = events.top();
+		events.pop();
+		if( e.time > clock )
+			clock = e.time;
+		frame = e.frame;
+		if( e.periodic )
+			schedule( clock + config.spoofEvery, e.frame, true );
+		replies++;
+		return true;
+	}
+
+	/** @return true if no frame can arrive anymore. */
+	bool idle() const { return events.empty(); }
+
+	/** @return The HW Address of a host, packed as by packHWAddr(). */
+	static uint64_t hostHW( uint32_t ip ){
+		uint8_t hw[8] = { 0x02, 0x5e, (uint8_t) (ip >> 24), (uint8_t) (ip >> 16),
+			(uint8_t) (ip >> 8), (uint8_t) ip, 0, 0 };
+
+		return packHWAddr( hw );
+	}
+
+	/** @return The IP Addresses answered by the attacker, host byte order. */
+	const std::set<uint32_t>& spoofedIPs() const { return spoofed; }
+
+	/** @return The number of requests sent to the network. */
+	uint64_t sent() const { return requests; }
+
+	/** @return The number of requests or replies lost. */
+	uint64_t lost() const { return drops; }
+
+	/** @return The number of frames received from the network. */
+	uint64_t received() const { return replies; }
+
+private:
+	/** A frame on its way. */
+	struct Event{
+		uint64_t time;		///< When it arrives.
+		uint64_t order;		///< Breaks the ties, so the order never depends on the heap.
+		bool periodic;		///< It's sent again every SimConfig::spoofEvery.
+		ARPFrame frame;
+
+		bool operator < ( const Event &e ) const {
+			return time != e.time ? time > e.time : order > e.order;
+		}
+	};
+
+	LocalData local;
+	SimConfig config;
+	std::vector<uint32_t> hostIPs;	///< Host byte order, ascending.
+	std::set<uint32_t> spoofed;		///< Host byte order.
+	std::priority_queue<Event> events;
+	uint64_t clock;
+	uint64_t seed;
+	uint64_t order;
+	uint64_t requests;
+	uint64_t drops;
+	uint64_t replies;
+
+	/** @return A pseudo-random number in [0, 1). */
+	double uniform(){
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		return (seed >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	uint64_t roundTrip(){
+		if( config.shape == RTT_UNIFORM )
+			return config.rtt + (uint64_t) (uniform() * config.jitter);
+		if( config.shape == RTT_EXPONENTIAL )
+			return config.rtt + (uint64_t) (-std::log( 1 - uniform() ) * config.jitter);
+		return config.rtt;
+	}
+
+	bool isHost( uint32_t ip ) const {
+		return std::binary_search( hostIPs.begin(), hostIPs.end(), ip );
+	}
+
+	void schedule( uint64_t time, const ARPFrame &frame, bool periodic ){
+		Event e;
+
+		e.time = time;
+		e.order = order++;
+		e.periodic = periodic;
+		e.frame = frame;
+		events.push( e );
+	}
+
+	/** Schedules the reply of a device to a request, unless it's lost. */
+	void answer( const ARPFrame &request, uint32_t ip, uint64_t hw ){
+		ARPFrame reply = request;
+		HWAddr sender = unpackHWAddr( hw );
+
+		if( config.loss > 0 && uniform() < config.loss ){
+			drops++;
+			return;
+		}
+		memcpy( reply.eth_dst, request.eth_src, MAC_ADDR_LEN );
+		memcpy( reply.eth_src, sender.hw, MAC_ADDR_LEN );
+		reply.opcode = htons( ARPOP_REPLY );
+		memcpy( reply.hw_src, sender.hw, MAC_ADDR_LEN );
+		reply.ip_src = htonl( ip );
+		memcpy( reply.hw_dst, request.hw_src, MAC_ADDR_LEN );
+		reply.ip_dst = request.ip_src;
+		schedule( clock + roundTrip(), reply, false );
+	}
+
+	/** @return An unsolicited reply of the attacker claiming an IP Address. */
+	ARPFrame claim( uint32_t ip ) const {
+		ARPFrame f;
+		HWAddr attacker = unpackHWAddr( SIM_ATTACKER );
+
+		memcpy( f.eth_dst, local.hwAddr, MAC_ADDR_LEN );
+		memcpy( f.eth_src, attacker.hw, MAC_ADDR_LEN );
+		f.eth_ethertype = htons( ETH_P_ARP );
+		f.hw_type = htons( ARPHRD_ETHER );
+		f.protocol = htons( ETH_P_IP );
+		f.hw_len = MAC_ADDR_LEN;
+		f.proto_len = IP_ADDR_LEN;
+		f.opcode = htons( ARPOP_REPLY );
+		memcpy( f.hw_src, attacker.hw, MAC_ADDR_LEN );
+		f.ip_src = htonl( ip );
+		memcpy( f.hw_dst, local.hwAddr, MAC_ADDR_LEN );
+		f.ip_dst = local.ipAddr;
+		return f;
+	}
+};
+
+/**
+ * The packet I/O of a sweep on a SimNetwork, see SocketIO. It only
+ * refers to the network, so the sweeper can keep a copy.
+ */
+class SimIO{
+public:
+	SimIO( SimNetwork &n ) : net( &n ) {}
+
+	uint64_t now() const { return net->now(); }
+	bool send( const ARPFrame &frame ){ net->send( frame ); return true; }
+	bool receive( ARPFrame &frame, uint64_t deadline ){ return net->receive( frame, deadline ); }
+
+private:
+	SimNetwork *net;
+};
+
+/**
+ * The frames of a SimNetwork as a FrameSource, stamped with the virtual
+ * time. Waiting for frames advances the virtual clock instead of
+ * sleeping; the source ends when no frame can arrive anymore.
+ */
+class SimSource : public FrameSource{
+public:
+	explicit SimSource( SimNetwork &n ) : net( n ) {}
+
+	int receive( const FrameRef *&frames, uint64_t timeout ) throw( std::runtime_error ){
+		uint64_t deadline = net.now() + timeout;
+		int n = 0;
+
+		if( net.idle() )
+			return -1;
+		while( n < SOURCE_BATCH && net.receive( copies[n], deadline ) ){
+			refs[n].data = reinterpret_cast<const uint8_t*>( &copies[n] );
+			refs[n].len = sizeof(ARPFrame);
+			refs[n].timestamp = net.now();
+			n++;
+		}
+		frames = refs;
+		return n;
+	}
+
+	const char* name() const { return "sim"; }
+
+private:
+	SimNetwork &net;
+	ARPFrame copies[SOURCE_BATCH];
+	FrameRef refs[SOURCE_BATCH];
+};
+
+#endif
@@ -0,0 +1,184 @@
+/**
+ * @file: snapshot.h
+ *
+ * Publication of immutable objects to reader threads with epoch based
+ * reclamation. Readers never lock: they announce the epoch they entered
+ * in, load the pointer and leave. A writer swaps the pointer in a single
+ * step and frees the old object once no reader can still be using it.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+#include "spsc_ring.h"
+
+/// The default maximum number of threads registered as readers at the same time.
+#define SNAPSHOT_MAX_READERS	64
+
+
+template<class T> class SnapshotReader;
+
+/**
+ * Holds the current version of an object of type T.
+ */
+template<class T>
+class Snapshot{
+public:
+	/**
+	 * @param initial The first version, it's owned by the Snapshot.
+	 * @param readers The maximum number of threads registered as readers at
+	 * the same time.
+	 */
+	explicit Snapshot( const T *initial = NULL, unsigned readers = SNAPSHOT_MAX_READERS )
+		: current( initial ), epoch( 1 ), slots( new Slot[readers] ), nslots( readers )
+	{
+		for( unsigned i = 0 ; i < nslots ; i++ ){
+			slots[i].used = false;
+			slots[i].epoch = 0;
+		}
+	}
+
+	~Snapshot(){
+		delete current.load();
+		for( auto &r : retired )
+			delete r.first;
+		delete[] slots;
+	}
+
+	/**
+	 * Replaces the current version. The old one is freed when all the
+	 * readers that could see it are done with it.
+	 *
+	 * @param next The new version, it's owned by the Snapshot.
+	 */
+	void publish( const T *next ){
+		std::lock_guard<std::mutex> lock( writeLock );
+		const T *old = current.exchange( next );
+
+		retired.push_back( std::make_pair( old, epoch.fetch_add( 1 ) + 1 ) );
+		reclaim();
+	}
+
+	/**
+	 * Frees the retired versions that no reader can be using. It's also
+	 * done on every publish().
+	 */
+	void collect(){
+		std::lock_guard<std::mutex> lock( writeLock );
+		reclaim();
+	}
+
+	/** @return The number of old versions waiting for the readers. */
+	size_t pending(){
+		std::lock_guard<std::mutex> lock( writeLock );
+		return retired.size();
+	}
+
+private:
+	friend class SnapshotReader<T>;
+
+	/** The epoch announced by one reader thread, 0 when it's outside. */
+	struct Slot{
+		std::atomic<bool> used;
+		std::atomic<uint64_t> epoch;
+		char pad[CACHE_LINE - 2 * sizeof(uint64_t)];
+	};
+
+	std::atomic<const T*> current;
+	std::atomic<uint64_t> epoch;
+	Slot *slots;		///< One per reader thread.
+	unsigned nslots;
+
+	std::mutex writeLock;
+	std::vector< std::pair<const T*, uint64_t> > retired; ///< Old versions and the epoch they were retired in.
+
+	void reclaim(){
+		uint64_t oldest = UINT64_MAX;
+
+		// A reader announced in an epoch lower than the retire epoch of a
+		// version could have loaded it before the swap.
+		for( unsigned i = 0 ; i < nslots ; i++ ){
+			uint64_t e = slots[i].epoch.load();
+			if( e && e < oldest )
+				oldest = e;
+		}
+		for( size_t i = 0 ; i < retired.size() ; ){
+			if( retired[i].second <= oldest ){
+				delete retired[i].first;
+				retired[i] = retired.back();
+				retired.pop_back();
+			}
+			else
+				i++;
+		}
+	}
+
+	Snapshot( const Snapshot& );
+	Snapshot& operator = ( const Snapshot& );
+};
+
+/**
+ * The registration of one reader thread. Each thread that reads a
+ * Snapshot needs its own SnapshotReader.
+ */
+template<class T>
+class SnapshotReader{
+public:
+	/**
+	 * @throw runtime_error If there are already as many readers as the
+	 * Snapshot was created for.
+	 */
+	explicit SnapshotReader( Snapshot<T> &s ) throw( std::runtime_error )
+		: snap( s ), slot( NULL )
+	{
+		for( unsigned i = 0 ; i < s.nslots && !slot ; i++ ){
+			bool expected = false;
+			if( s.slots[i].used.compare_exchange_strong( expected, true ) )
+				slot = &s.slots[i];
+		}
+		if( !slot )
+			throw std::runtime_error( "Too many snapshot readers" );
+	}
+
+	~SnapshotReader(){
+		slot->epoch = 0;
+		slot->used = false;
+	}
+
+	/**
+	 * Gets the current version. It stays valid until leave() is called.
+	 */
+	const T* enter(){
+		slot->epoch = snap.epoch.load();
+		return snap.current.load();
+	}
+
+	/** Stops using the version returned by enter(). */
+	void leave(){
+		slot->epoch.store( 0, std::memory_order_release );
+	}
+
+private:
+	Snapshot<T> &snap;
+	typename Snapshot<T>::Slot *slot;
+
+	SnapshotReader( const SnapshotReader& );
+	SnapshotReader& operator = ( const SnapshotReader& );
+};
+
+#endif
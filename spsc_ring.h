@@ -0,0 +1,110 @@
+/**
+ * @file: spsc_ring.h
+ *
+ * Bounded lock-free queue for one producer thread and one consumer
+ * thread.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+
+/// Size in bytes of a cache line.
+#define CACHE_LINE	64
+
+
+/**
+ * Single-producer/single-consumer ring of fixed capacity. The indexes
+ * written by each side live in their own cache line, and each side keeps
+ * a private copy of the other index so it only touches the shared line
+ * when the ring looks full (producer) or empty (consumer).
+ */
+template<class T>
+class SPSCRing{
+public:
+	/**
+	 * @param capacity Number of slots, must be a power of two.
+	 */
+	explicit SPSCRing( size_t capacity )
+		: items( new T[capacity] ), mask( capacity - 1 ), head( 0 ),
+		cachedTail( 0 ), tail( 0 ), cachedHead( 0 )
+	{
+	}
+
+	~SPSCRing(){
+		delete[] items;
+	}
+
+	/**
+	 * Adds an item. Only called by the producer thread.
+	 *
+	 * @return false if the ring is full, the item is not added.
+	 */
+	bool push( const T &item ){
+		size_t t = tail.load( std::memory_order_relaxed );
+
+		if( t - cachedHead > mask ){
+			cachedHead = head.load( std::memory_order_acquire );
+			if( t - cachedHead > mask )
+				return false;
+		}
+		items[t & mask] = item;
+		tail.store( t + 1, std::memory_order_release );
+		return true;
+	}
+
+	/**
+	 * Takes the oldest item. Only called by the consumer thread.
+	 *
+	 * @return false if the ring is empty.
+	 */
+	bool pop( T &item ){
+		size_t h = head.load( std::memory_order_relaxed );
+
+		if( h == cachedTail ){
+			cachedTail = tail.load( std::memory_order_acquire );
+			if( h == cachedTail )
+				return false;
+		}
+		item = items[h & mask];
+		head.store( h + 1, std::memory_order_release );
+		return true;
+	}
+
+	/** @return The number of queued items, from any thread. */
+	size_t size() const {
+		return tail.load( std::memory_order_acquire ) - head.load( std::memory_order_acquire );
+	}
+
+	/** @return The number of slots. */
+	size_t capacity() const {
+		return mask + 1;
+	}
+
+private:
+	T *items;
+	const size_t mask;
+	char pad0[CACHE_LINE];
+
+	std::atomic<size_t> head;	///< Next slot to pop, written by the consumer.
+	size_t cachedTail;			///< Consumer's copy of tail.
+	char pad1[CACHE_LINE];
+
+	std::atomic<size_t> tail;	///< Next slot to push, written by the producer.
+	size_t cachedHead;			///< Producer's copy of head.
+	char pad2[CACHE_LINE];
+
+	SPSCRing( const SPSCRing& );
+	SPSCRing& operator = ( const SPSCRing& );
+};
+
+#endif
@@ -0,0 +1,357 @@
+/**
+ * @file: sweeper.h
+ *
+ * Paced ARP sweep of the local network. The requests are sent at a fixed
+ * rate while the replies are collected, so the cost of a sweep is the
+ * time to send it plus one reply window.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef SWEEPER_H
+#define SWEEPER_H
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <cstring>
+#include <ctime>
+
+#include <arpa/inet.h>
+#include <linux/if_arp.h>
+#include <net/ethernet.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "anti_arpspoof.h"
+
+/// Time in milliseconds to wait for late replies after the last request.
+#define SWEEP_REPLY_WINDOW	1000
+
+/// Bits of the host part of the slices of the network in SweepStats, /24 slices.
+#define SWEEP_SLICE_BITS	8
+
+
+/** Every HW Address that answered for each IP Address (network byte order). */
+typedef std::map< uint32_t, std::set<HWAddr> > SweepResult;
+
+/** The counters of a sweep, of the whole network or of a slice of it. */
+struct SweepCounters{
+	uint64_t probes;		///< Requests sent.
+	uint64_t retries;		///< Requests sent after the first pass.
+	uint64_t replies;		///< Replies received, several per IP Address if it has several devices.
+	uint64_t timeouts;		///< Requests not answered before the end of their pass.
+	std::vector<uint64_t> rtts;	///< Nanoseconds from the request of each IP Address to its first reply.
+
+	SweepCounters() : probes( 0 ), retries( 0 ), replies( 0 ), timeouts( 0 ) {}
+
+	/** @return The shortest round trip time, 0 if none. */
+	uint64_t minRTT() const {
+		return rtts.empty() ? 0 : *std::min_element( rtts.begin(), rtts.end() );
+	}
+
+	/** @return The mean round trip time, 0 if none. */
+	uint64_t avgRTT() const {
+		uint64_t sum = 0;
+
+		for( uint64_t r : rtts )
+			sum += r;
+		return rtts.empty() ? 0 : sum / rtts.size();
+	}
+
+	/**
+	 * @param q The quantile, from 0 to 1.
+	 * @return The round trip time of the quantile, 0 if none.
+	 */
+	uint64_t quantileRTT( double q ) const {
+		std::vector<uint64_t> sorted( rtts );
+		size_t rank = q * sorted.size();
+
+		if( sorted.empty() )
+			return 0;
+		if( rank >= sorted.size() )
+			rank = sorted.size() - 1;
+		std::nth_element( sorted.begin(), sorted.begin() + rank, sorted.end() );
+		return sorted[rank];
+	}
+};
+
+/** The statistics of a slice of #SWEEP_SLICE_BITS host bits of the network. */
+struct SliceStats : SweepCounters{
+	uint32_t first;		///< First IP Address of the slice in the network, host byte order.
+	uint32_t last;		///< Last IP Address of the slice in the network, included.
+};
+
+/** The statistics of a sweep. */
+struct SweepStats : SweepCounters{
+	uint64_t elapsed;				///< Duration of the sweep, in nanoseconds.
+	size_t answered;				///< IP Addresses that answered.
+	std::vector<SliceStats> slices;	///< The slices of the network, in order.
+
+	SweepStats() : elapsed( 0 ), answered( 0 ) {}
+
+	/** @return The requests sent per second. */
+	double pps() const { return elapsed ? probes * 1e9 / elapsed : 0; }
+};
+
+/**
+ * The packet I/O of a sweep on an ARP socket, with the real clock.
+ * Another class with the same members can replace it, see SimIO.
+ */
+class SocketIO{
+public:
+	/** @param sfd The ARP socket, as returned by initSocket(). */
+	SocketIO( int sfd ) : sockfd( sfd ) {}
+
+	/** @return The current time, CLOCK_MONOTONIC ns. */
+	uint64_t now() const { return monotonicNs(); }
+
+	/** Sends a frame. @return false if it couldn't be sent. */
+	bool send( const ARPFrame &frame ){
+		return write( sockfd, &frame, sizeof(frame) ) == sizeof(frame);
+	}
+
+	/**
+	 * Waits for a frame.
+	 *
+	 * @param frame Where the frame is stored.
+	 * @param deadline Until when to wait, CLOCK_MONOTONIC ns.
+	 * @return false if no whole frame arrived.
+	 */
+	bool receive( ARPFrame &frame, uint64_t deadline ){
+		struct pollfd pfd = { sockfd, POLLIN, 0 };
+		uint64_t t = monotonicNs();
+		uint64_t left = deadline > t ? deadline - t : 0;
+		struct timespec wait = { (time_t) (left / 1000000000ULL), (long) (left % 1000000000ULL) };
+
+		if( ppoll( &pfd, 1, &wait, NULL ) <= 0 )
+			return false;
+		return read( sockfd, &frame, sizeof(frame) ) >= (int) sizeof(frame);
+	}
+
+private:
+	int sockfd;
+};
+
+/**
+ * Sends ARP requests for a range of IP Addresses and collects the replies.
+ *
+ * @tparam IO How the frames are sent and received, and the clock, see
+ * SocketIO.
+ */
+template<class IO>
+class BasicSweeper{
+public:
+	/**
+	 * @param packetIO The packet I/O, an ARP socket for Sweeper.
+	 * @param ld The local info about the network interface.
+	 */
+	BasicSweeper( const IO &packetIO, const LocalData &ld )
+		: io( packetIO ), local( ld ), requests( 0 ), window( SWEEP_REPLY_WINDOW )
+	{
+		memset( request.eth_dst, 0xff, MAC_ADDR_LEN );
+		memcpy( request.eth_src, ld.hwAddr, MAC_ADDR_LEN );
+		request.eth_ethertype = htons( ETH_P_ARP );
+		request.hw_type = htons( ARPHRD_ETHER );
+		request.protocol = htons( ETH_P_IP );
+		request.hw_len = MAC_ADDR_LEN;
+		request.proto_len = IP_ADDR_LEN;
+		request.opcode = htons( ARPOP_REQUEST );
+		memcpy( request.hw_src, ld.hwAddr, MAC_ADDR_LEN );
+		request.ip_src = ld.ipAddr;
+		memset( request.hw_dst, 0, MAC_ADDR_LEN );
+	}
+
+	/**
+	 * Sweeps the hosts from ld.firstHost up to ld.lastHost (not included).
+	 * The replies are collected during the whole sweep, so every device
+	 * that answers for an IP Address is recorded, not only the first one.
+	 *
+	 * @param pps The maximum number of requests per second.
+	 * @param tries The number of passes. Each pass after the first one
+	 * only asks for the IP Addresses that didn't answer yet.
+	 * @param running The sweep stops early when it becomes false.
+	 * @param progress Callable as progress( uint32_t ip ), before sending
+	 * each request.
+	 * @return The responders of every IP Address that answered.
+	 */
+	template<class Progress>
+	SweepResult sweep( unsigned pps, unsigned tries, const std::atomic<bool> &running,
+			Progress progress )
+	{
+		std::vector<uint32_t> hosts;
+
+		for( uint32_t host = ntohl( local.firstHost ) ; host < ntohl( local.lastHost ) ; host++ )
+			hosts.push_back( htonl( host ) );
+		return sweep( hosts, pps, tries, running, progress );
+	}
+
+	/**
+	 * Sweeps some IP Addresses of the network, see
+	 * sweep( unsigned, unsigned, const std::atomic<bool>&, Progress ).
+	 *
+	 * @param hosts The IP Addresses to ask for (network byte order). Only
+	 * the ones from ld.firstHost up to ld.lastHost can be answered.
+	 */
+	template<class Progress>
+	SweepResult sweep( std::vector<uint32_t> hosts, unsigned pps, unsigned tries,
+			const std::atomic<bool> &running, Progress progress )
+	{
+		SweepResult result;
+		std::vector<uint32_t> missing;
+		uint32_t first = ntohl( local.firstHost );
+		uint32_t last = ntohl( local.lastHost );
+		uint64_t gap = 1000000000ULL / (pps ? pps : 1);
+		uint64_t start = io.now();
+
+		startStats( first, last );
+		for( unsigned t = 0 ; t < tries && !hosts.empty() && running ; t++ ){
+			uint64_t next = io.now();
+
+			for( size_t i = 0 ; i < hosts.size() && running ; i++ ){
+				receiveUntil( next, first, last, result );
+				progress( hosts[i] );
+				request.ip_dst = hosts[i];
+				if( io.send( request ) ){
+					requests++;
+					countRequest( ntohl( hosts[i] ), first, last, t > 0 );
+				}
+				next += gap;
+			}
+			receiveUntil( io.now() + window * 1000000ULL, first, last, result );
+
+			missing.clear();
+			for( uint32_t ip : hosts ){
+				if( !result.count( ip ) )
+					missing.push_back( ip );
+				countTimeout( ntohl( ip ), first, last );
+			}
+			hosts.swap( missing );
+		}
+		statistics.elapsed = io.now() - start;
+		statistics.answered = result.size();
+		return result;
+	}
+
+	/**
+	 * Sweeps the network once, see sweep( unsigned, unsigned, const std::atomic<bool>&, Progress ).
+	 */
+	SweepResult sweep( unsigned pps, const std::atomic<bool> &running ){
+		return sweep( pps, 1, running, NoProgress() );
+	}
+
+	/**
+	 * Asks for some IP Addresses, see
+	 * sweep( std::vector<uint32_t>, unsigned, unsigned, const std::atomic<bool>&, Progress ).
+	 */
+	SweepResult sweep( const std::vector<uint32_t> &hosts, unsigned pps, unsigned tries,
+			const std::atomic<bool> &running )
+	{
+		return sweep( hosts, pps, tries, running, NoProgress() );
+	}
+
+	/** @return The number of requests sent by all the sweeps. */
+	uint64_t sent() const { return requests; }
+
+	/** @return The statistics of the last sweep. */
+	const SweepStats& stats() const { return statistics; }
+
+	/**
+	 * Changes the time to wait for late replies after the last request
+	 * of each pass, #SWEEP_REPLY_WINDOW by default.
+	 */
+	void setReplyWindow( unsigned ms ){ window = ms; }
+
+private:
+	IO io;
+	LocalData local;
+	ARPFrame request;
+	uint64_t requests;
+	unsigned window;	///< Milliseconds to wait for late replies.
+	SweepStats statistics;	///< The statistics of the last sweep.
+	std::vector<uint64_t> pending;	///< When each host of the network was asked for, 0 if it answered.
+
+	struct NoProgress{
+		void operator () ( uint32_t ) const {}
+	};
+
+	/** Clears the statistics and splits the network from first to last in slices. */
+	void startStats( uint32_t first, uint32_t last ){
+		statistics = SweepStats();
+		pending.assign( last > first ? last - first : 0, 0 );
+		for( uint64_t base = first >> SWEEP_SLICE_BITS << SWEEP_SLICE_BITS ; base < last ;
+				base += 1 << SWEEP_SLICE_BITS ){
+			SliceStats slice;
+
+			slice.first = base > first ? base : first;
+			slice.last = std::min<uint64_t>( base + (1 << SWEEP_SLICE_BITS), last ) - 1;
+			statistics.slices.push_back( slice );
+		}
+	}
+
+	/** @return The slice of a host of the network, from first to last. */
+	SliceStats& sliceOf( uint32_t host, uint32_t first ){
+		return statistics.slices[(host >> SWEEP_SLICE_BITS) - (first >> SWEEP_SLICE_BITS)];
+	}
+
+	/** Counts a request for a host, in host byte order. */
+	void countRequest( uint32_t host, uint32_t first, uint32_t last, bool retry ){
+		statistics.probes++;
+		statistics.retries += retry;
+		if( host < first || host >= last )
+			return;
+		SliceStats &slice = sliceOf( host, first );
+		slice.probes++;
+		slice.retries += retry;
+		pending[host - first] = io.now();
+	}
+
+	/** Counts a host asked for in a pass as timed out if it didn't answer. */
+	void countTimeout( uint32_t host, uint32_t first, uint32_t last ){
+		if( host < first || host >= last || !pending[host - first] )
+			return;
+		statistics.timeouts++;
+		sliceOf( host, first ).timeouts++;
+		pending[host - first] = 0;
+	}
+
+	/** Collects the replies addressed to us until the deadline. */
+	void receiveUntil( uint64_t deadline, uint32_t first, uint32_t last, SweepResult &result ){
+		ARPFrame reply;
+
+		while( io.now() < deadline ){
+			if( !io.receive( reply, deadline ) )
+				continue;
+			if( ntohs(reply.opcode) != ARPOP_REPLY || reply.ip_dst != local.ipAddr ||
+					ntohl(reply.ip_src) < first || ntohl(reply.ip_src) >= last )
+				continue;
+			result[reply.ip_src].insert( HWAddr( reply.hw_src ) );
+
+			// The first reply to the request gives its round trip time.
+			uint32_t host = ntohl( reply.ip_src );
+			SliceStats &slice = sliceOf( host, first );
+			statistics.replies++;
+			slice.replies++;
+			if( pending[host - first] ){
+				uint64_t rtt = io.now() - pending[host - first];
+
+				statistics.rtts.push_back( rtt );
+				slice.rtts.push_back( rtt );
+				pending[host - first] = 0;
+			}
+		}
+	}
+};
+
+/** Sweeps through an ARP socket. */
+typedef BasicSweeper<SocketIO> Sweeper;
+
+#endif
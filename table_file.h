@@ -0,0 +1,302 @@
+/**
+ * @file: table_file.h
+ *
+ * The ARP table saved on disk, so a restart can guard the network right
+ * away instead of scanning it again. The file is a header followed by
+ * fixed-size records; it's replaced atomically when saved and read
+ * through mmap when loaded.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef TABLE_FILE_H
+#define TABLE_FILE_H
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "anti_arpspoof.h"
+#include "arp_table.h"
+
+/// Identifies a table file.
+#define TABLE_FILE_MAGIC	"AATABLE"
+
+/// Version of the format of the table file.
+#define TABLE_FILE_VERSION	1
+
+
+/** The header of a table file. */
+struct TableFileHeader{
+	char		magic[8];			///< #TABLE_FILE_MAGIC.
+	uint32_t	version;			///< #TABLE_FILE_VERSION.
+	uint32_t	recordSize;			///< sizeof(TableFileRecord).
+	char		ifname[IFNAMSIZ];	///< The network interface scanned.
+	uint32_t	firstHost;			///< First host of the network scanned.
+	uint32_t	lastHost;			///< Last host of the network scanned.
+	uint64_t	savedAt;			///< When it was saved, in nanoseconds since the epoch.
+	uint64_t	count;				///< The number of records after the header.
+	uint32_t	checksum;			///< CRC-32 of the header (with this field 0) and the records.
+	uint32_t	reserved;
+};
+
+/** One binding of a table file. */
+struct TableFileRecord{
+	uint8_t		hw[MAC_ADDR_LEN];	///< HW Address.
+	uint8_t		reserved[2];
+	uint32_t	ip;					///< IP Address.
+};
+
+static_assert( sizeof(TableFileHeader) == 64, "TableFileHeader must be 64 bytes" );
+static_assert( sizeof(TableFileRecord) == 12, "TableFileRecord must be 12 bytes" );
+
+/**
+ * Updates a CRC-32 (IEEE 802.3) with more bytes.
+ *
+ * @param crc The CRC of the previous bytes, 0 at the start.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ * @return The CRC including the new bytes.
+ */
+inline uint32_t crc32( uint32_t crc, const void *data, size_t len )
+{
+	// Built once, the first call from any thread.
+	static const struct Table{
+		uint32_t t[256];
+
+		Table(){
+			for( uint32_t i = 0 ; i < 256 ; i++ ){
+				uint32_t c = i;
+				for( int k = 0 ; k < 8 ; k++ )
+					c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+				t[i] = c;
+			}
+		}
+	} table;
+	const uint8_t *p = static_cast<const uint8_t*>( data );
+
+	crc = ~crc;
+	while( len-- )
+		crc = table.t[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/**
+ * Writes a whole buffer to a file.
+ *
+ * @return false if it couldn't be written, errno tells why.
+ */
+inline bool writeAll( int fd, const void *data, size_t len )
+{
+	const char *p = static_cast<const char*>( data );
+
+	while( len ){
+		ssize_t n = write( fd, p, len );
+		if( n < 0 && errno == EINTR )
+			continue;
+		if( n <= 0 )
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/**
+ * Makes a rename durable, syncing the directory of the file.
+ *
+ * @param path The new path of the file.
+ */
+inline void syncDir( const std::string &path )
+{
+	size_t slash = path.find_last_of( '/' );
+	std::string dir = slash == std::string::npos ? "." :
+		slash == 0 ? "/" : path.substr( 0, slash );
+	int fd = open( dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+
+	if( fd >= 0 ){
+		fsync( fd );
+		close( fd );
+	}
+}
+
+/**
+ * A table file for one network interface. It's only valid for the
+ * network it was saved for.
+ */
+class TableFile{
+public:
+	/**
+	 * @param path The path of the file.
+	 * @param ifname The name of the network interface.
+	 * @param ld The local info about the network interface.
+	 */
+	TableFile( const std::string &path, const char *ifname, const LocalData &ld )
+		: filePath( path ), local( ld )
+	{
+		memset( iface, 0, sizeof(iface) );
+		strncpy( iface, ifname, IFNAMSIZ - 1 );
+	}
+
+	/** @return The path of the file. */
+	const std::string& path() const { return filePath; }
+
+	/**
+	 * Loads the bindings of the file.
+	 *
+	 * @param table Where the bindings are added.
+	 * @param savedAt Where the time it was saved is stored, in
+	 * nanoseconds since the epoch.
+	 * @return false if the file doesn't exist.
+	 *
+	 * @throw runtime_error If the file couldn't be read, it's corrupt or
+	 * it was saved for another network.
+	 */
+	bool load( ARPTable &table, uint64_t &savedAt ) throw( std::runtime_error )
+	{
+		struct stat st;
+		int fd = open( filePath.c_str(), O_RDONLY | O_CLOEXEC );
+
+		if( fd < 0 && errno == ENOENT )
+			return false;
+		if( fd < 0 || fstat( fd, &st ) < 0 ){
+			if( fd >= 0 )
+				close( fd );
+			throw std::runtime_error( filePath + ": " + std::string(strerror(errno)) );
+		}
+		if( st.st_size < (off_t) sizeof(TableFileHeader) ){
+			close( fd );
+			throw std::runtime_error( filePath + ": not a table file" );
+		}
+
+		void *map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		close( fd );
+		if( map == MAP_FAILED )
+			throw std::runtime_error( filePath + ": mmap: " + std::string(strerror(errno)) );
+
+		const char *error = check( static_cast<const TableFileHeader*>( map ), st.st_size );
+		if( !error ){
+			const TableFileHeader *h = static_cast<const TableFileHeader*>( map );
+			const TableFileRecord *r = reinterpret_cast<const TableFileRecord*>( h + 1 );
+
+			for( uint64_t i = 0 ; i < h->count ; i++ ){
+				struct in_addr ip = { r[i].ip };
+				table.add( HWAddr( r[i].hw ), ip );
+			}
+			savedAt = h->savedAt;
+		}
+		munmap( map, st.st_size );
+		if( error )
+			throw std::runtime_error( filePath + ": " + error );
+		return true;
+	}
+
+	/**
+	 * Saves the bindings. A temporary file is written and synced, then
+	 * renamed over the old one, so a crash leaves either the old or the
+	 * new file.
+	 *
+	 * @param table The bindings to save.
+	 *
+	 * @throw runtime_error If the file couldn't be written.
+	 */
+	void save( const ARPTable &table ) throw( std::runtime_error )
+	{
+		std::vector<TableFileRecord> records;
+		TableFileHeader h;
+		struct timespec now;
+		std::string tmp = filePath + ".tmp";
+
+		table.forEach( [&]( const HWAddr &hw, struct in_addr ip ){
+			TableFileRecord r;
+
+			memcpy( r.hw, hw.hw, MAC_ADDR_LEN );
+			memset( r.reserved, 0, sizeof(r.reserved) );
+			r.ip = ip.s_addr;
+			records.push_back( r );
+		} );
+		// Same table, same file.
+		std::sort( records.begin(), records.end(),
+			[]( const TableFileRecord &a, const TableFileRecord &b ){
+				return ntohl( a.ip ) < ntohl( b.ip ) ||
+					(a.ip == b.ip && memcmp( a.hw, b.hw, MAC_ADDR_LEN ) < 0);
+			} );
+
+		clock_gettime( CLOCK_REALTIME, &now );
+		memset( &h, 0, sizeof(h) );
+		memcpy( h.magic, TABLE_FILE_MAGIC, sizeof(TABLE_FILE_MAGIC) );
+		h.version = TABLE_FILE_VERSION;
+		h.recordSize = sizeof(TableFileRecord);
+		memcpy( h.ifname, iface, IFNAMSIZ );
+		h.firstHost = local.firstHost;
+		h.lastHost = local.lastHost;
+		h.savedAt = now.tv_sec * 1000000000ULL + now.tv_nsec;
+		h.count = records.size();
+		h.checksum = crc32( crc32( 0, &h, sizeof(h) ), records.data(),
+			records.size() * sizeof(TableFileRecord) );
+
+		int fd = open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 );
+		if( fd < 0 )
+			throw std::runtime_error( tmp + ": " + std::string(strerror(errno)) );
+		if( !writeAll( fd, &h, sizeof(h) ) ||
+				!writeAll( fd, records.data(), records.size() * sizeof(TableFileRecord) ) ||
+				fsync( fd ) < 0 ){
+			int err = errno;
+			close( fd );
+			unlink( tmp.c_str() );
+			throw std::runtime_error( tmp + ": " + std::string(strerror(err)) );
+		}
+		close( fd );
+		if( rename( tmp.c_str(), filePath.c_str() ) < 0 ){
+			int err = errno;
+			unlink( tmp.c_str() );
+			throw std::runtime_error( filePath + ": " + std::string(strerror(err)) );
+		}
+		syncDir( filePath );
+	}
+
+private:
+	std::string filePath;
+	char iface[IFNAMSIZ];
+	LocalData local;
+
+	/** @return Why the file can't be used, NULL if it's fine. */
+	const char* check( const TableFileHeader *h, off_t size ) const {
+		TableFileHeader copy = *h;
+
+		if( memcmp( h->magic, TABLE_FILE_MAGIC, sizeof(TABLE_FILE_MAGIC) ) )
+			return "not a table file";
+		if( h->version != TABLE_FILE_VERSION || h->recordSize != sizeof(TableFileRecord) )
+			return "unsupported version";
+		if( (uint64_t) (size - sizeof(*h)) / sizeof(TableFileRecord) != h->count ||
+				(size - sizeof(*h)) % sizeof(TableFileRecord) )
+			return "truncated";
+		copy.checksum = 0;
+		if( crc32( crc32( 0, &copy, sizeof(copy) ), h + 1,
+					h->count * sizeof(TableFileRecord) ) != h->checksum )
+			return "bad checksum";
+		if( strncmp( h->ifname, iface, IFNAMSIZ ) || h->firstHost != local.firstHost ||
+				h->lastHost != local.lastHost )
+			return "saved for another network";
+		return NULL;
+	}
+};
+
+#endif
@@ -0,0 +1,453 @@
+/**
+ * @file: arp_bench.cpp
+ *
+ * Throughput benchmark of the checks of the guard. Synthetic streams of
+ * ARP frames, and optionally a capture file, are fed from memory through
+ * the same code that checks the frames received from the network, so
+ * the numbers don't depend on the network or the kernel.
+ *
+ * For every stream it reports frames per second, nanoseconds and heap
+ * allocations per frame, and percentiles of the time per frame within
+ * each span of frames, for two engines:
+ *
+ *	- guard: the path of a frame through a worker of the tool against
+ *	  a scanned table, checkSpan(), with the frame history, the event
+ *	  log, the evidence, the metrics and the profile of the stages, but
+ *	  without sending probes or asking the user.
+ *	- capture: the Detector of the analysis of capture files, which
+ *	  learns the table from the replies.
+ *
+ * Each engine is warmed up with ALLOCATION_WARMUP frames of the stream
+ * before it's measured, so the allocations are the ones of the steady
+ * state; with -z the benchmark fails if there's any.
+ *
+ * Build it with the same flags as the tool, so the results can be
+ * compared across builds:
+ *
+ *	g++ -std=c++11 -O2 -pthread -o arp_bench tools/arp_bench.cpp
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <net/if.h>
+#include <linux/if_arp.h>
+#include <net/ethernet.h>
+
+// The allocations are always counted.
+#ifndef COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS
+#endif
+
+#include "../anti_arpspoof.h"
+#include "../arp_table.h"
+#include "../frame_source.h"
+#include "../engine.h"
+#include "../guard.h"
+
+/// Frames checked of each stream, by default.
+#define BENCH_FRAMES	4000000
+
+/// Hosts of the synthetic network, by default.
+#define BENCH_HOSTS		1024
+
+/// Distinct frames of each synthetic stream, handed out again and again.
+#define BENCH_STREAM	65536
+
+using namespace std;
+
+
+// ===============================
+// Streams
+// ===============================
+
+/** A stream of frames kept in memory. */
+struct Stream{
+	string name;
+	vector<uint8_t> bytes;		///< The frames, one after the other.
+	vector<uint32_t> lens;		///< The length of each frame.
+	vector<uint64_t> stamps;	///< The capture time of each frame, 0 if unknown.
+	vector<FrameRef> refs;		///< Built by seal().
+
+	/** Appends a frame. */
+	void add( const void *data, uint32_t len, uint64_t timestamp ){
+		bytes.insert( bytes.end(), (const uint8_t*) data, (const uint8_t*) data + len );
+		lens.push_back( len );
+		stamps.push_back( timestamp );
+	}
+
+	/** Points the references to the frames, once they are all added. */
+	void seal(){
+		const uint8_t *p = bytes.data();
+
+		refs.clear();
+		for( size_t i = 0 ; i < lens.size() ; i++ ){
+			FrameRef ref = { p, lens[i], stamps[i] };
+
+			refs.push_back( ref );
+			p += lens[i];
+		}
+	}
+};
+
+/** The synthetic network: host i has 10.0.x.y and 02:00:00:00:x:y. */
+struct Network{
+	unsigned hosts;
+	uint32_t seed;
+
+	uint32_t ipOf( unsigned i ) const { return htonl( 0x0a000000 | (i + 1) ); }
+
+	HWAddr hwOf( unsigned i ) const {
+		uint8_t hw[MAC_ADDR_LEN] = { 0x02, 0, 0, 0, (uint8_t) ((i + 1) >> 8), (uint8_t) (i + 1) };
+		return HWAddr( hw );
+	}
+
+	/** @return A pseudo-random number, the same sequence every run. */
+	uint32_t random(){
+		seed = seed * 1103515245 + 12345;
+		return seed >> 8;
+	}
+
+	unsigned randomHost(){ return random() % hosts; }
+};
+
+/**
+ * Builds an ARP frame.
+ */
+ARPFrame makeFrame( uint16_t opcode, const HWAddr &src, uint32_t ipSrc,
+		const HWAddr &dst, uint32_t ipDst )
+{
+	ARPFrame f;
+
+	if( opcode == ARPOP_REQUEST )
+		memset( f.eth_dst, 0xff, MAC_ADDR_LEN );
+	else
+		memcpy( f.eth_dst, dst.hw, MAC_ADDR_LEN );
+	memcpy( f.eth_src, src.hw, MAC_ADDR_LEN );
+	f.eth_ethertype = htons( ETH_P_ARP );
+	f.hw_type = htons( ARPHRD_ETHER );
+	f.protocol = htons( ETH_P_IP );
+	f.hw_len = MAC_ADDR_LEN;
+	f.proto_len = IP_ADDR_LEN;
+	f.opcode = htons( opcode );
+	memcpy( f.hw_src, src.hw, MAC_ADDR_LEN );
+	f.ip_src = ipSrc;
+	if( opcode == ARPOP_REQUEST )
+		memset( f.hw_dst, 0, MAC_ADDR_LEN );
+	else
+		memcpy( f.hw_dst, dst.hw, MAC_ADDR_LEN );
+	f.ip_dst = ipDst;
+	return f;
+}
+
+/**
+ * Builds a synthetic stream. The frames are 1 microsecond apart.
+ *
+ * @param name steady, unknown, storm or mixed.
+ * @param net The synthetic network.
+ * @return The stream.
+ */
+Stream makeStream( const string &name, Network net )
+{
+	Stream s;
+	uint64_t t = 1000000000ULL;
+
+	s.name = name;
+	for( unsigned i = 0 ; i < BENCH_STREAM ; i++, t += 1000 ){
+		unsigned a = net.randomHost(), b = net.randomHost();
+		ARPFrame f;
+
+		if( name == "steady" ) // Known hosts answering for themselves.
+			f = makeFrame( ARPOP_REPLY, net.hwOf( a ), net.ipOf( a ), net.hwOf( b ), net.ipOf( b ) );
+		else if( name == "unknown" ){ // Devices that aren't in the table.
+			uint32_t r = net.random();
+			uint8_t hw[MAC_ADDR_LEN] = { 0x0a, (uint8_t) (r >> 16), (uint8_t) (r >> 8), (uint8_t) r,
+				(uint8_t) (i >> 8), (uint8_t) i };
+
+			f = makeFrame( ARPOP_REPLY, HWAddr( hw ), htonl( 0x0a800000 | (r & 0xffff) ),
+				net.hwOf( b ), net.ipOf( b ) );
+		}
+		else if( name == "storm" ) // One host claiming the addresses of the others.
+			f = makeFrame( ARPOP_REPLY, net.hwOf( 0 ), net.ipOf( a ? a : 1 ), net.hwOf( b ), net.ipOf( b ) );
+		else if( i % 2 == 0 ) // mixed: a request and its reply.
+			f = makeFrame( ARPOP_REQUEST, net.hwOf( b ), net.ipOf( b ), net.hwOf( a ), net.ipOf( a ) );
+		else{
+			const ARPFrame &req = *(const ARPFrame*) (s.bytes.data() + s.bytes.size() - sizeof(ARPFrame));
+			HWAddr asker( req.hw_src );
+			unsigned target = ntohl( req.ip_dst ) - 0x0a000001;
+
+			f = makeFrame( ARPOP_REPLY, net.hwOf( target ), req.ip_dst, asker, req.ip_src );
+		}
+		s.add( &f, sizeof(f), t );
+	}
+	s.seal();
+	return s;
+}
+
+/**
+ * Loads the frames of a capture file in memory.
+ *
+ * @throw runtime_error If the file couldn't be read.
+ */
+Stream loadStream( const string &path ) throw( runtime_error )
+{
+	PcapSource source( path );
+	const FrameRef *frames;
+	Stream s;
+	int n;
+
+	s.name = "capture";
+	while( (n = source.receive( frames, 0 )) >= 0 )
+		for( int i = 0 ; i < n ; i++ )
+			s.add( frames[i].data, frames[i].len, frames[i].timestamp );
+	s.seal();
+	return s;
+}
+
+
+// ===============================
+// Engines
+// ===============================
+
+/**
+ * A single worker of the guard, checkSpan(), with the I/O left out: the
+ * probes aren't sent and the alerts don't ask the user. The events and
+ * the evidence are written to /dev/null by their own threads.
+ */
+class GuardEngine{
+public:
+	explicit GuardEngine( const ARPTable &t ) throw( std::runtime_error )
+		: table( new TableSnapshot( t, 1 ), 1 ), reader( table )
+	{
+		shared.ifname = "bench";
+		shared.table = &table;
+		shared.events = new EventLog( "/dev/null", "bench", 1 );
+		shared.evidence = new EvidenceWriter( "/dev/null", 1, EVIDENCE_HISTORY );
+		shared.prompt = &prompt;
+		shared.sendProbes = sendProbes;
+		shared.notify = notify;
+		shard.id = 0;
+		shard.history = new FrameHistory( EVIDENCE_HISTORY );
+	}
+
+	~GuardEngine(){
+		shared.events->stop();
+		shared.evidence->stop();
+		delete shared.events;
+		delete shared.evidence;
+		delete shard.history;
+	}
+
+	void process( const FrameRef *frames, int n ){
+		uint64_t ticks = profileTicks();
+
+		checkSpan( frames, n, reader, shard, shared, NULL, ticks );
+	}
+
+	/** @return The alerts and the new devices. */
+	uint64_t events() const { return shard.metrics.alerts + shard.metrics.unknown; }
+
+private:
+	Snapshot<TableSnapshot> table;
+	SnapshotReader<TableSnapshot> reader;
+	GuardShared shared;
+	Shard shard;
+	std::mutex prompt;
+
+	static void sendProbes( int, const LocalData&, uint32_t, uint64_t ){}
+
+	static void notify( const HWAddr&, struct in_addr, bool, uint64_t, const Probe*,
+			const TableSnapshot&, Shard&, GuardShared&, uint64_t ){}
+};
+
+/** The Detector, with the poisonings counted. */
+class CaptureEngine{
+public:
+	CaptureEngine() : reported( 0 ) {}
+
+	void process( const FrameRef *frames, int n ){
+		detector.process( frames, n, [&]( const Poisoning& ){ reported++; } );
+	}
+
+	uint64_t reported;
+
+private:
+	Detector detector;
+};
+
+
+// ===============================
+// Measurement
+// ===============================
+
+/** What a run measured. */
+struct Result{
+	uint64_t frames;
+	uint64_t ns;
+	uint64_t allocations;
+	vector<double> perFrame;	///< Time per frame of each span, in nanoseconds.
+};
+
+/**
+ * Feeds a stream to an engine until the frames are checked, after
+ * warming it up.
+ */
+template<class Engine>
+Result run( Engine &engine, const Stream &stream, uint64_t frames )
+{
+	uint64_t rounds = (frames + stream.refs.size() - 1) / stream.refs.size();
+	MemorySource warmup( stream.refs, (ALLOCATION_WARMUP + stream.refs.size() - 1) / stream.refs.size() );
+	MemorySource source( stream.refs, rounds );
+	const FrameRef *span;
+	Result r;
+	int n;
+
+	while( (n = warmup.receive( span, 0 )) >= 0 )
+		engine.process( span, n );
+	r.frames = 0;
+	r.perFrame.reserve( rounds * (stream.refs.size() / SOURCE_BATCH + 1) );
+
+	// The threads that write the events and the evidence aren't counted.
+	uint64_t start = monotonicNs(), before = threadAllocationCount();
+	while( (n = source.receive( span, 0 )) >= 0 ){
+		uint64_t t = monotonicNs();
+
+		engine.process( span, n );
+		r.perFrame.push_back( (double) (monotonicNs() - t) / n );
+		r.frames += n;
+	}
+	r.ns = monotonicNs() - start;
+	r.allocations = threadAllocationCount() - before;
+	return r;
+}
+
+/** @return The value below which a fraction of the samples fall. */
+double percentile( vector<double> &v, double p )
+{
+	size_t i = min( v.size() - 1, (size_t) (p * v.size()) );
+
+	nth_element( v.begin(), v.begin() + i, v.end() );
+	return v[i];
+}
+
+void report( const string &stream, const string &engine, Result &r, uint64_t events )
+{
+	cout << left << setw( 9 ) << stream << setw( 9 ) << engine << right << fixed
+		<< setprecision( 0 ) << setw( 13 ) << r.frames * 1e9 / r.ns
+		<< setprecision( 1 ) << setw( 10 ) << (double) r.ns / r.frames
+		<< setprecision( 4 ) << setw( 14 ) << (double) r.allocations / r.frames
+		<< setprecision( 1 ) << setw( 9 ) << percentile( r.perFrame, 0.5 )
+		<< setw( 9 ) << percentile( r.perFrame, 0.99 )
+		<< setw( 9 ) << percentile( r.perFrame, 0.999 )
+		<< setw( 9 ) << events << endl;
+}
+
+int main( int argc, char **argv )
+{
+	uint64_t frames = BENCH_FRAMES;
+	Network net = { BENCH_HOSTS, 1 };
+	const char *capturePath = NULL;
+	string only;
+	bool strict = false;
+	bool badUsage = false;
+	int opt;
+
+	while( (opt = getopt( argc, argv, "f:h:n:s:z" )) != -1 ){
+		if( opt == 'f' )
+			capturePath = optarg;
+		else if( opt == 'h' && atoi(optarg) > 1 && atoi(optarg) < 65535 )
+			net.hosts = atoi( optarg );
+		else if( opt == 'n' && atoll(optarg) > 0 )
+			frames = atoll( optarg );
+		else if( opt == 's' )
+			only = optarg;
+		else if( opt == 'z' )
+			strict = true;
+		else
+			badUsage = true;
+	}
+	if( badUsage || optind != argc ){
+		cerr << "Uso:\n\t" << *argv << " [-n frames] [-h hosts] [-s stream] [-f capture] [-z]\n\n"
+			"\t-f\tAlso check the frames of a pcap or pcapng file\n"
+			"\t-h\tHosts of the synthetic network (default: " << BENCH_HOSTS << ")\n"
+			"\t-n\tFrames checked of each stream (default: " << BENCH_FRAMES << ")\n"
+			"\t-s\tOnly this stream: steady, unknown, storm, mixed or capture\n"
+			"\t-z\tFail if any frame allocates memory after the warm-up" << endl;
+		return 1;
+	}
+
+	vector<Stream> streams;
+	const char *names[] = { "steady", "unknown", "storm", "mixed" };
+
+	for( const char *name : names )
+		if( only.empty() || only == name )
+			streams.push_back( makeStream( name, net ) );
+	if( capturePath && (only.empty() || only == "capture") ){
+		try{
+			streams.push_back( loadStream( capturePath ) );
+		}
+		catch( runtime_error &e ){
+			cerr << e.what() << endl;
+			return 1;
+		}
+		if( streams.back().refs.empty() ){
+			cerr << capturePath << ": no frames" << endl;
+			return 1;
+		}
+	}
+
+	// The table of the guard, as left by a scan of the synthetic network.
+	ARPTable table;
+	for( unsigned i = 0 ; i < net.hosts ; i++ ){
+		struct in_addr ip = { net.ipOf( i ) };
+		table.add( net.hwOf( i ), ip );
+	}
+
+	cout << left << setw( 9 ) << "stream" << setw( 9 ) << "engine" << right
+		<< setw( 13 ) << "frames/s" << setw( 10 ) << "ns/frame" << setw( 14 ) << "allocs/frame"
+		<< setw( 9 ) << "p50" << setw( 9 ) << "p99" << setw( 9 ) << "p99.9"
+		<< setw( 9 ) << "events" << endl;
+
+	uint64_t allocated = 0;
+	for( auto &s : streams ){
+		{
+			GuardEngine guard( table );
+			Result r = run( guard, s, frames );
+
+			report( s.name, "guard", r, guard.events() );
+			allocated += r.allocations;
+		}
+		{
+			CaptureEngine capture;
+			Result r = run( capture, s, frames );
+
+			report( s.name, "capture", r, capture.reported );
+			allocated += r.allocations;
+		}
+	}
+	cout << "\nAllocations: after " << ALLOCATION_WARMUP << " frames of warm-up.\n"
+		"Percentiles: nanoseconds per frame within each span of up to "
+		<< SOURCE_BATCH << " frames.\nEvents: alerts and new devices (guard), "
+		"poisonings reported (capture)." << endl;
+	if( strict && allocated ){
+		cerr << allocated << " allocations after the warm-up" << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,266 @@
+/**
+ * @file: arp_responder.cpp
+ *
+ * Answers ARP requests for a set of virtual hosts, so a scan can be
+ * measured against a network of any size without the hosts. The answers
+ * can be lost or delayed on purpose, like in a busy network.
+ *
+ * The hosts are the first n addresses of the network after the first
+ * one, which is left for the scanner; host 10.200.1.2 answers with the
+ * HW Address 02:aa:0a:c8:01:02. It's meant to run at the far end of a
+ * veth pair, see netns_bench.sh.
+ *
+ *	g++ -std=c++11 -O2 -pthread -o arp_responder tools/arp_responder.cpp
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#include <iostream>
+#include <queue>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <atomic>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <linux/if_arp.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../anti_arpspoof.h"
+
+/// Frames received or sent per system call.
+#define RESPONDER_BATCH		64
+
+/// Receive and send buffer of the socket, in bytes.
+#define RESPONDER_BUFFER	(8 << 20)
+
+using namespace std;
+
+atomic<bool> active( true ); ///< Controls the main loop.
+
+/** A reply waiting for its time. */
+struct Pending{
+	uint64_t due;		///< When it's sent, CLOCK_MONOTONIC ns.
+	ARPFrame frame;
+
+	bool operator < ( const Pending &p ) const {
+		return due > p.due; // The earliest first in a priority_queue.
+	}
+};
+
+/** The counters printed at exit. */
+struct Counters{
+	uint64_t requests;	///< Requests received.
+	uint64_t ours;		///< Requests for one of the virtual hosts.
+	uint64_t lost;		///< Requests left without answer on purpose.
+	uint64_t sent;		///< Replies sent.
+	uint64_t failed;	///< Replies that couldn't be sent.
+};
+
+/** @return A pseudo-random number in [0, 1). */
+double uniform( uint64_t &seed )
+{
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (seed >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Opens a socket for ARP frames on an interface.
+ *
+ * @throw runtime_error If the socket couldn't be opened.
+ */
+int openSocket( const char *ifname ) throw( runtime_error )
+{
+	struct sockaddr_ll sll;
+	int size = RESPONDER_BUFFER;
+	int sockfd = socket( AF_PACKET, SOCK_RAW, htons(ETH_P_ARP) );
+
+	if( sockfd < 0 )
+		throw runtime_error( "socket: " + string(strerror(errno)) );
+	memset( &sll, 0, sizeof(sll) );
+	sll.sll_family = AF_PACKET;
+	sll.sll_ifindex = if_nametoindex( ifname );
+	sll.sll_protocol = htons( ETH_P_ARP );
+	if( !sll.sll_ifindex || bind( sockfd, (struct sockaddr*) &sll, sizeof(sll) ) < 0 ){
+		close( sockfd );
+		throw runtime_error( string(ifname) + ": " + string(strerror(errno)) );
+	}
+	// The scanner is measured, not the responder.
+	setsockopt( sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size) );
+	setsockopt( sockfd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size) );
+	return sockfd;
+}
+
+/**
+ * Sends the replies that are due.
+ */
+void sendDue( int sockfd, priority_queue<Pending> &pending, uint64_t now, Counters &counters )
+{
+	struct mmsghdr msgs[RESPONDER_BATCH];
+	struct iovec iov[RESPONDER_BATCH];
+	ARPFrame frames[RESPONDER_BATCH];
+
+	while( !pending.empty() && pending.top().due <= now ){
+		int n = 0;
+
+		memset( msgs, 0, sizeof(msgs) );
+		while( n < RESPONDER_BATCH && !pending.empty() && pending.top().due <= now ){
+			frames[n] = pending.top().frame;
+			pending.pop();
+			iov[n].iov_base = &frames[n];
+			iov[n].iov_len = sizeof(ARPFrame);
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			n++;
+		}
+
+		int sent = sendmmsg( sockfd, msgs, n, 0 );
+		if( sent < 0 )
+			sent = 0;
+		counters.sent += sent;
+		counters.failed += n - sent;
+	}
+}
+
+void sigKill( int ){
+	active = false;
+}
+
+int main( int argc, char **argv )
+{
+	unsigned hosts = 60000;
+	double loss = 0;
+	double delay = 0, jitter = 0;
+	uint64_t seed = 1;
+	bool badUsage = false;
+	int opt;
+
+	while( (opt = getopt( argc, argv, "d:J:l:n:x:" )) != -1 ){
+		if( opt == 'd' && atof(optarg) >= 0 )
+			delay = atof( optarg );
+		else if( opt == 'J' && atof(optarg) >= 0 )
+			jitter = atof( optarg );
+		else if( opt == 'l' && atof(optarg) >= 0 && atof(optarg) <= 100 )
+			loss = atof( optarg ) / 100;
+		else if( opt == 'n' && atoi(optarg) > 0 )
+			hosts = atoi( optarg );
+		else if( opt == 'x' )
+			seed = strtoull( optarg, NULL, 10 );
+		else
+			badUsage = true;
+	}
+
+	struct in_addr net;
+	string cidr = optind == argc - 2 ? argv[optind + 1] : "";
+	size_t slash = cidr.find( '/' );
+	unsigned prefix = slash == string::npos ? 0 : atoi( cidr.c_str() + slash + 1 );
+
+	if( badUsage || slash == string::npos || prefix < 1 || prefix > 30 ||
+			!inet_aton( cidr.substr( 0, slash ).c_str(), &net ) ||
+			hosts > (1U << (32 - prefix)) - 3 ){
+		cerr << "Uso:\n\t" << *argv << " [-n hosts] [-l loss] [-d ms] [-J ms] [-x seed] interface network/prefix\n\n"
+			"\t-d\tDelay of every reply in milliseconds (default: 0)\n"
+			"\t-J\tExtra random delay of up to this many milliseconds (default: 0)\n"
+			"\t-l\tPercentage of requests left without answer (default: 0)\n"
+			"\t-n\tNumber of virtual hosts, it must fit in the network (default: 60000)\n"
+			"\t-x\tSeed of the random losses and delays (default: 1)" << endl;
+		return 1;
+	}
+
+	uint32_t first = (ntohl( net.s_addr ) & ~((1U << (32 - prefix)) - 1)) + 2;
+	uint32_t last = first + hosts; // Not included.
+	int sockfd;
+
+	try{
+		sockfd = openSocket( argv[optind] );
+	}
+	catch( runtime_error &e ){
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	priority_queue<Pending> pending;
+	Counters counters;
+	struct mmsghdr msgs[RESPONDER_BATCH];
+	struct iovec iov[RESPONDER_BATCH];
+	ARPFrame frames[RESPONDER_BATCH];
+
+	memset( &counters, 0, sizeof(counters) );
+	signal( SIGINT, sigKill );
+	signal( SIGTERM, sigKill );
+	cerr << "Answering for " << hosts << " hosts" << endl;
+
+	while( active ){
+		uint64_t now = monotonicNs();
+		uint64_t wait = pending.empty() ? 100000000ULL :
+			pending.top().due > now ? pending.top().due - now : 0;
+		struct pollfd pfd = { sockfd, POLLIN, 0 };
+		struct timespec ts = { (time_t) (wait / 1000000000ULL), (long) (wait % 1000000000ULL) };
+
+		if( ppoll( &pfd, 1, &ts, NULL ) > 0 ){
+			memset( msgs, 0, sizeof(msgs) );
+			for( int i = 0 ; i < RESPONDER_BATCH ; i++ ){
+				iov[i].iov_base = &frames[i];
+				iov[i].iov_len = sizeof(ARPFrame);
+				msgs[i].msg_hdr.msg_iov = &iov[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+
+			int n = recvmmsg( sockfd, msgs, RESPONDER_BATCH, MSG_DONTWAIT, NULL );
+			now = monotonicNs();
+			for( int i = 0 ; i < n ; i++ ){
+				const ARPFrame &req = frames[i];
+				uint32_t target = ntohl( req.ip_dst );
+				Pending reply;
+
+				if( msgs[i].msg_len < sizeof(ARPFrame) || ntohs( req.opcode ) != ARPOP_REQUEST )
+					continue;
+				counters.requests++;
+				if( target < first || target >= last )
+					continue;
+				counters.ours++;
+				if( loss > 0 && uniform( seed ) < loss ){
+					counters.lost++;
+					continue;
+				}
+
+				uint8_t hw[MAC_ADDR_LEN] = { 0x02, 0xaa };
+				memcpy( hw + 2, &req.ip_dst, IP_ADDR_LEN );
+
+				reply.frame = req;
+				memcpy( reply.frame.eth_dst, req.eth_src, MAC_ADDR_LEN );
+				memcpy( reply.frame.eth_src, hw, MAC_ADDR_LEN );
+				reply.frame.opcode = htons( ARPOP_REPLY );
+				memcpy( reply.frame.hw_src, hw, MAC_ADDR_LEN );
+				reply.frame.ip_src = req.ip_dst;
+				memcpy( reply.frame.hw_dst, req.hw_src, MAC_ADDR_LEN );
+				reply.frame.ip_dst = req.ip_src;
+				reply.due = now + (uint64_t) ((delay + jitter * uniform( seed )) * 1000000);
+				pending.push( reply );
+			}
+		}
+		sendDue( sockfd, pending, monotonicNs(), counters );
+	}
+
+	cerr << counters.requests << " requests, " << counters.ours << " for the virtual hosts, "
+		<< counters.lost << " lost on purpose, " << counters.sent << " replies sent, "
+		<< counters.failed << " failed" << endl;
+	close( sockfd );
+	return 0;
+}
@@ -0,0 +1,427 @@
+/**
+ * @file: arp_storm.cpp
+ *
+ * Floods an interface with ARP frames, to load the guard of the tool
+ * with the traffic of a busy or attacked network. The frames are written
+ * straight into a TX ring shared with the kernel (PACKET_TX_RING), which
+ * sends a whole batch per system call, so a single core can keep a veth
+ * pair or a dummy interface busy.
+ *
+ * The traffic is a mix, by weight, of:
+ *
+ *	- legit: hosts answering for themselves to other hosts.
+ *	- spoof: the first host answering for the others, like a device of
+ *	  the network in the middle of their traffic.
+ *	- garp: gratuitous announcements of the hosts, as requests and as
+ *	  replies.
+ *	- flood: replies of random HW Addresses claiming random IP Addresses
+ *	  of the network.
+ *
+ * The hosts are the ones of arp_responder: host 10.200.1.2 has the HW
+ * Address 02:aa:0a:c8:01:02, so a table scanned from the responder knows
+ * them: spoof frames are poisonings and flood frames new devices.
+ *
+ *	g++ -std=c++11 -O2 -pthread -o arp_storm tools/arp_storm.cpp
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include <atomic>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <linux/if_arp.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../anti_arpspoof.h"
+
+/// Size in bytes of each slot of the TX ring, header included.
+#define STORM_FRAME_SIZE	128
+
+/// Size in bytes of each block of the TX ring.
+#define STORM_BLOCK_SIZE	(1 << 16)
+
+/// Number of blocks of the TX ring.
+#define STORM_BLOCKS		64
+
+/// Most frames written to the ring before it's flushed.
+#define STORM_BATCH			256
+
+using namespace std;
+
+atomic<bool> active( true ); ///< Controls the main loop.
+
+/** The kinds of frames of the mix. */
+enum Kind{ KIND_LEGIT, KIND_SPOOF, KIND_GARP, KIND_FLOOD, KINDS };
+
+const char *kindNames[KINDS] = { "legit", "spoof", "garp", "flood" };
+
+/** The network whose traffic is made up. */
+struct Network{
+	uint32_t first;		///< IP Address of the first host, host byte order.
+	unsigned hosts;
+	uint64_t seed;
+
+	/** @return A pseudo-random number. */
+	uint32_t random(){
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		return seed >> 32;
+	}
+
+	/** @return The IP Address of a random host, network byte order. */
+	uint32_t randomHost(){ return htonl( first + random() % hosts ); }
+};
+
+/**
+ * Fills an ARP frame.
+ *
+ * @param f Where it's written.
+ * @param ethDst The Ethernet destination, also the target HW Address of a
+ * reply.
+ */
+void fill( ARPFrame &f, uint16_t opcode, const uint8_t *ethDst, const uint8_t *src,
+		uint32_t ipSrc, uint32_t ipDst )
+{
+	memcpy( f.eth_dst, ethDst, MAC_ADDR_LEN );
+	memcpy( f.eth_src, src, MAC_ADDR_LEN );
+	f.eth_ethertype = htons( ETH_P_ARP );
+	f.hw_type = htons( ARPHRD_ETHER );
+	f.protocol = htons( ETH_P_IP );
+	f.hw_len = MAC_ADDR_LEN;
+	f.proto_len = IP_ADDR_LEN;
+	f.opcode = htons( opcode );
+	memcpy( f.hw_src, src, MAC_ADDR_LEN );
+	f.ip_src = ipSrc;
+	if( opcode == ARPOP_REQUEST )
+		memset( f.hw_dst, 0, MAC_ADDR_LEN );
+	else
+		memcpy( f.hw_dst, ethDst, MAC_ADDR_LEN );
+	f.ip_dst = ipDst;
+}
+
+/**
+ * Makes up a frame of the given kind.
+ *
+ * @param f Where it's written.
+ * @param kind What kind of frame.
+ * @param net The network.
+ */
+void makeFrame( ARPFrame &f, Kind kind, Network &net )
+{
+	static const uint8_t broadcast[MAC_ADDR_LEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+	uint32_t a = net.randomHost(), b = net.randomHost();
+	uint32_t attacker = htonl( net.first );
+	uint8_t hwA[MAC_ADDR_LEN] = { 0x02, 0xaa }, hwB[MAC_ADDR_LEN] = { 0x02, 0xaa };
+	uint8_t hwAttacker[MAC_ADDR_LEN] = { 0x02, 0xaa };
+
+	memcpy( hwA + 2, &a, IP_ADDR_LEN );
+	memcpy( hwB + 2, &b, IP_ADDR_LEN );
+	memcpy( hwAttacker + 2, &attacker, IP_ADDR_LEN );
+	if( kind == KIND_LEGIT )
+		fill( f, ARPOP_REPLY, hwB, hwA, a, b );
+	else if( kind == KIND_SPOOF )
+		fill( f, ARPOP_REPLY, hwB, hwAttacker, a == attacker ? htonl( net.first + 1 ) : a, b );
+	else if( kind == KIND_GARP )
+		fill( f, b & htonl( 1 ) ? ARPOP_REPLY : ARPOP_REQUEST, broadcast, hwA, a, a );
+	else{
+		uint32_t r = net.random();
+		uint8_t hw[MAC_ADDR_LEN] = { 0x02, 0xf1, (uint8_t) (r >> 24), (uint8_t) (r >> 16),
+			(uint8_t) (r >> 8), (uint8_t) r };
+		uint32_t ip = htonl( net.first + net.random() % net.hosts );
+
+		fill( f, ARPOP_REPLY, hwB, hw, ip, b );
+	}
+}
+
+/**
+ * A packet socket with a TX ring, bound to an interface.
+ */
+class TxRing{
+public:
+	/**
+	 * @param ifname The interface.
+	 * @param bypass Skip the queueing discipline of the interface.
+	 *
+	 * @throw runtime_error If the socket or the ring couldn't be set up.
+	 */
+	TxRing( const char *ifname, bool bypass ) throw( runtime_error ) : slot( 0 ) {
+		struct tpacket_req req;
+		int version = TPACKET_V2, one = 1;
+
+		// Protocol 0: the socket only sends, it doesn't get a copy of every frame.
+		sockfd = socket( AF_PACKET, SOCK_RAW, 0 );
+		if( sockfd < 0 )
+			throw runtime_error( "socket: " + string(strerror(errno)) );
+		memset( &dest, 0, sizeof(dest) );
+		dest.sll_family = AF_PACKET;
+		dest.sll_protocol = htons( ETH_P_ARP );
+		dest.sll_ifindex = if_nametoindex( ifname );
+		if( !dest.sll_ifindex ){
+			close( sockfd );
+			throw runtime_error( string(ifname) + ": " + string(strerror(errno)) );
+		}
+
+		memset( &req, 0, sizeof(req) );
+		req.tp_block_size = STORM_BLOCK_SIZE;
+		req.tp_block_nr = STORM_BLOCKS;
+		req.tp_frame_size = STORM_FRAME_SIZE;
+		req.tp_frame_nr = STORM_BLOCK_SIZE / STORM_FRAME_SIZE * STORM_BLOCKS;
+		slots = req.tp_frame_nr;
+		if( setsockopt( sockfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version) ) < 0 ||
+				setsockopt( sockfd, SOL_PACKET, PACKET_LOSS, &one, sizeof(one) ) < 0 ||
+				(bypass && setsockopt( sockfd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one) ) < 0) ||
+				setsockopt( sockfd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req) ) < 0 ){
+			int err = errno;
+
+			close( sockfd );
+			throw runtime_error( "PACKET_TX_RING: " + string(strerror(err)) );
+		}
+		ring = static_cast<uint8_t*>( mmap( NULL, STORM_BLOCK_SIZE * STORM_BLOCKS,
+				PROT_READ | PROT_WRITE, MAP_SHARED, sockfd, 0 ) );
+		if( ring == MAP_FAILED ){
+			int err = errno;
+
+			close( sockfd );
+			throw runtime_error( "PACKET_TX_RING mmap: " + string(strerror(err)) );
+		}
+	}
+
+	~TxRing(){
+		munmap( ring, STORM_BLOCK_SIZE * STORM_BLOCKS );
+		close( sockfd );
+	}
+
+	/**
+	 * @return The next free slot to write a frame in, NULL if the kernel
+	 * hasn't sent it yet.
+	 */
+	ARPFrame* next(){
+		struct tpacket2_hdr *h = header( slot );
+
+		if( __atomic_load_n( &h->tp_status, __ATOMIC_ACQUIRE ) &
+				(TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING) )
+			return NULL;
+		return reinterpret_cast<ARPFrame*>( reinterpret_cast<uint8_t*>( h ) + TPACKET2_HDRLEN -
+				sizeof(struct sockaddr_ll) );
+	}
+
+	/** Hands the frame written in the slot of next() to the kernel. */
+	void commit(){
+		struct tpacket2_hdr *h = header( slot );
+
+		h->tp_len = sizeof(ARPFrame);
+		__atomic_store_n( &h->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE );
+		slot = (slot + 1) % slots;
+	}
+
+	/**
+	 * Asks the kernel to send the frames handed to it.
+	 *
+	 * @param wait Also wait until they are sent.
+	 */
+	void flush( bool wait ){
+		if( sendto( sockfd, NULL, 0, wait ? 0 : MSG_DONTWAIT,
+					(struct sockaddr*) &dest, sizeof(dest) ) < 0 &&
+				errno != EAGAIN && errno != ENOBUFS && errno != EINTR )
+			throw runtime_error( "send: " + string(strerror(errno)) );
+	}
+
+	/** Waits up to a millisecond for a slot to be sent. */
+	void waitRoom(){
+		struct pollfd pfd = { sockfd, POLLOUT, 0 };
+
+		poll( &pfd, 1, 1 );
+	}
+
+private:
+	int sockfd;
+	struct sockaddr_ll dest;
+	uint8_t *ring;
+	unsigned slots;
+	unsigned slot;		///< The next one to write.
+
+	struct tpacket2_hdr* header( unsigned i ){
+		return reinterpret_cast<struct tpacket2_hdr*>( ring + i * STORM_FRAME_SIZE );
+	}
+};
+
+/**
+ * @return A counter of the interface from sysfs, 0 if it can't be read.
+ */
+uint64_t interfaceCounter( const string &ifname, const char *name )
+{
+	ifstream f( "/sys/class/net/" + ifname + "/statistics/" + name );
+	uint64_t v = 0;
+
+	f >> v;
+	return v;
+}
+
+void sigKill( int ){
+	active = false;
+}
+
+int main( int argc, char **argv )
+{
+	unsigned weights[KINDS] = { 70, 10, 10, 10 };
+	unsigned hosts = 60000;
+	uint64_t rate = 0, count = 0;
+	double seconds = 0;
+	uint64_t seed = 1;
+	bool bypass = true;
+	bool badUsage = false;
+	int opt;
+
+	while( (opt = getopt( argc, argv, "c:d:m:n:qr:x:" )) != -1 ){
+		if( opt == 'c' && atoll(optarg) > 0 )
+			count = atoll( optarg );
+		else if( opt == 'd' && atof(optarg) > 0 )
+			seconds = atof( optarg );
+		else if( opt == 'm' )
+			badUsage |= sscanf( optarg, "%u:%u:%u:%u", &weights[KIND_LEGIT], &weights[KIND_SPOOF],
+					&weights[KIND_GARP], &weights[KIND_FLOOD] ) != KINDS ||
+				weights[0] + weights[1] + weights[2] + weights[3] == 0;
+		else if( opt == 'n' && atoi(optarg) > 0 )
+			hosts = atoi( optarg );
+		else if( opt == 'q' )
+			bypass = false;
+		else if( opt == 'r' && atoll(optarg) >= 0 )
+			rate = atoll( optarg );
+		else if( opt == 'x' )
+			seed = strtoull( optarg, NULL, 10 );
+		else
+			badUsage = true;
+	}
+
+	struct in_addr net;
+	string cidr = optind == argc - 2 ? argv[optind + 1] : "";
+	size_t slash = cidr.find( '/' );
+	unsigned prefix = slash == string::npos ? 0 : atoi( cidr.c_str() + slash + 1 );
+
+	if( badUsage || slash == string::npos || prefix < 1 || prefix > 30 ||
+			!inet_aton( cidr.substr( 0, slash ).c_str(), &net ) ||
+			hosts > (1U << (32 - prefix)) - 3 ){
+		cerr << "Uso:\n\t" << *argv << " [-m legit:spoof:garp:flood] [-n hosts] [-r pps] [-c frames] [-d secs]\n"
+			"\t\t[-q] [-x seed] interface network/prefix\n\n"
+			"\t-m\tWeights of each kind of frame in the mix (default: 70:10:10:10)\n"
+			"\t-n\tHosts of the network, as in arp_responder (default: 60000)\n"
+			"\t-r\tFrames per second, 0 for as many as possible (default: 0)\n"
+			"\t-c\tStop after this many frames (default: never)\n"
+			"\t-d\tStop after this many seconds (default: never)\n"
+			"\t-q\tGo through the queueing discipline of the interface\n"
+			"\t-x\tSeed of the random frames (default: 1)" << endl;
+		return 1;
+	}
+
+	// The kind of each frame is looked up, not computed.
+	Kind mix[256];
+	unsigned total = weights[0] + weights[1] + weights[2] + weights[3];
+	for( unsigned i = 0, k = 0, upTo = weights[0] ; i < 256 ; i++ ){
+		while( i * total >= upTo * 256 )
+			upTo += weights[++k];
+		mix[i] = (Kind) k;
+	}
+
+	Network network = { (ntohl( net.s_addr ) & ~((1U << (32 - prefix)) - 1)) + 2, hosts, seed };
+	string ifname = argv[optind];
+	TxRing *ring;
+
+	try{
+		ring = new TxRing( ifname.c_str(), bypass );
+	}
+	catch( runtime_error &e ){
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	signal( SIGINT, sigKill );
+	signal( SIGTERM, sigKill );
+
+	uint64_t sent[KINDS] = { 0, 0, 0, 0 };
+	uint64_t queued = 0, full = 0;
+	uint64_t txBefore = interfaceCounter( ifname, "tx_packets" );
+	uint64_t dropBefore = interfaceCounter( ifname, "tx_dropped" );
+	uint64_t start = monotonicNs(), now = start, lastReport = start, lastQueued = 0;
+	uint64_t end = seconds > 0 ? start + (uint64_t) (seconds * 1e9) : 0;
+
+	cerr << "Sending to " << ifname << " through a ring of "
+		<< STORM_BLOCK_SIZE / STORM_FRAME_SIZE * STORM_BLOCKS << " frames" << endl;
+	try{
+		while( active && (!count || queued < count) && (!end || now < end) ){
+			uint64_t batch = STORM_BATCH;
+			int n = 0;
+
+			if( rate ){
+				uint64_t due = (now - start) * rate / 1000000000ULL + 1;
+
+				batch = due > queued ? min( batch, due - queued ) : 0;
+			}
+			if( count )
+				batch = min( batch, count - queued );
+			for( ARPFrame *f ; n < (int) batch && (f = ring->next()) ; n++ ){
+				Kind kind = mix[network.random() & 0xff];
+
+				makeFrame( *f, kind, network );
+				ring->commit();
+				sent[kind]++;
+			}
+			queued += n;
+			if( n )
+				ring->flush( false );
+			if( n < (int) batch ){ // The ring is full.
+				full++;
+				ring->waitRoom();
+			}
+			else if( !batch ) // Ahead of the rate.
+				usleep( 100 );
+
+			now = monotonicNs();
+			if( now - lastReport >= 1000000000ULL ){
+				cout << fixed << setprecision( 1 ) << (now - start) / 1e9 << " s: "
+					<< setprecision( 0 ) << (queued - lastQueued) * 1e9 / (now - lastReport)
+					<< " frames/s" << endl;
+				lastReport = now;
+				lastQueued = queued;
+			}
+		}
+		ring->flush( true );
+	}
+	catch( runtime_error &e ){
+		cerr << e.what() << endl;
+	}
+	now = monotonicNs();
+	delete ring;
+
+	uint64_t tx = interfaceCounter( ifname, "tx_packets" ) - txBefore;
+	uint64_t dropped = interfaceCounter( ifname, "tx_dropped" ) - dropBefore;
+
+	cout << queued << " frames in " << setprecision( 3 ) << (now - start) / 1e9 << " s ("
+		<< setprecision( 0 ) << queued * 1e9 / (now - start) << " frames/s):";
+	for( int k = 0 ; k < KINDS ; k++ )
+		cout << ' ' << sent[k] << ' ' << kindNames[k];
+	cout << "\nInterface: " << tx << " sent, " << dropped << " dropped; ring full "
+		<< full << " times" << endl;
+	return 0;
+}
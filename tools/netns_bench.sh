@@ -0,0 +1,100 @@
+#!/bin/bash
+#
+# Measures the first scan of anti_arpspoof against an emulated network.
+# Two private network namespaces are joined by a veth pair: the tool
+# scans from one end, arp_responder answers for the virtual hosts at the
+# other one. Nothing outside the namespaces is touched, they're deleted
+# at exit. Needs root.
+#
+# It prints the scan line of the tool (hosts that answered, requests sent
+# and wall time), the completeness of the table and the counters of the
+# responder.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+hosts=60000
+loss=0
+delay=0
+jitter=0
+rate=20000
+prefix=16
+net=10.200.0.0
+
+usage(){
+	echo -e "Uso:\n\t$0 [-n hosts] [-l loss] [-d ms] [-J ms] [-s pps] [-p prefix]\n"
+	echo -e "\t-n\tVirtual hosts that answer (default: $hosts)"
+	echo -e "\t-l\tPercentage of requests left without answer (default: $loss)"
+	echo -e "\t-d\tDelay of every reply in milliseconds (default: $delay)"
+	echo -e "\t-J\tExtra random delay of up to this many milliseconds (default: $jitter)"
+	echo -e "\t-s\tRequests per second of the scan (default: $rate)"
+	echo -e "\t-p\tPrefix length of the network $net (default: $prefix)"
+	exit 1
+}
+
+while getopts "n:l:d:J:s:p:" opt; do
+	case $opt in
+		n) hosts=$OPTARG ;;
+		l) loss=$OPTARG ;;
+		d) delay=$OPTARG ;;
+		J) jitter=$OPTARG ;;
+		s) rate=$OPTARG ;;
+		p) prefix=$OPTARG ;;
+		*) usage ;;
+	esac
+done
+[ $OPTIND -gt $# ] || usage
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+scanner=aa_scan$$
+responder=aa_resp$$
+
+cleanup(){
+	ip netns del $scanner 2>/dev/null
+	ip netns del $responder 2>/dev/null
+	rm -rf "$work"
+}
+trap cleanup EXIT
+
+echo "Building in $work"
+g++ -std=c++11 -O2 -Wno-deprecated -pthread -o "$work/anti_arpspoof" "$src/anti_arpspoof.cpp" || exit 1
+g++ -std=c++11 -O2 -Wno-deprecated -pthread -o "$work/arp_responder" "$src/tools/arp_responder.cpp" || exit 1
+
+ip netns add $scanner || exit 1
+ip netns add $responder || exit 1
+ip link add aas$$ type veth peer name aar$$ || exit 1
+ip link set aas$$ netns $scanner name eth0
+ip link set aar$$ netns $responder name eth0
+ip -n $scanner addr add ${net%.0}.1/$prefix dev eth0
+for ns in $scanner $responder; do
+	ip -n $ns link set lo up
+	ip -n $ns link set eth0 up
+done
+
+ip netns exec $responder "$work/arp_responder" -n $hosts -l $loss -d $delay -J $jitter \
+	eth0 $net/$prefix 2> "$work/responder.txt" &
+resp=$!
+sleep 0.5
+
+echo "Scanning $hosts hosts of $net/$prefix at $rate requests/s" \
+	"(loss $loss%, delay $delay ms + up to $jitter ms)"
+ip netns exec $scanner "$work/anti_arpspoof" -s $rate eth0 < /dev/null > "$work/scanner.txt" 2>&1 &
+scan=$!
+# The scan is over when the tool starts guarding.
+while kill -0 $scan 2>/dev/null && ! grep -q "Analyzing ARP replies" "$work/scanner.txt"; do
+	sleep 0.2
+done
+kill -INT $scan 2>/dev/null
+wait $scan
+kill -INT $resp
+wait $resp
+
+tr '\r' '\n' < "$work/scanner.txt" | grep -E "^Scan:|Error|error|:.*(denied|No such)"
+found=$(grep -o "^[0-9]* entries found" "$work/scanner.txt" | cut -d' ' -f1)
+echo "Completeness: ${found:-0} of $hosts hosts in the table" \
+	"($(awk "BEGIN{ printf \"%.2f\", 100 * ${found:-0} / $hosts }")%)"
+echo -n "Responder: "
+tail -1 "$work/responder.txt"
@@ -0,0 +1,272 @@
+/**
+ * @file: scan_sim.cpp
+ *
+ * Runs the scan of the tool over a simulated network, see SimNetwork.
+ * The sweep is the same one that scans the real network, only the
+ * packet I/O and the clock are replaced, so the effect of the request
+ * rate, the passes and the reply window on a given network can be
+ * measured over millions of requests in seconds. Each seed always gives
+ * the same result.
+ *
+ * After the scan, the guard can watch the network for a while of virtual
+ * time: the frames of the attacker go through the checks of the guard,
+ * checkFrame(), against the table found, and every IP Address it claims
+ * as a new device or as someone else's is counted as detected. The
+ * probes of the verifications aren't sent.
+ *
+ *	g++ -std=c++11 -O2 -pthread -o scan_sim tools/scan_sim.cpp
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <set>
+#include <string>
+#include <stdexcept>
+#include <atomic>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <getopt.h>
+
+#include "../anti_arpspoof.h"
+#include "../arp_table.h"
+#include "../correlation.h"
+#include "../sweeper.h"
+#include "../engine.h"
+#include "../sim_network.h"
+
+/// Requests per second of the scan, by default, as the tool.
+#define SIM_SCAN_RATE	1000
+
+using namespace std;
+
+/** What a run found. */
+struct Outcome{
+	size_t found;			///< Hosts in the table.
+	size_t conflicts;		///< IP Addresses answered by more than one device.
+	size_t caught;			///< Spoofed IP Addresses among the conflicts.
+	uint64_t requests;		///< Requests sent.
+	uint64_t virtualNs;		///< Virtual duration of the scan.
+	uint64_t realNs;		///< Real duration of the scan.
+	size_t detected;		///< IP Addresses claimed by a device that isn't in the table, or isn't their owner.
+	uint64_t firstAlert;	///< Virtual time from the end of the scan to the first detection, 0 if none.
+};
+
+/**
+ * What the guard of the simulation does about the decisions of
+ * checkFrame(): the IP Addresses are counted as detected.
+ */
+struct SimHooks{
+	set<uint32_t> detected;	///< IP Addresses claimed by a new device or by another one.
+	uint64_t since;			///< Virtual time when the guard started.
+	uint64_t firstAlert;	///< Virtual time from the start to the first detection, 0 if none.
+
+	void stage( Stage ){}
+	void inspected( const ARPRecord&, Finding ){}
+	void newDevice( const ARPRecord &rec, bool ){ detect( rec ); }
+	void conflict( const ARPRecord &rec, bool ){ detect( rec ); }
+	void probe( const ARPRecord&, uint64_t ){}
+	void alert( const HWAddr&, struct in_addr, bool, uint64_t, const Probe* ){}
+
+	void detect( const ARPRecord &rec ){
+		if( detected.empty() )
+			firstAlert = rec.timestamp - since;
+		detected.insert( rec.ip_src );
+	}
+};
+
+/**
+ * Scans a simulated network like scan() does, then guards it.
+ *
+ * @param ld The local info of the simulated interface.
+ * @param config The settings of the network.
+ * @param pps The requests per second of the scan.
+ * @param tries The passes of the scan.
+ * @param window Milliseconds to wait for late replies after each pass.
+ * @param guardNs Virtual time to guard the network after the scan.
+ */
+Outcome simulate( const LocalData &ld, const SimConfig &config, unsigned pps, unsigned tries,
+		unsigned window, uint64_t guardNs ) throw( runtime_error )
+{
+	SimNetwork net( ld, config );
+	BasicSweeper<SimIO> sweeper( SimIO( net ), ld );
+	atomic<bool> running( true );
+	ARPTable table;
+	Outcome o;
+	uint64_t start = monotonicNs();
+
+	sweeper.setReplyWindow( window );
+	SweepResult result = sweeper.sweep( pps, tries, running, []( uint32_t ){} );
+
+	memset( &o, 0, sizeof(o) );
+	o.realNs = monotonicNs() - start;
+	o.virtualNs = net.now() - SIM_EPOCH;
+	o.requests = sweeper.sent();
+	for( auto &r : result ){
+		struct in_addr ip = { r.first };
+
+		if( r.second.size() > 1 ){
+			o.conflicts++;
+			o.caught += net.spoofedIPs().count( ntohl( r.first ) );
+		}
+		else
+			table.add( *r.second.begin(), ip );
+	}
+	o.found = table.size();
+
+	// The guard, over the frames that keep arriving, in virtual time.
+	SimSource source( net );
+	RequestTable requests;
+	ProbeTable probes;
+	CheckState state;
+	SimHooks hooks;
+	uint64_t guardStart = net.now();
+	const FrameRef *frames;
+	ARPRecord rec;
+	int n;
+
+	hooks.since = guardStart;
+	hooks.firstAlert = 0;
+	while( net.now() - guardStart < guardNs &&
+			(n = source.receive( frames, guardStart + guardNs - net.now() )) >= 0 ){
+		for( int i = 0 ; i < n ; i++ )
+			if( parseEthernet( frames[i].data, frames[i].len, frames[i].timestamp, rec ) )
+				checkFrame( rec, table, table, requests, probes, state, rec.timestamp, hooks );
+		expireProbes( probes, state, net.now(), hooks );
+	}
+	o.detected = hooks.detected.size();
+	o.firstAlert = hooks.firstAlert;
+	return o;
+}
+
+int main( int argc, char **argv )
+{
+	SimConfig config = { 60000, 1000000, 2000000, RTT_EXPONENTIAL, 0.01, 0, 0, 1 };
+	unsigned prefix = 16;
+	unsigned pps = SIM_SCAN_RATE;
+	unsigned tries = MAX_TRIES_FOR_RESOLV;
+	unsigned window = SWEEP_REPLY_WINDOW;
+	unsigned runs = 1;
+	double guardSecs = 0;
+	bool badUsage = false;
+	int opt;
+
+	while( (opt = getopt( argc, argv, "c:d:g:j:l:n:p:r:R:s:S:t:w:x:" )) != -1 ){
+		if( opt == 'c' && atof(optarg) >= 0 )
+			config.spoofEvery = atof( optarg ) * 1000000;
+		else if( opt == 'd' && string(optarg) == "fixed" )
+			config.shape = RTT_FIXED;
+		else if( opt == 'd' && string(optarg) == "uniform" )
+			config.shape = RTT_UNIFORM;
+		else if( opt == 'd' && string(optarg) == "exp" )
+			config.shape = RTT_EXPONENTIAL;
+		else if( opt == 'g' && atof(optarg) >= 0 )
+			guardSecs = atof( optarg );
+		else if( opt == 'j' && atof(optarg) >= 0 )
+			config.jitter = atof( optarg ) * 1000000;
+		else if( opt == 'l' && atof(optarg) >= 0 && atof(optarg) <= 100 )
+			config.loss = atof( optarg ) / 100;
+		else if( opt == 'n' && atoi(optarg) > 0 )
+			config.hosts = atoi( optarg );
+		else if( opt == 'p' && atoi(optarg) >= 8 && atoi(optarg) <= 30 )
+			prefix = atoi( optarg );
+		else if( opt == 'r' && atof(optarg) >= 0 )
+			config.rtt = atof( optarg ) * 1000000;
+		else if( opt == 'R' && atoi(optarg) > 0 )
+			runs = atoi( optarg );
+		else if( opt == 's' && atoi(optarg) > 0 )
+			pps = atoi( optarg );
+		else if( opt == 'S' && atoi(optarg) >= 0 )
+			config.spoofers = atoi( optarg );
+		else if( opt == 't' && atoi(optarg) > 0 )
+			tries = atoi( optarg );
+		else if( opt == 'w' && atoi(optarg) >= 0 )
+			window = atoi( optarg );
+		else if( opt == 'x' )
+			config.seed = strtoull( optarg, NULL, 10 );
+		else
+			badUsage = true;
+	}
+	if( badUsage || optind != argc ){
+		cerr << "Uso:\n\t" << *argv << " [-n hosts] [-p prefix] [-r ms] [-j ms] [-d fixed|uniform|exp]\n"
+			"\t\t[-l loss] [-S spoofers] [-c ms] [-s pps] [-t tries] [-w ms] [-g secs]\n"
+			"\t\t[-x seed] [-R runs]\n\n"
+			"Network:\n"
+			"\t-n\tHosts that answer (default: " << config.hosts << ")\n"
+			"\t-p\tPrefix length of the network 10.0.0.0 (default: " << prefix << ")\n"
+			"\t-r\tShortest round trip time in milliseconds (default: " << config.rtt / 1e6 << ")\n"
+			"\t-j\tExtra round trip time in milliseconds, its maximum or its mean (default: "
+				<< config.jitter / 1e6 << ")\n"
+			"\t-d\tHow the extra time is spread (default: exp)\n"
+			"\t-l\tPercentage of requests and replies lost (default: " << config.loss * 100 << ")\n"
+			"\t-S\tHosts also answered by an attacker (default: 0)\n"
+			"\t-c\tThe attacker claims each of them every ms milliseconds (default: never)\n"
+			"Scan:\n"
+			"\t-s\tRequests per second (default: " << SIM_SCAN_RATE << ")\n"
+			"\t-t\tPasses (default: " << MAX_TRIES_FOR_RESOLV << ")\n"
+			"\t-w\tMilliseconds to wait for late replies after each pass (default: "
+				<< SWEEP_REPLY_WINDOW << ")\n"
+			"\t-g\tVirtual seconds to guard the network after the scan (default: 0)\n"
+			"Runs:\n"
+			"\t-x\tSeed of the first run (default: 1)\n"
+			"\t-R\tRuns, with consecutive seeds (default: 1)" << endl;
+		return 1;
+	}
+
+	LocalData ld;
+	uint32_t mask = ~((1U << (32 - prefix)) - 1);
+
+	memset( &ld, 0, sizeof(ld) );
+	ld.ipAddr = htonl( 0x0a000001 );
+	ld.firstHost = htonl( (0x0a000000 & mask) + 1 );
+	ld.lastHost = htonl( 0x0a000000 | ~mask );
+	ld.hwAddr[0] = 0x02;
+	ld.hwAddr[MAC_ADDR_LEN - 1] = 0x01;
+
+	cout << "seed      found  complete  conflicts  caught   requests  virtual s  real ms";
+	if( guardSecs > 0 )
+		cout << "  detected  first ms";
+	cout << endl;
+
+	uint64_t seed = config.seed;
+	double sumComplete = 0, sumVirtual = 0, sumRequests = 0;
+	for( unsigned r = 0 ; r < runs ; r++ ){
+		Outcome o;
+
+		config.seed = seed + r;
+		try{
+			o = simulate( ld, config, pps, tries, window, guardSecs * 1e9 );
+		}
+		catch( runtime_error &e ){
+			cerr << e.what() << endl;
+			return 1;
+		}
+
+		double complete = 100.0 * o.found / config.hosts;
+		cout << left << setw( 6 ) << config.seed << right << fixed << setprecision( 0 )
+			<< setw( 9 ) << o.found << setprecision( 2 ) << setw( 9 ) << complete << '%'
+			<< setw( 11 ) << o.conflicts << setw( 8 ) << o.caught
+			<< setw( 11 ) << o.requests << setprecision( 3 ) << setw( 11 ) << o.virtualNs / 1e9
+			<< setprecision( 1 ) << setw( 9 ) << o.realNs / 1e6;
+		if( guardSecs > 0 )
+			cout << setw( 10 ) << o.detected << setw( 10 ) << o.firstAlert / 1e6;
+		cout << endl;
+		sumComplete += complete;
+		sumVirtual += o.virtualNs / 1e9;
+		sumRequests += o.requests;
+	}
+	if( runs > 1 )
+		cout << "\nMean of " << runs << " runs: " << setprecision( 2 ) << sumComplete / runs
+			<< "% complete, " << setprecision( 0 ) << sumRequests / runs << " requests, "
+			<< setprecision( 3 ) << sumVirtual / runs << " virtual s" << endl;
+	return 0;
+}
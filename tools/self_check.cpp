@@ -0,0 +1,309 @@
+/**
+ * @file: self_check.cpp
+ *
+ * Checks of the tables, of the checks of the guard and of the reader of
+ * capture files on crafted input: the cases that a sniffer only meets
+ * when someone builds them on purpose. Every check is printed; it exits with 1 if one of them
+ * failed, so it can run after every build.
+ *
+ *	g++ -std=c++11 -O2 -pthread -o self_check tools/self_check.cpp
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <linux/if_arp.h>
+#include <net/ethernet.h>
+
+#include "../anti_arpspoof.h"
+#include "../arp_table.h"
+#include "../correlation.h"
+#include "../frame_source.h"
+#include "../engine.h"
+#include "../probes.h"
+#include "../pcap_reader.h"
+
+// The allocations are always counted.
+#ifndef COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS
+#endif
+#include "../alloc_count.h"
+
+using namespace std;
+
+unsigned failures = 0; ///< Checks that failed.
+
+/** Prints the result of a check and counts it if it failed. */
+#define CHECK( cond ) check( (cond), #cond, __LINE__ )
+
+void check( bool ok, const char *what, int line )
+{
+	cout << (ok ? "  ok    " : "  FAIL  ") << what;
+	if( !ok ){
+		cout << " (line " << line << ')';
+		failures++;
+	}
+	cout << endl;
+}
+
+/** @return The HW Address 02:00:00:00:00:n, all zeros for 0. */
+HWAddr hwOf( unsigned n )
+{
+	uint8_t hw[MAC_ADDR_LEN] = { (uint8_t) (n ? 0x02 : 0), 0, 0, 0, 0, (uint8_t) n };
+	return HWAddr( hw );
+}
+
+/** @return The IP Address 10.0.0.n, 0.0.0.0 for 0. */
+struct in_addr ipOf( unsigned n )
+{
+	struct in_addr ip = { n ? htonl( 0x0a000000 | n ) : 0 };
+	return ip;
+}
+
+/** Builds an ARP reply as received from the network. */
+ARPFrame reply( const HWAddr &src, struct in_addr ipSrc, const HWAddr &dst, struct in_addr ipDst )
+{
+	ARPFrame f;
+
+	memcpy( f.eth_dst, dst.hw, MAC_ADDR_LEN );
+	memcpy( f.eth_src, src.hw, MAC_ADDR_LEN );
+	f.eth_ethertype = htons( ETH_P_ARP );
+	f.hw_type = htons( ARPHRD_ETHER );
+	f.protocol = htons( ETH_P_IP );
+	f.hw_len = MAC_ADDR_LEN;
+	f.proto_len = IP_ADDR_LEN;
+	f.opcode = htons( ARPOP_REPLY );
+	memcpy( f.hw_src, src.hw, MAC_ADDR_LEN );
+	f.ip_src = ipSrc.s_addr;
+	memcpy( f.hw_dst, dst.hw, MAC_ADDR_LEN );
+	f.ip_dst = ipDst.s_addr;
+	return f;
+}
+
+/** Parses a frame and runs inspect() on it. */
+Finding inspectFrame( const ARPFrame &f, const ARPTable &table, uint64_t &owner )
+{
+	RequestTable requests;
+	CorrelationStats stats;
+	ARPRecord rec;
+	bool solicited = false;
+
+	owner = 0;
+	if( !parseEthernet( (const uint8_t*) &f, sizeof(f), 1, rec ) )
+		return FINDING_NONE;
+	return inspect( rec, table, table, requests, stats, 0, solicited, owner );
+}
+
+
+// ===============================
+// Checks
+// ===============================
+
+/** The zero MAC and 0.0.0.0 are stored like any other key. */
+void checkZeroKeys()
+{
+	cout << "Zero MAC and 0.0.0.0 in the tables" << endl;
+
+	ARPTable table;
+	CHECK( table.add( hwOf( 0 ), ipOf( 1 ) ) );
+	CHECK( table.contains( hwOf( 0 ), ipOf( 1 ) ) );
+	CHECK( !table.add( hwOf( 0 ), ipOf( 1 ) ) );
+	CHECK( table.add( hwOf( 2 ), ipOf( 0 ) ) );
+	CHECK( table.ownersOf( ipOf( 0 ) ) != NULL );
+	CHECK( table.contains( hwOf( 2 ), ipOf( 0 ) ) );
+	CHECK( table.size() == 2 );
+
+	size_t seen = 0;
+	ARPTable copy = table;
+	copy.forEach( [&]( const HWAddr&, struct in_addr ){ seen++; } );
+	CHECK( seen == 2 );
+	CHECK( copy.remove( hwOf( 2 ), ipOf( 0 ) ) && !copy.contains( hwOf( 2 ), ipOf( 0 ) ) );
+	CHECK( copy.remove( hwOf( 0 ), ipOf( 1 ) ) && copy.empty() );
+
+	// A reserved set takes 0.0.0.0 once, without allocating.
+	IPSet ignored;
+	ignored.reserve( 16 );
+	uint64_t before = allocationCount();
+	CHECK( ignored.insert( 0 ) );
+	CHECK( !ignored.insert( 0 ) );
+	for( int i = 0 ; i < 1000 ; i++ )
+		ignored.insert( 0 );
+	CHECK( ignored.contains( 0 ) && ignored.size() == 1 );
+	CHECK( allocationCount() == before );
+}
+
+/** Frames with a zero MAC or 0.0.0.0 as sender. */
+void checkZeroFrames()
+{
+	cout << "Frames from a zero MAC or for 0.0.0.0" << endl;
+
+	ARPTable table;
+	uint64_t owner;
+	table.add( hwOf( 1 ), ipOf( 1 ) );
+	table.add( hwOf( 2 ), ipOf( 2 ) );
+
+	// A zero MAC is a new device, a known one claiming 0.0.0.0 a conflict.
+	CHECK( inspectFrame( reply( hwOf( 0 ), ipOf( 1 ), hwOf( 2 ), ipOf( 2 ) ), table, owner ) == FINDING_NEW_DEVICE );
+	CHECK( inspectFrame( reply( hwOf( 1 ), ipOf( 0 ), hwOf( 2 ), ipOf( 2 ) ), table, owner ) == FINDING_CONFLICT );
+	CHECK( owner == 0 );
+
+	// Once bound, the zero MAC and 0.0.0.0 are checked like the rest.
+	table.add( hwOf( 0 ), ipOf( 3 ) );
+	table.add( hwOf( 3 ), ipOf( 0 ) );
+	CHECK( inspectFrame( reply( hwOf( 0 ), ipOf( 3 ), hwOf( 2 ), ipOf( 2 ) ), table, owner ) == FINDING_NONE );
+	CHECK( inspectFrame( reply( hwOf( 3 ), ipOf( 0 ), hwOf( 2 ), ipOf( 2 ) ), table, owner ) == FINDING_NONE );
+	CHECK( inspectFrame( reply( hwOf( 1 ), ipOf( 0 ), hwOf( 2 ), ipOf( 2 ) ), table, owner ) == FINDING_CONFLICT );
+	CHECK( owner == packHWAddr( hwOf( 3 ).hw ) );
+
+	// The Detector learns them, and a later claim is a poisoning.
+	vector<ARPFrame> frames;
+	frames.push_back( reply( hwOf( 0 ), ipOf( 1 ), hwOf( 9 ), ipOf( 9 ) ) );
+	frames.push_back( reply( hwOf( 2 ), ipOf( 0 ), hwOf( 9 ), ipOf( 9 ) ) );
+	frames.push_back( reply( hwOf( 4 ), ipOf( 1 ), hwOf( 9 ), ipOf( 9 ) ) );
+	frames.push_back( reply( hwOf( 0 ), ipOf( 0 ), hwOf( 9 ), ipOf( 9 ) ) );
+
+	vector<FrameRef> refs;
+	for( auto &f : frames ){
+		FrameRef ref = { (const uint8_t*) &f, sizeof(f), 1 };
+		refs.push_back( ref );
+	}
+
+	Detector detector;
+	vector<Poisoning> found;
+	detector.process( refs.data(), refs.size(), [&]( const Poisoning &p ){ found.push_back( p ); } );
+	CHECK( detector.table().contains( hwOf( 0 ), ipOf( 1 ) ) );
+	CHECK( detector.table().contains( hwOf( 2 ), ipOf( 0 ) ) );
+	CHECK( detector.table().size() == 2 );
+	CHECK( found.size() == 2 );
+	CHECK( found.size() == 2 && found[0].ip == ipOf( 1 ).s_addr && found[0].owner == packHWAddr( hwOf( 0 ).hw ) );
+	CHECK( found.size() == 2 && found[1].ip == 0 && found[1].owner == packHWAddr( hwOf( 2 ).hw ) );
+}
+
+/** A verification is started once per IP Address, and its slots aren't lost. */
+void checkProbes()
+{
+	cout << "Verifications" << endl;
+
+	ProbeTable probes;
+	HWAddr claimant = hwOf( 1 );
+	unsigned verdicts = 0;
+
+	// A free slot before the pending verification of the same IP Address.
+	CHECK( probes.launch( ipOf( 1 ).s_addr, claimant.hw, 0, true, 0, 1 ) == LAUNCH_STARTED );
+	CHECK( probes.launch( ipOf( 2 ).s_addr, claimant.hw, 0, true, 1, 1 ) == LAUNCH_STARTED );
+	probes.expire( 0, 1, [&]( const Probe& ){ verdicts++; } );
+	CHECK( verdicts == 1 && !probes.pending( ipOf( 1 ).s_addr ) );
+	CHECK( probes.launch( ipOf( 2 ).s_addr, claimant.hw, 0, true, 0, 1 ) == LAUNCH_VERIFYING );
+
+	// All the other slots are still free.
+	unsigned started = 0;
+	for( int i = 0 ; i < MAX_PROBES - 1 ; i++ )
+		started += probes.launch( ipOf( 10 + i ).s_addr, claimant.hw, 0, true, 0, 1 ) == LAUNCH_STARTED;
+	CHECK( started == MAX_PROBES - 1 );
+	CHECK( probes.launch( ipOf( 9 ).s_addr, claimant.hw, 0, true, 0, 1 ) == LAUNCH_FULL );
+	probes.expire( 0, 1, []( const Probe& ){} );
+	probes.expire( 1, 1, []( const Probe& ){} );
+	CHECK( probes.nextDeadline( 0 ) == 0 && probes.nextDeadline( 1 ) == 0 );
+
+	// Workers that see the same claim at once start a single verification.
+	unsigned duplicated = 0;
+	for( int round = 0 ; round < 1000 ; round++ ){
+		atomic<bool> go( false );
+		atomic<unsigned> launched( 0 );
+		vector<thread> workers;
+
+		for( unsigned w = 0 ; w < 4 ; w++ )
+			workers.push_back( thread( [&, w](){
+				while( !go )
+					;
+				if( probes.launch( ipOf( 1 ).s_addr, claimant.hw, 0, true, w, 1 ) == LAUNCH_STARTED )
+					launched++;
+			} ) );
+		go = true;
+		for( auto &t : workers )
+			t.join();
+		duplicated += launched != 1;
+		for( unsigned w = 0 ; w < 4 ; w++ )
+			probes.expire( w, 1, []( const Probe& ){} );
+	}
+	CHECK( duplicated == 0 );
+}
+
+/** Timestamps of pcapng interfaces with units finer than a nanosecond. */
+void checkPcapngResolution()
+{
+	cout << "pcapng timestamps finer than a nanosecond" << endl;
+
+	vector<uint8_t> file;
+	auto put16 = [&]( uint16_t v ){ file.insert( file.end(), (uint8_t*) &v, (uint8_t*) &v + 2 ); };
+	auto put32 = [&]( uint32_t v ){ file.insert( file.end(), (uint8_t*) &v, (uint8_t*) &v + 4 ); };
+	ARPFrame f = reply( hwOf( 1 ), ipOf( 1 ), hwOf( 2 ), ipOf( 2 ) );
+
+	// Section Header Block
+	put32( 0x0a0d0d0a ); put32( 28 ); put32( 0x1a2b3c4d ); put16( 1 ); put16( 0 );
+	put32( 0xffffffff ); put32( 0xffffffff ); put32( 28 );
+	// Interfaces of picoseconds and 2^-40 seconds, if_tsresol.
+	for( uint8_t r : { (uint8_t) 12, (uint8_t) (0x80 | 40) } ){
+		put32( 1 ); put32( 32 ); put16( LINKTYPE_ETHERNET ); put16( 0 ); put32( 65535 );
+		put16( 9 ); put16( 1 ); put32( r ); put32( 0 ); put32( 32 );
+	}
+	// 10^7 s and 123456789 ns; 10^6 s and a half.
+	uint64_t stamps[2] = { 10000000ULL * 1000000000000ULL + 123456789000ULL,
+		(1000000ULL << 40) + (1ULL << 39) };
+	for( uint32_t id = 0 ; id < 2 ; id++ ){
+		uint32_t len = 32 + ((sizeof(f) + 3) & ~3);
+
+		put32( 6 ); put32( len ); put32( id ); put32( stamps[id] >> 32 ); put32( stamps[id] );
+		put32( sizeof(f) ); put32( sizeof(f) );
+		file.insert( file.end(), (uint8_t*) &f, (uint8_t*) (&f + 1) );
+		file.resize( file.size() + (len - 32 - sizeof(f)) );
+		put32( len );
+	}
+
+	char path[] = "/tmp/self_check_XXXXXX";
+	int fd = mkstemp( path );
+	bool saved = fd >= 0 && write( fd, file.data(), file.size() ) == (ssize_t) file.size();
+
+	if( fd >= 0 )
+		close( fd );
+	CHECK( saved );
+	if( saved ){
+		PcapReader reader( path );
+		const uint8_t *data;
+		uint32_t len;
+		uint64_t t[2] = { 0, 0 };
+
+		CHECK( reader.next( data, len, t[0] ) && reader.next( data, len, t[1] ) );
+		CHECK( t[0] == 10000000ULL * 1000000000ULL + 123456789 );
+		CHECK( t[1] == 1000000ULL * 1000000000ULL + 500000000 );
+	}
+	unlink( path );
+}
+
+int main()
+{
+	checkZeroKeys();
+	checkZeroFrames();
+	checkProbes();
+	checkPcapngResolution();
+
+	if( failures ){
+		cout << '\n' << failures << " checks failed" << endl;
+		return 1;
+	}
+	cout << "\nAll the checks passed" << endl;
+	return 0;
+}
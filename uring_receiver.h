@@ -0,0 +1,314 @@
+/**
+ * @file: uring_receiver.h
+ *
+ * io_uring receive backend for the ARP socket. A single multishot recv
+ * stays armed on the socket and the kernel picks an ARPFrame sized slot
+ * from a registered provided-buffer ring for every frame, so the guard
+ * only enters the kernel once per batch of completions.
+ *
+ * Requires Linux 6.0 or newer (IORING_RECV_MULTISHOT and
+ * IORING_REGISTER_PBUF_RING). liburing is not needed.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.*
+ */
+
+#ifndef URING_RECEIVER_H
+#define URING_RECEIVER_H
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "anti_arpspoof.h"
+
+/// Number of ARPFrame slots in the provided-buffer ring (power of two).
+#define URING_BUF_SLOTS		1024
+
+/// Completion queue entries, enough to hold a full buffer ring of frames.
+#define URING_CQ_ENTRIES	(2 * URING_BUF_SLOTS)
+
+/// Buffer group id used for the provided-buffer ring.
+#define URING_BUF_GROUP		0
+
+/// Default time in milliseconds that wait() blocks for a completion.
+#define URING_WAIT_MS		100
+
+
+/**
+ * Receives ARP frames from a packet socket through io_uring.
+ */
+class URingReceiver{
+public:
+	/**
+	 * Sets up the ring, registers the buffer ring and arms the
+	 * multishot recv on the socket.
+	 *
+	 * @param sfd The ARP socket, as returned by initSocket().
+	 *
+	 * @throw runtime_error If the kernel doesn't support some of the
+	 * required features.
+	 */
+	explicit URingReceiver( int sfd ) throw( std::runtime_error )
+		: sockfd( sfd ), ringfd( -1 ), sqPtr( MAP_FAILED ), cqPtr( MAP_FAILED ),
+		sqes( static_cast<struct io_uring_sqe*>(MAP_FAILED) ),
+		bufRing( static_cast<struct io_uring_buf_ring*>(MAP_FAILED) ),
+		slots( static_cast<ARPFrame*>(MAP_FAILED) ), bufTail( 0 )
+	{
+		try{
+			setupRing();
+			registerBuffers();
+			armRecv();
+		}
+		catch( ... ){
+			release();
+			throw;
+		}
+	}
+
+	~URingReceiver(){
+		release();
+	}
+
+	/**
+	 * Waits for frames and calls the handler for every completion
+	 * available, then gives the slots back to the kernel all at once.
+	 *
+	 * @param handler Callable as handler( const ARPFrame &frame, int len ).
+	 * The frame is only valid during the call.
+	 * @param timeout Maximum time to wait, in nanoseconds.
+	 * @return The number of frames handled.
+	 *
+	 * @throw runtime_error If the recv failed for a reason other than
+	 * running out of buffers.
+	 */
+	template<class Handler>
+	int wait( Handler handler, uint64_t timeout = URING_WAIT_MS * 1000000ULL )
+		throw( std::runtime_error )
+	{
+		struct __kernel_timespec ts = { (long long) (timeout / 1000000000ULL),
+			(long long) (timeout % 1000000000ULL) };
+		struct io_uring_getevents_arg arg;
+		unsigned head, tail;
+		int handled = 0;
+		bool rearm = false;
+
+		memset( &arg, 0, sizeof(arg) );
+		arg.sigmask_sz = _NSIG / 8;
+		arg.ts = reinterpret_cast<uint64_t>( &ts );
+
+		head = *cqHead;
+		tail = __atomic_load_n( cqTail, __ATOMIC_ACQUIRE );
+		if( head == tail ){
+			if( enter( 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+						&arg, sizeof(arg) ) < 0 && errno != ETIME && errno != EINTR )
+				throw std::runtime_error( "io_uring_enter: " + std::string(strerror(errno)) );
+			tail = __atomic_load_n( cqTail, __ATOMIC_ACQUIRE );
+		}
+
+		for( ; head != tail ; head++ ){
+			const struct io_uring_cqe &cqe = cqes[head & *cqMask];
+
+			if( cqe.res >= 0 && (cqe.flags & IORING_CQE_F_BUFFER) ){
+				uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+
+				handler( slots[bid], cqe.res );
+				recycle( bid );
+				handled++;
+			}
+			else if( cqe.res < 0 && cqe.res != -ENOBUFS ){
+				__atomic_store_n( cqHead, head + 1, __ATOMIC_RELEASE );
+				throw std::runtime_error( "io_uring recv: " + std::string(strerror(-cqe.res)) );
+			}
+			// The kernel drops the multishot request when it runs out of
+			// slots or hits an error, re-arm it once the batch is done.
+			if( !(cqe.flags & IORING_CQE_F_MORE) )
+				rearm = true;
+		}
+		__atomic_store_n( cqHead, head, __ATOMIC_RELEASE );
+		__atomic_store_n( &bufRing->tail, bufTail, __ATOMIC_RELEASE );
+
+		if( rearm )
+			armRecv();
+		return handled;
+	}
+
+	/**
+	 * Cancels the recv and frees the ring, so the socket can be read in
+	 * other ways. No frame can be received after it.
+	 */
+	void release()
+	{
+		if( ringfd >= 0 )
+			close( ringfd ); // Cancels the recv and unregisters the buffers.
+		if( sqes != MAP_FAILED )
+			munmap( sqes, sqesSize );
+		if( cqPtr != MAP_FAILED && cqPtr != sqPtr )
+			munmap( cqPtr, cqSize );
+		if( sqPtr != MAP_FAILED )
+			munmap( sqPtr, sqSize );
+		if( bufRing != MAP_FAILED )
+			munmap( bufRing, URING_BUF_SLOTS * sizeof(struct io_uring_buf) );
+		if( slots != MAP_FAILED )
+			munmap( slots, URING_BUF_SLOTS * sizeof(ARPFrame) );
+		ringfd = -1;
+		sqPtr = cqPtr = MAP_FAILED;
+		sqes = static_cast<struct io_uring_sqe*>( MAP_FAILED );
+		bufRing = static_cast<struct io_uring_buf_ring*>( MAP_FAILED );
+		slots = static_cast<ARPFrame*>( MAP_FAILED );
+	}
+
+private:
+	int sockfd;							///< The ARP socket.
+	int ringfd;							///< The io_uring descriptor.
+
+	void *sqPtr;						///< Mapping of the submission ring.
+	size_t sqSize;						///< Size of the submission ring mapping.
+	unsigned *sqTail;					///< Tail of the submission ring.
+	unsigned *sqMask;					///< Mask of the submission ring.
+	unsigned *sqArray;					///< Index array of the submission ring.
+	void *cqPtr;						///< Mapping of the completion ring.
+	size_t cqSize;						///< Size of the completion ring mapping.
+	unsigned *cqHead;					///< Head of the completion ring.
+	unsigned *cqTail;					///< Tail of the completion ring.
+	unsigned *cqMask;					///< Mask of the completion ring.
+	struct io_uring_cqe *cqes;			///< Completion entries.
+	struct io_uring_sqe *sqes;			///< Submission entries.
+	size_t sqesSize;					///< Size of the submission entries mapping.
+
+	struct io_uring_buf_ring *bufRing;	///< Provided-buffer ring shared with the kernel.
+	ARPFrame *slots;					///< Storage of the frame slots.
+	uint16_t bufTail;					///< Local tail of the buffer ring.
+
+	int enter( unsigned toSubmit, unsigned minComplete, unsigned flags,
+			const void *arg, size_t argSize )
+	{
+		return syscall( __NR_io_uring_enter, ringfd, toSubmit, minComplete,
+				flags, arg, argSize );
+	}
+
+	void setupRing() throw( std::runtime_error )
+	{
+		struct io_uring_params p;
+
+		memset( &p, 0, sizeof(p) );
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = URING_CQ_ENTRIES;
+		if( (ringfd = syscall( __NR_io_uring_setup, 4, &p )) < 0 )
+			throw std::runtime_error( "io_uring_setup: " + std::string(strerror(errno)) );
+		if( !(p.features & IORING_FEAT_EXT_ARG) )
+			throw std::runtime_error( "io_uring: kernel too old (no IORING_FEAT_EXT_ARG)" );
+
+		sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		if( p.features & IORING_FEAT_SINGLE_MMAP ){
+			if( cqSize > sqSize )
+				sqSize = cqSize;
+			cqSize = sqSize;
+		}
+
+		sqPtr = mmap( NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ringfd, IORING_OFF_SQ_RING );
+		if( sqPtr == MAP_FAILED )
+			throw std::runtime_error( "io_uring mmap: " + std::string(strerror(errno)) );
+		if( p.features & IORING_FEAT_SINGLE_MMAP )
+			cqPtr = sqPtr;
+		else{
+			cqPtr = mmap( NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					ringfd, IORING_OFF_CQ_RING );
+			if( cqPtr == MAP_FAILED )
+				throw std::runtime_error( "io_uring mmap: " + std::string(strerror(errno)) );
+		}
+		sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+		sqes = static_cast<struct io_uring_sqe*>( mmap( NULL, sqesSize,
+					PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES ) );
+		if( sqes == MAP_FAILED )
+			throw std::runtime_error( "io_uring mmap: " + std::string(strerror(errno)) );
+
+		char *sq = static_cast<char*>( sqPtr );
+		char *cq = static_cast<char*>( cqPtr );
+		sqTail = reinterpret_cast<unsigned*>( sq + p.sq_off.tail );
+		sqMask = reinterpret_cast<unsigned*>( sq + p.sq_off.ring_mask );
+		sqArray = reinterpret_cast<unsigned*>( sq + p.sq_off.array );
+		cqHead = reinterpret_cast<unsigned*>( cq + p.cq_off.head );
+		cqTail = reinterpret_cast<unsigned*>( cq + p.cq_off.tail );
+		cqMask = reinterpret_cast<unsigned*>( cq + p.cq_off.ring_mask );
+		cqes = reinterpret_cast<struct io_uring_cqe*>( cq + p.cq_off.cqes );
+	}
+
+	void registerBuffers() throw( std::runtime_error )
+	{
+		struct io_uring_buf_reg reg;
+
+		bufRing = static_cast<struct io_uring_buf_ring*>( mmap( NULL,
+					URING_BUF_SLOTS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ) );
+		slots = static_cast<ARPFrame*>( mmap( NULL, URING_BUF_SLOTS * sizeof(ARPFrame),
+					PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ) );
+		if( bufRing == MAP_FAILED || slots == MAP_FAILED )
+			throw std::runtime_error( "io_uring buffers: " + std::string(strerror(errno)) );
+
+		memset( &reg, 0, sizeof(reg) );
+		reg.ring_addr = reinterpret_cast<uint64_t>( bufRing );
+		reg.ring_entries = URING_BUF_SLOTS;
+		reg.bgid = URING_BUF_GROUP;
+		if( syscall( __NR_io_uring_register, ringfd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 )
+			throw std::runtime_error( "io_uring buffer ring: " + std::string(strerror(errno)) );
+
+		for( uint16_t i = 0 ; i < URING_BUF_SLOTS ; i++ )
+			recycle( i );
+		__atomic_store_n( &bufRing->tail, bufTail, __ATOMIC_RELEASE );
+	}
+
+	/** Submits the multishot recv on the socket. */
+	void armRecv() throw( std::runtime_error )
+	{
+		unsigned tail = *sqTail;
+		unsigned idx = tail & *sqMask;
+		struct io_uring_sqe &sqe = sqes[idx];
+
+		memset( &sqe, 0, sizeof(sqe) );
+		sqe.opcode = IORING_OP_RECV;
+		sqe.fd = sockfd;
+		sqe.ioprio = IORING_RECV_MULTISHOT;
+		sqe.flags = IOSQE_BUFFER_SELECT;
+		sqe.buf_group = URING_BUF_GROUP;
+		sqArray[idx] = idx;
+		__atomic_store_n( sqTail, tail + 1, __ATOMIC_RELEASE );
+		if( enter( 1, 0, 0, NULL, 0 ) < 0 )
+			throw std::runtime_error( "io_uring_enter: " + std::string(strerror(errno)) );
+	}
+
+	/** Gives the slot back to the kernel (visible after the tail is published). */
+	void recycle( uint16_t bid )
+	{
+		// Not bufRing->bufs[], in C++ the flexible array of the kernel
+		// header is placed after an empty struct that isn't zero sized.
+		struct io_uring_buf &buf = reinterpret_cast<struct io_uring_buf*>( bufRing )
+			[bufTail & (URING_BUF_SLOTS - 1)];
+
+		buf.addr = reinterpret_cast<uint64_t>( &slots[bid] );
+		buf.len = sizeof(ARPFrame);
+		buf.bid = bid;
+		bufTail++;
+	}
+
+	URingReceiver( const URingReceiver& );
+	URingReceiver& operator = ( const URingReceiver& );
+};
+
+#endif